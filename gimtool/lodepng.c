@@ -37,6 +37,20 @@ Rename this file to lodepng.cpp to use it for C++, or to lodepng.c to use it for
 #include <fstream>
 #endif /*LODEPNG_COMPILE_CPP*/
 
+/*the SIMD functions are compiled with target attributes and selected with __builtin_cpu_supports*/
+#if defined(LODEPNG_COMPILE_X86_SIMD) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LODEPNG_X86_SIMD
+#include <immintrin.h>
+#endif
+
+#ifdef LODEPNG_COMPILE_THREADS
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+#endif /*LODEPNG_COMPILE_THREADS*/
+
 #if defined(_MSC_VER) && (_MSC_VER >= 1310) /*Visual Studio: A few warning types are not desired here.*/
 #pragma warning( disable : 4244 ) /*implicit conversions: not warned by gcc -Wall -Wextra and requires too much casts*/
 #pragma warning( disable : 4996 ) /*VS does not like fopen, but fopen_s is not standard C so unusable here*/
@@ -408,6 +422,98 @@ unsigned lodepng_save_file(const unsigned char* buffer, size_t buffersize, const
 
 #endif /*LODEPNG_COMPILE_DISK*/
 
+#ifdef LODEPNG_COMPILE_ENCODER
+/*
+The encoder can split work in parts that don't depend on each other, such as blocks of
+deflate data or bands of scanlines, and run them on multiple threads.
+*/
+typedef void ParallelFunction(void* context);
+
+typedef struct ParallelTask
+{
+  ParallelFunction* function;
+  void* context;
+  unsigned started; /*whether it runs on its own thread*/
+#ifdef LODEPNG_COMPILE_THREADS
+#ifdef _WIN32
+  HANDLE thread;
+#else /*_WIN32*/
+  pthread_t thread;
+#endif /*_WIN32*/
+#endif /*LODEPNG_COMPILE_THREADS*/
+} ParallelTask;
+
+#ifdef LODEPNG_COMPILE_THREADS
+#ifdef _WIN32
+static DWORD WINAPI parallelThread(LPVOID task)
+{
+  ((ParallelTask*)task)->function(((ParallelTask*)task)->context);
+  return 0;
+}
+#else /*_WIN32*/
+static void* parallelThread(void* task)
+{
+  ((ParallelTask*)task)->function(((ParallelTask*)task)->context);
+  return 0;
+}
+#endif /*_WIN32*/
+#endif /*LODEPNG_COMPILE_THREADS*/
+
+/*
+Calls function for each of the count contexts, which are contextsize bytes apart, each on its own
+thread. The calling thread does the first one, and those whose thread couldn't be started.
+*/
+static void runParallel(ParallelFunction* function, void* contexts, size_t contextsize, unsigned count)
+{
+  unsigned i;
+  ParallelTask* tasks = (ParallelTask*)lodepng_malloc(sizeof(ParallelTask) * count);
+  if(!tasks)
+  {
+    for(i = 0; i != count; ++i) function((unsigned char*)contexts + i * contextsize);
+    return;
+  }
+
+  for(i = 0; i != count; ++i)
+  {
+    tasks[i].function = function;
+    tasks[i].context = (unsigned char*)contexts + i * contextsize;
+    tasks[i].started = 0;
+  }
+
+#ifdef LODEPNG_COMPILE_THREADS
+  for(i = 1; i < count; ++i)
+  {
+#ifdef _WIN32
+    tasks[i].thread = CreateThread(NULL, 0, parallelThread, &tasks[i], 0, NULL);
+    tasks[i].started = tasks[i].thread != NULL;
+#else /*_WIN32*/
+    tasks[i].started = pthread_create(&tasks[i].thread, NULL, parallelThread, &tasks[i]) == 0;
+#endif /*_WIN32*/
+  }
+#endif /*LODEPNG_COMPILE_THREADS*/
+
+  for(i = 0; i != count; ++i)
+  {
+    if(!tasks[i].started) function(tasks[i].context);
+  }
+
+#ifdef LODEPNG_COMPILE_THREADS
+  for(i = 1; i < count; ++i)
+  {
+    if(!tasks[i].started) continue;
+#ifdef _WIN32
+    WaitForSingleObject(tasks[i].thread, INFINITE);
+    CloseHandle(tasks[i].thread);
+#else /*_WIN32*/
+    pthread_join(tasks[i].thread, NULL);
+#endif /*_WIN32*/
+  }
+#endif /*LODEPNG_COMPILE_THREADS*/
+
+  lodepng_free(tasks);
+}
+#endif /*LODEPNG_COMPILE_ENCODER*/
+
 /* ////////////////////////////////////////////////////////////////////////// */
 /* ////////////////////////////////////////////////////////////////////////// */
 /* // End of common code and tools. Begin of Zlib related code.            // */
@@ -441,23 +547,71 @@ static void addBitsToStreamReversed(size_t* bitpointer, ucvector* bitstream, uns
 
 #ifdef LODEPNG_COMPILE_DECODER
 
-#define READBIT(bitpointer, bitstream) ((bitstream[bitpointer >> 3] >> (bitpointer & 0x7)) & (unsigned char)1)
+typedef struct LodePNGBitReader
+{
+  const unsigned char* data;
+  size_t size; /*size of data in bytes*/
+  size_t bitsize; /*size of data in bits, bp can go past it when reading the zeroes after the end*/
+  size_t bp; /*current bit position, the current byte is bp >> 3, the current bit is bp & 0x7 (from lsb to msb of the byte)*/
+  size_t buffer; /*the bits from bp on, the first one is the lsb*/
+} LodePNGBitReader;
 
-static unsigned char readBitFromStream(size_t* bitpointer, const unsigned char* bitstream)
+static void LodePNGBitReader_init(LodePNGBitReader* reader, const unsigned char* data, size_t size)
 {
-  unsigned char result = (unsigned char)(READBIT(*bitpointer, bitstream));
-  ++(*bitpointer);
-  return result;
+  reader->data = data;
+  reader->size = size;
+  reader->bitsize = size * 8;
+  reader->bp = 0;
+  reader->buffer = 0;
 }
 
-static unsigned readBitsFromStream(size_t* bitpointer, const unsigned char* bitstream, size_t nbits)
+/*
+Refills the buffer from bp. Afterwards all of its bits, 64 or 32 depending on size_t, can be peeked
+and read, as long as no more than that are read before the next call. Past the end of the data they're zeroes.
+*/
+static void ensureBits(LodePNGBitReader* reader)
 {
-  unsigned result = 0, i;
-  for(i = 0; i != nbits; ++i)
+  size_t start = reader->bp >> 3;
+  unsigned shift = (unsigned)(reader->bp & 0x7);
+  const unsigned char* p = reader->data + start;
+  if(start + sizeof(size_t) < reader->size)
   {
-    result += ((unsigned)READBIT(*bitpointer, bitstream)) << i;
-    ++(*bitpointer);
+    /*compilers turn this into a single load on little endian CPUs*/
+    size_t buffer = (size_t)p[0] | ((size_t)p[1] << 8) | ((size_t)p[2] << 16) | ((size_t)p[3] << 24);
+    if(sizeof(size_t) >= 8)
+    {
+      size_t high = (size_t)p[4] | ((size_t)p[5] << 8) | ((size_t)p[6] << 16) | ((size_t)p[7] << 24);
+      buffer |= (high << 16) << 16; /*two shifts, so that 32-bit size_t doesn't shift by its width*/
+    }
+    reader->buffer = buffer >> shift;
+    /*a 32-bit buffer gets the bits the shift left out from the next byte*/
+    if(sizeof(size_t) < 8 && shift) reader->buffer |= (size_t)p[4] << (32 - shift);
   }
+  else
+  {
+    size_t i;
+    reader->buffer = 0;
+    for(i = 0; start + i < reader->size && i != sizeof(size_t); ++i) reader->buffer |= (size_t)p[i] << (8 * i);
+    reader->buffer >>= shift;
+  }
+}
+
+/*get the next nbits bits without advancing, nbits must be at most 31*/
+static unsigned peekBits(const LodePNGBitReader* reader, size_t nbits)
+{
+  return (unsigned)reader->buffer & ((1u << nbits) - 1u);
+}
+
+static void advanceBits(LodePNGBitReader* reader, size_t nbits)
+{
+  reader->buffer >>= nbits;
+  reader->bp += nbits;
+}
+
+static unsigned readBits(LodePNGBitReader* reader, size_t nbits)
+{
+  unsigned result = peekBits(reader, nbits);
+  advanceBits(reader, nbits);
   return result;
 }
 #endif /*LODEPNG_COMPILE_DECODER*/
@@ -502,12 +656,25 @@ static const unsigned CLCL_ORDER[NUM_CODE_LENGTH_CODES]
 
 /* ////////////////////////////////////////////////////////////////////////// */
 
+/*the number of bits the decoder looks up at once in the first table, longer codes continue in a second table*/
+#define FIRSTBITS 9u
+
+/*value in the decoding tables for bit patterns that aren't a code in an incomplete tree*/
+#define INVALIDSYMBOL 65535u
+
 /*
 Huffman tree struct, containing multiple representations of the tree
 */
 typedef struct HuffmanTree
 {
-  unsigned* tree2d;
+  /*
+  the decoding tables, indexed by the next bits of the stream in the order they're read.
+  The first 2^FIRSTBITS entries are the first table. table_len is the code length, or if
+  larger than FIRSTBITS, the longest length of codes starting with these bits, with
+  table_value being the offset of their second table of 2^(table_len - FIRSTBITS) entries
+  */
+  unsigned char* table_len;
+  unsigned short* table_value;
   unsigned* tree1d;
   unsigned* lengths; /*the lengths of the codes of the 1d-tree*/
   unsigned maxbitlen; /*maximum number of bits a single code can get*/
@@ -529,74 +696,119 @@ static void HuffmanTree_draw(HuffmanTree* tree)
 
 static void HuffmanTree_init(HuffmanTree* tree)
 {
-  tree->tree2d = 0;
+  tree->table_len = 0;
+  tree->table_value = 0;
   tree->tree1d = 0;
   tree->lengths = 0;
 }
 
 static void HuffmanTree_cleanup(HuffmanTree* tree)
 {
-  lodepng_free(tree->tree2d);
+  lodepng_free(tree->table_len);
+  lodepng_free(tree->table_value);
   lodepng_free(tree->tree1d);
   lodepng_free(tree->lengths);
 }
 
-/*the tree representation used by the decoder. return value is error*/
-static unsigned HuffmanTree_make2DTree(HuffmanTree* tree)
+static unsigned reverseBits(unsigned bits, unsigned num)
 {
-  unsigned nodefilled = 0; /*up to which node it is filled*/
-  unsigned treepos = 0; /*position in the tree (1 of the numcodes columns)*/
-  unsigned n, i;
+  unsigned i, result = 0;
+  for(i = 0; i != num; ++i) result |= ((bits >> (num - i - 1)) & 1u) << i;
+  return result;
+}
 
-  tree->tree2d = (unsigned*)lodepng_malloc(tree->numcodes * 2 * sizeof(unsigned));
-  if(!tree->tree2d) return 83; /*alloc fail*/
+/*the lookup tables used by the decoder. return value is error*/
+static unsigned HuffmanTree_makeTable(HuffmanTree* tree)
+{
+  static const unsigned headsize = 1u << FIRSTBITS; /*size of the first table*/
+  static const unsigned mask = (1u << FIRSTBITS) - 1u;
+  unsigned maxlens[1u << FIRSTBITS];
+  size_t i, pointer, size; /*size is the total of the first and all second tables*/
 
-  /*
-  convert tree1d[] to tree2d[][]. In the 2D array, a value of 32767 means
-  uninited, a value >= numcodes is an address to another bit, a value < numcodes
-  is a code. The 2 rows are the 2 possible bit values (0 or 1), there are as
-  many columns as codes - 1.
-  A good huffmann tree has N * 2 - 1 nodes, of which N - 1 are internal nodes.
-  Here, the internal nodes are stored (what their 0 and 1 option point to).
-  There is only memory for such good tree currently, if there are more nodes
-  (due to too long length codes), error 55 will happen
-  */
-  for(n = 0; n < tree->numcodes * 2; ++n)
+  /*for each first table entry, the longest code starting with its bits, this sizes its second table*/
+  for(i = 0; i != headsize; ++i) maxlens[i] = 0;
+  for(i = 0; i != tree->numcodes; ++i)
   {
-    tree->tree2d[n] = 32767; /*32767 here means the tree2d isn't filled there yet*/
+    unsigned l = tree->lengths[i];
+    unsigned index;
+    if(l <= FIRSTBITS) continue;
+    /*codes are stored MSB first, but the bits are read LSB first, so the first table index is reversed*/
+    index = reverseBits(tree->tree1d[i] >> (l - FIRSTBITS), FIRSTBITS);
+    if(maxlens[index] < l) maxlens[index] = l;
   }
 
-  for(n = 0; n < tree->numcodes; ++n) /*the codes*/
+  size = headsize;
+  for(i = 0; i != headsize; ++i)
   {
-    for(i = 0; i != tree->lengths[n]; ++i) /*the bits for this code*/
+    if(maxlens[i] > FIRSTBITS) size += 1u << (maxlens[i] - FIRSTBITS);
+  }
+
+  tree->table_len = (unsigned char*)lodepng_malloc(size * sizeof(unsigned char));
+  tree->table_value = (unsigned short*)lodepng_malloc(size * sizeof(unsigned short));
+  if(!tree->table_len || !tree->table_value) return 83; /*alloc fail, the tables are freed by HuffmanTree_cleanup*/
+
+  /*16 is longer than any code, it marks entries that aren't filled in yet*/
+  for(i = 0; i != size; ++i) tree->table_len[i] = 16;
+
+  /*first table entries of long codes point to their second table*/
+  pointer = headsize;
+  for(i = 0; i != headsize; ++i)
+  {
+    if(maxlens[i] <= FIRSTBITS) continue;
+    tree->table_len[i] = (unsigned char)maxlens[i];
+    tree->table_value[i] = (unsigned short)pointer;
+    pointer += 1u << (maxlens[i] - FIRSTBITS);
+  }
+
+  for(i = 0; i != tree->numcodes; ++i)
+  {
+    unsigned l = tree->lengths[i];
+    unsigned reverse, j, num;
+    if(l == 0) continue;
+    reverse = reverseBits(tree->tree1d[i], l);
+
+    if(l <= FIRSTBITS)
     {
-      unsigned char bit = (unsigned char)((tree->tree1d[n] >> (tree->lengths[n] - i - 1)) & 1);
-      /*oversubscribed, see comment in lodepng_error_text*/
-      if(treepos > 2147483647 || treepos + 2 > tree->numcodes) return 55;
-      if(tree->tree2d[2 * treepos + bit] == 32767) /*not yet filled in*/
+      /*the code is repeated for every value of the bits after it*/
+      num = 1u << (FIRSTBITS - l);
+      for(j = 0; j != num; ++j)
       {
-        if(i + 1 == tree->lengths[n]) /*last bit*/
-        {
-          tree->tree2d[2 * treepos + bit] = n; /*put the current code in it*/
-          treepos = 0;
-        }
-        else
-        {
-          /*put address of the next step in here, first that address has to be found of course
-          (it's just nodefilled + 1)...*/
-          ++nodefilled;
-          /*addresses encoded with numcodes added to it*/
-          tree->tree2d[2 * treepos + bit] = nodefilled + tree->numcodes;
-          treepos = nodefilled;
-        }
+        unsigned index = reverse | (j << l);
+        /*oversubscribed, see comment in lodepng_error_text*/
+        if(tree->table_len[index] != 16) return 55;
+        tree->table_len[index] = (unsigned char)l;
+        tree->table_value[index] = (unsigned short)i;
+      }
+    }
+    else
+    {
+      unsigned index = reverse & mask;
+      unsigned maxlen = tree->table_len[index];
+      unsigned start = tree->table_value[index];
+      /*a shorter code already uses these first bits*/
+      if(maxlen < l) return 55;
+      num = 1u << (maxlen - l);
+      for(j = 0; j != num; ++j)
+      {
+        unsigned index2 = start + ((reverse >> FIRSTBITS) | (j << (l - FIRSTBITS)));
+        if(tree->table_len[index2] != 16) return 55;
+        tree->table_len[index2] = (unsigned char)l;
+        tree->table_value[index2] = (unsigned short)i;
       }
-      else treepos = tree->tree2d[2 * treepos + bit] - tree->numcodes;
     }
   }
 
-  for(n = 0; n < tree->numcodes * 2; ++n)
+  /*
+  Bit patterns that aren't a code remain in incomplete trees, e.g. a tree with only
+  one code, or a distance tree of a block without distances. Decoding them gives
+  INVALIDSYMBOL. The length is chosen so the decoder consumes at least one bit, and
+  in a second table more than FIRSTBITS
+  */
+  for(i = 0; i != size; ++i)
   {
-    if(tree->tree2d[n] == 32767) tree->tree2d[n] = 0; /*remove possible remaining 32767's*/
+    if(tree->table_len[i] != 16) continue;
+    tree->table_len[i] = (unsigned char)(i < headsize ? 1 : FIRSTBITS + 1);
+    tree->table_value[i] = (unsigned short)INVALIDSYMBOL;
   }
 
   return 0;
@@ -643,7 +855,7 @@ static unsigned HuffmanTree_makeFromLengths2(HuffmanTree* tree)
   uivector_cleanup(&blcount);
   uivector_cleanup(&nextcode);
 
-  if(!error) return HuffmanTree_make2DTree(tree);
+  if(!error) return HuffmanTree_makeTable(tree);
   else return error;
 }
 
@@ -920,26 +1132,27 @@ static unsigned generateFixedDistanceTree(HuffmanTree* tree)
 #ifdef LODEPNG_COMPILE_DECODER
 
 /*
-returns the code, or (unsigned)(-1) if error happened
-inbitlength is the length of the complete buffer, in bits (so its byte length times 8)
+returns the code, or INVALIDSYMBOL for bits that aren't a code of the tree.
+Uses at most 15 bits of the reader's buffer. Reading past the end of the data
+isn't an error here, the caller checks reader->bp against reader->bitsize
 */
-static unsigned huffmanDecodeSymbol(const unsigned char* in, size_t* bp,
-                                    const HuffmanTree* codetree, size_t inbitlength)
+static unsigned huffmanDecodeSymbol(LodePNGBitReader* reader, const HuffmanTree* codetree)
 {
-  unsigned treepos = 0, ct;
-  for(;;)
+  unsigned index = peekBits(reader, FIRSTBITS);
+  unsigned l = codetree->table_len[index];
+  unsigned value = codetree->table_value[index];
+  if(l <= FIRSTBITS)
   {
-    if(*bp >= inbitlength) return (unsigned)(-1); /*error: end of input memory reached without endcode*/
-    /*
-    decode the symbol from the tree. The "readBitFromStream" code is inlined in
-    the expression below because this is the biggest bottleneck while decoding
-    */
-    ct = codetree->tree2d[(treepos << 1) + READBIT(*bp, in)];
-    ++(*bp);
-    if(ct < codetree->numcodes) return ct; /*the symbol is decoded, return it*/
-    else treepos = ct - codetree->numcodes; /*symbol not yet decoded, instead move tree position*/
-
-    if(treepos >= codetree->numcodes) return (unsigned)(-1); /*error: it appeared outside the codetree*/
+    advanceBits(reader, l);
+    return value;
+  }
+  else
+  {
+    /*long code: value is where its second table starts, indexed by the bits after the first FIRSTBITS*/
+    advanceBits(reader, FIRSTBITS);
+    index = value + peekBits(reader, l - FIRSTBITS);
+    advanceBits(reader, codetree->table_len[index] - FIRSTBITS);
+    return codetree->table_value[index];
   }
 }
 #endif /*LODEPNG_COMPILE_DECODER*/
@@ -951,21 +1164,20 @@ static unsigned huffmanDecodeSymbol(const unsigned char* in, size_t* bp,
 /* ////////////////////////////////////////////////////////////////////////// */
 
 /*get the tree of a deflated block with fixed tree, as specified in the deflate specification*/
-static void getTreeInflateFixed(HuffmanTree* tree_ll, HuffmanTree* tree_d)
+static unsigned getTreeInflateFixed(HuffmanTree* tree_ll, HuffmanTree* tree_d)
 {
-  /*TODO: check for out of memory errors*/
-  generateFixedLitLenTree(tree_ll);
-  generateFixedDistanceTree(tree_d);
+  unsigned error = generateFixedLitLenTree(tree_ll);
+  if(error) return error;
+  return generateFixedDistanceTree(tree_d);
 }
 
 /*get the tree of a deflated block with dynamic tree, the tree itself is also Huffman compressed with a known tree*/
 static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
-                                      const unsigned char* in, size_t* bp, size_t inlength)
+                                      LodePNGBitReader* reader)
 {
   /*make sure that length values that aren't filled in will be 0, or a wrong tree will be generated*/
   unsigned error = 0;
   unsigned n, HLIT, HDIST, HCLEN, i;
-  size_t inbitlength = inlength * 8;
 
   /*see comments in deflateDynamic for explanation of the context and these variables, it is analogous*/
   unsigned* bitlen_ll = 0; /*lit,len code lengths*/
@@ -974,16 +1186,17 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
   unsigned* bitlen_cl = 0;
   HuffmanTree tree_cl; /*the code tree for code length codes (the huffman tree for compressed huffman trees)*/
 
-  if((*bp) + 14 > (inlength << 3)) return 49; /*error: the bit pointer is or will go past the memory*/
+  if(reader->bp + 14 > reader->bitsize) return 49; /*error: the bit pointer is or will go past the memory*/
 
+  ensureBits(reader);
   /*number of literal/length codes + 257. Unlike the spec, the value 257 is added to it here already*/
-  HLIT =  readBitsFromStream(bp, in, 5) + 257;
+  HLIT =  readBits(reader, 5) + 257;
   /*number of distance codes. Unlike the spec, the value 1 is added to it here already*/
-  HDIST = readBitsFromStream(bp, in, 5) + 1;
+  HDIST = readBits(reader, 5) + 1;
   /*number of code length codes. Unlike the spec, the value 4 is added to it here already*/
-  HCLEN = readBitsFromStream(bp, in, 4) + 4;
+  HCLEN = readBits(reader, 4) + 4;
 
-  if((*bp) + HCLEN * 3 > (inlength << 3)) return 50; /*error: the bit pointer is or will go past the memory*/
+  if(reader->bp + HCLEN * 3 > reader->bitsize) return 50; /*error: the bit pointer is or will go past the memory*/
 
   HuffmanTree_init(&tree_cl);
 
@@ -996,7 +1209,9 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
 
     for(i = 0; i != NUM_CODE_LENGTH_CODES; ++i)
     {
-      if(i < HCLEN) bitlen_cl[CLCL_ORDER[i]] = readBitsFromStream(bp, in, 3);
+      /*at most 19 * 3 bits, refilled every 8 codes for 32-bit buffers*/
+      if(i % 8 == 0) ensureBits(reader);
+      if(i < HCLEN) bitlen_cl[CLCL_ORDER[i]] = readBits(reader, 3);
       else bitlen_cl[CLCL_ORDER[i]] = 0; /*if not, it must stay 0*/
     }
 
@@ -1014,7 +1229,10 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
     i = 0;
     while(i < HLIT + HDIST)
     {
-      unsigned code = huffmanDecodeSymbol(in, bp, &tree_cl, inbitlength);
+      unsigned code;
+      ensureBits(reader); /*the code and its extra bits are at most 7 + 7 bits*/
+      code = huffmanDecodeSymbol(reader, &tree_cl);
+      if(reader->bp > reader->bitsize) ERROR_BREAK(10); /*error: end of input memory reached without endcode*/
       if(code <= 15) /*a length code*/
       {
         if(i < HLIT) bitlen_ll[i] = code;
@@ -1028,8 +1246,8 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
 
         if (i == 0) ERROR_BREAK(54); /*can't repeat previous if i is 0*/
 
-        if((*bp + 2) > inbitlength) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
-        replength += readBitsFromStream(bp, in, 2);
+        if(reader->bp + 2 > reader->bitsize) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
+        replength += readBits(reader, 2);
 
         if(i < HLIT + 1) value = bitlen_ll[i - 1];
         else value = bitlen_d[i - HLIT - 1];
@@ -1045,8 +1263,8 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
       else if(code == 17) /*repeat "0" 3-10 times*/
       {
         unsigned replength = 3; /*read in the bits that indicate repeat length*/
-        if((*bp + 3) > inbitlength) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
-        replength += readBitsFromStream(bp, in, 3);
+        if(reader->bp + 3 > reader->bitsize) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
+        replength += readBits(reader, 3);
 
         /*repeat this value in the next lengths*/
         for(n = 0; n < replength; ++n)
@@ -1061,8 +1279,8 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
       else if(code == 18) /*repeat "0" 11-138 times*/
       {
         unsigned replength = 11; /*read in the bits that indicate repeat length*/
-        if((*bp + 7) > inbitlength) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
-        replength += readBitsFromStream(bp, in, 7);
+        if(reader->bp + 7 > reader->bitsize) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
+        replength += readBits(reader, 7);
 
         /*repeat this value in the next lengths*/
         for(n = 0; n < replength; ++n)
@@ -1074,14 +1292,9 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
           ++i;
         }
       }
-      else /*if(code == (unsigned)(-1))*/ /*huffmanDecodeSymbol returns (unsigned)(-1) in case of error*/
+      else /*if(code == INVALIDSYMBOL)*/
       {
-        if(code == (unsigned)(-1))
-        {
-          /*return error code 10 or 11 depending on the situation that happened in huffmanDecodeSymbol
-          (10=no endcode, 11=wrong jump outside of tree)*/
-          error = (*bp) > inbitlength ? 10 : 11;
-        }
+        if(code == INVALIDSYMBOL) error = 11; /*error: bits that aren't a code of the tree*/
         else error = 16; /*unexisting code, this can never happen*/
         break;
       }
@@ -1107,24 +1320,28 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
 }
 
 /*inflate a block with dynamic of fixed Huffman tree*/
-static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size_t* bp,
-                                    size_t* pos, size_t inlength, unsigned btype)
+static unsigned inflateHuffmanBlock(ucvector* out, LodePNGBitReader* reader,
+                                    size_t* pos, unsigned btype)
 {
   unsigned error = 0;
   HuffmanTree tree_ll; /*the huffman tree for literal and length codes*/
   HuffmanTree tree_d; /*the huffman tree for distance codes*/
-  size_t inbitlength = inlength * 8;
 
   HuffmanTree_init(&tree_ll);
   HuffmanTree_init(&tree_d);
 
-  if(btype == 1) getTreeInflateFixed(&tree_ll, &tree_d);
-  else if(btype == 2) error = getTreeInflateDynamic(&tree_ll, &tree_d, in, bp, inlength);
+  if(btype == 1) error = getTreeInflateFixed(&tree_ll, &tree_d);
+  else if(btype == 2) error = getTreeInflateDynamic(&tree_ll, &tree_d, reader);
 
   while(!error) /*decode all symbols until end reached, breaks at end code*/
   {
     /*code_ll is literal, length or end code*/
-    unsigned code_ll = huffmanDecodeSymbol(in, bp, &tree_ll, inbitlength);
+    unsigned code_ll;
+    /*one refill covers a length and distance with their extra bits, at most 15 + 5 + 15 + 13 bits,
+    with 32-bit buffers there's another before the distance*/
+    ensureBits(reader);
+    code_ll = huffmanDecodeSymbol(reader, &tree_ll);
+    if(reader->bp > reader->bitsize) ERROR_BREAK(10); /*error: end of input memory reached without endcode*/
     if(code_ll <= 255) /*literal symbol*/
     {
       /*ucvector_push_back would do the same, but for some reason the two lines below run 10% faster*/
@@ -1143,19 +1360,14 @@ static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size
 
       /*part 2: get extra bits and add the value of that to length*/
       numextrabits_l = LENGTHEXTRA[code_ll - FIRST_LENGTH_CODE_INDEX];
-      if((*bp + numextrabits_l) > inbitlength) ERROR_BREAK(51); /*error, bit pointer will jump past memory*/
-      length += readBitsFromStream(bp, in, numextrabits_l);
+      length += readBits(reader, numextrabits_l);
 
       /*part 3: get distance code*/
-      code_d = huffmanDecodeSymbol(in, bp, &tree_d, inbitlength);
+      if(sizeof(size_t) < 8) ensureBits(reader);
+      code_d = huffmanDecodeSymbol(reader, &tree_d);
       if(code_d > 29)
       {
-        if(code_ll == (unsigned)(-1)) /*huffmanDecodeSymbol returns (unsigned)(-1) in case of error*/
-        {
-          /*return error code 10 or 11 depending on the situation that happened in huffmanDecodeSymbol
-          (10=no endcode, 11=wrong jump outside of tree)*/
-          error = (*bp) > inlength * 8 ? 10 : 11;
-        }
+        if(code_d == INVALIDSYMBOL) error = 11; /*error: bits that aren't a code of the tree*/
         else error = 18; /*error: invalid distance code (30-31 are never used)*/
         break;
       }
@@ -1163,8 +1375,8 @@ static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size
 
       /*part 4: get extra bits from distance*/
       numextrabits_d = DISTANCEEXTRA[code_d];
-      if((*bp + numextrabits_d) > inbitlength) ERROR_BREAK(51); /*error, bit pointer will jump past memory*/
-      distance += readBitsFromStream(bp, in, numextrabits_d);
+      distance += readBits(reader, numextrabits_d);
+      if(reader->bp > reader->bitsize) ERROR_BREAK(51); /*error, bit pointer jumped past memory*/
 
       /*part 5: fill in all the out[n] values based on the length and dist*/
       start = (*pos);
@@ -1184,11 +1396,9 @@ static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size
     {
       break; /*end code, break the loop*/
     }
-    else /*if(code == (unsigned)(-1))*/ /*huffmanDecodeSymbol returns (unsigned)(-1) in case of error*/
+    else /*if(code_ll == INVALIDSYMBOL)*/
     {
-      /*return error code 10 or 11 depending on the situation that happened in huffmanDecodeSymbol
-      (10=no endcode, 11=wrong jump outside of tree)*/
-      error = ((*bp) > inlength * 8) ? 10 : 11;
+      error = 11; /*error: bits that aren't a code of the tree, or the unused codes 286-287*/
       break;
     }
   }
@@ -1199,14 +1409,15 @@ static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size
   return error;
 }
 
-static unsigned inflateNoCompression(ucvector* out, const unsigned char* in, size_t* bp, size_t* pos, size_t inlength)
+static unsigned inflateNoCompression(ucvector* out, LodePNGBitReader* reader, size_t* pos)
 {
   size_t p;
+  const unsigned char* in = reader->data;
+  size_t inlength = reader->size;
   unsigned LEN, NLEN, n, error = 0;
 
   /*go to first boundary of byte*/
-  while(((*bp) & 0x7) != 0) ++(*bp);
-  p = (*bp) / 8; /*byte position*/
+  p = (reader->bp + 7) >> 3; /*byte position*/
 
   /*read LEN (2 bytes) and NLEN (2 bytes)*/
   if(p + 4 >= inlength) return 52; /*error, bit pointer will jump past memory*/
@@ -1222,7 +1433,7 @@ static unsigned inflateNoCompression(ucvector* out, const unsigned char* in, siz
   if(p + LEN > inlength) return 23; /*error: reading outside of in buffer*/
   for(n = 0; n < LEN; ++n) out->data[(*pos)++] = in[p++];
 
-  (*bp) = p * 8;
+  reader->bp = p * 8;
 
   return error;
 }
@@ -1231,25 +1442,26 @@ static unsigned lodepng_inflatev(ucvector* out,
                                  const unsigned char* in, size_t insize,
                                  const LodePNGDecompressSettings* settings)
 {
-  /*bit pointer in the "in" data, current byte is bp >> 3, current bit is bp & 0x7 (from lsb to msb of the byte)*/
-  size_t bp = 0;
+  LodePNGBitReader reader;
   unsigned BFINAL = 0;
   size_t pos = 0; /*byte position in the out buffer*/
   unsigned error = 0;
 
   (void)settings;
 
+  LodePNGBitReader_init(&reader, in, insize);
+
   while(!BFINAL)
   {
     unsigned BTYPE;
-    if(bp + 2 >= insize * 8) return 52; /*error, bit pointer will jump past memory*/
-    BFINAL = readBitFromStream(&bp, in);
-    BTYPE = 1u * readBitFromStream(&bp, in);
-    BTYPE += 2u * readBitFromStream(&bp, in);
+    if(reader.bp + 2 >= reader.bitsize) return 52; /*error, bit pointer will jump past memory*/
+    ensureBits(&reader);
+    BFINAL = readBits(&reader, 1);
+    BTYPE = readBits(&reader, 2);
 
     if(BTYPE == 3) return 20; /*error: invalid BTYPE*/
-    else if(BTYPE == 0) error = inflateNoCompression(out, in, &bp, &pos, insize); /*no compression*/
-    else error = inflateHuffmanBlock(out, in, &bp, &pos, insize, BTYPE); /*compression, BTYPE 01 or 10*/
+    else if(BTYPE == 0) error = inflateNoCompression(out, &reader, &pos); /*no compression*/
+    else error = inflateHuffmanBlock(out, &reader, &pos, BTYPE); /*compression, BTYPE 01 or 10*/
 
     if(error) return error;
   }
@@ -1340,48 +1552,47 @@ static void addLengthDistance(uivector* values, size_t length, size_t distance)
   uivector_push_back(values, extra_distance);
 }
 
-/*3 bytes of data get encoded into two bytes. The hash cannot use more than 3
-bytes as input because 3 is the minimum match length for deflate*/
-static const unsigned HASH_NUM_VALUES = 65536;
-static const unsigned HASH_BIT_MASK = 65535; /*HASH_NUM_VALUES - 1, but C90 does not like that as initializer*/
+/*
+The hash chains link positions with the same 4 bytes, hashed into HASH_BITS bits. 4 bytes spread
+PNG data, which is dominated by zeroes due to the filters, much better over the chains than the 3
+bytes of the minimum match. Matches of 3 bytes are looked up separately, only at the last
+position with the same 3 bytes.
+*/
+#define HASH_BITS 16u
+#define HASH_NUM_VALUES (1u << HASH_BITS)
+#define HASH_MIN_LENGTH 4u
+#define HASH3_BITS 15u
+#define HASH3_NUM_VALUES (1u << HASH3_BITS)
+/*head value for hash values that didn't occur yet*/
+#define HASH_NO_POS ((unsigned)(-1))
 
 typedef struct Hash
 {
-  int* head; /*hash value to head circular pos - can be outdated if went around window*/
-  /*circular pos to prev circular pos*/
-  unsigned short* chain;
-  int* val; /*circular pos to hash value*/
-
-  /*TODO: do this not only for zeros but for any repeated byte. However for PNG
-  it's always going to be the zeros that dominate, so not important for PNG*/
-  int* headz; /*similar to head, but for chainz*/
-  unsigned short* chainz; /*those with same amount of zeros*/
-  unsigned short* zeros; /*length of zeros streak, used as a second hash chain*/
+  unsigned* head; /*hash value to the last position it occurred at, or HASH_NO_POS*/
+  unsigned* chain; /*circular pos to the previous position with the same hash value*/
+  unsigned* head3; /*hash value of 3 bytes to the last position they occurred at, or HASH_NO_POS*/
 } Hash;
 
-static unsigned hash_init(Hash* hash, unsigned windowsize)
+/*forget all positions. chain entries are only read after being written*/
+static void hash_clear(Hash* hash)
 {
   unsigned i;
-  hash->head = (int*)lodepng_malloc(sizeof(int) * HASH_NUM_VALUES);
-  hash->val = (int*)lodepng_malloc(sizeof(int) * windowsize);
-  hash->chain = (unsigned short*)lodepng_malloc(sizeof(unsigned short) * windowsize);
+  for(i = 0; i != HASH_NUM_VALUES; ++i) hash->head[i] = HASH_NO_POS;
+  for(i = 0; i != HASH3_NUM_VALUES; ++i) hash->head3[i] = HASH_NO_POS;
+}
 
-  hash->zeros = (unsigned short*)lodepng_malloc(sizeof(unsigned short) * windowsize);
-  hash->headz = (int*)lodepng_malloc(sizeof(int) * (MAX_SUPPORTED_DEFLATE_LENGTH + 1));
-  hash->chainz = (unsigned short*)lodepng_malloc(sizeof(unsigned short) * windowsize);
+static unsigned hash_init(Hash* hash, unsigned windowsize)
+{
+  hash->head = (unsigned*)lodepng_malloc(sizeof(unsigned) * HASH_NUM_VALUES);
+  hash->chain = (unsigned*)lodepng_malloc(sizeof(unsigned) * windowsize);
+  hash->head3 = (unsigned*)lodepng_malloc(sizeof(unsigned) * HASH3_NUM_VALUES);
 
-  if(!hash->head || !hash->chain || !hash->val  || !hash->headz|| !hash->chainz || !hash->zeros)
+  if(!hash->head || !hash->chain || !hash->head3)
   {
     return 83; /*alloc fail*/
   }
 
-  /*initialize hash table*/
-  for(i = 0; i != HASH_NUM_VALUES; ++i) hash->head[i] = -1;
-  for(i = 0; i != windowsize; ++i) hash->val[i] = -1;
-  for(i = 0; i != windowsize; ++i) hash->chain[i] = i; /*same value as index indicates uninitialized*/
-
-  for(i = 0; i <= MAX_SUPPORTED_DEFLATE_LENGTH; ++i) hash->headz[i] = -1;
-  for(i = 0; i != windowsize; ++i) hash->chainz[i] = i; /*same value as index indicates uninitialized*/
+  hash_clear(hash);
 
   return 0;
 }
@@ -1389,58 +1600,67 @@ static unsigned hash_init(Hash* hash, unsigned windowsize)
 static void hash_cleanup(Hash* hash)
 {
   lodepng_free(hash->head);
-  lodepng_free(hash->val);
   lodepng_free(hash->chain);
-
-  lodepng_free(hash->zeros);
-  lodepng_free(hash->headz);
-  lodepng_free(hash->chainz);
+  lodepng_free(hash->head3);
 }
 
-
-
-static unsigned getHash(const unsigned char* data, size_t size, size_t pos)
+/*
+Multiplicative hashing of the 4 bytes at pos, the upper bits of the product depend on all of them.
+pos + HASH_MIN_LENGTH must be at most the size of the data
+*/
+static unsigned getHash(const unsigned char* data, size_t pos)
 {
-  unsigned result = 0;
-  if (pos + 2 < size)
-  {
-    /*A simple shift and xor hash is used. Since the data of PNGs is dominated
-    by zeroes due to the filters, a better hash does not have a significant
-    effect on speed in traversing the chain, and causes more time spend on
-    calculating the hash.*/
-    result ^= (unsigned)(data[pos + 0] << 0u);
-    result ^= (unsigned)(data[pos + 1] << 4u);
-    result ^= (unsigned)(data[pos + 2] << 8u);
-  } else {
-    size_t amount, i;
-    if(pos >= size) return 0;
-    amount = size - pos;
-    for(i = 0; i != amount; ++i) result ^= (unsigned)(data[pos + i] << (i * 8u));
-  }
-  return result & HASH_BIT_MASK;
+  const unsigned char* p = &data[pos];
+  unsigned value = (unsigned)p[0] | ((unsigned)p[1] << 8) | ((unsigned)p[2] << 16) | ((unsigned)p[3] << 24);
+  return ((value * 2654435761u) & 0xffffffffu) >> (32u - HASH_BITS);
 }
 
-static unsigned countZeros(const unsigned char* data, size_t size, size_t pos)
+/*same for the first 3 bytes*/
+static unsigned getHash3(const unsigned char* data, size_t pos)
 {
-  const unsigned char* start = data + pos;
-  const unsigned char* end = start + MAX_SUPPORTED_DEFLATE_LENGTH;
-  if(end > data + size) end = data + size;
-  data = start;
-  while (data != end && *data == 0) ++data;
-  /*subtracting two addresses returned as 32-bit number (max value is MAX_SUPPORTED_DEFLATE_LENGTH)*/
-  return (unsigned)(data - start);
+  const unsigned char* p = &data[pos];
+  unsigned value = (unsigned)p[0] | ((unsigned)p[1] << 8) | ((unsigned)p[2] << 16);
+  return ((value * 2654435761u) & 0xffffffffu) >> (32u - HASH3_BITS);
 }
 
-/*wpos = pos & (windowsize - 1)*/
-static void updateHashChain(Hash* hash, size_t wpos, unsigned hashval, unsigned short numzeros)
+/*
+wpos = pos & (windowsize - 1). Returns the previous position with the same hash value,
+and the previous position with the same 3 bytes hash value in prev3 if not NULL
+*/
+static unsigned updateHashChain(Hash* hash, const unsigned char* data, size_t pos, size_t wpos, unsigned* prev3)
 {
-  hash->val[wpos] = (int)hashval;
-  if(hash->head[hashval] != -1) hash->chain[wpos] = hash->head[hashval];
-  hash->head[hashval] = wpos;
+  unsigned hashval = getHash(data, pos);
+  unsigned hashval3 = getHash3(data, pos);
+  unsigned prev = hash->head[hashval];
+  hash->chain[wpos] = prev;
+  hash->head[hashval] = (unsigned)pos;
+  if(prev3) *prev3 = hash->head3[hashval3];
+  hash->head3[hashval3] = (unsigned)pos;
+  return prev;
+}
 
-  hash->zeros[wpos] = numzeros;
-  if(hash->headz[numzeros] != -1) hash->chainz[wpos] = hash->headz[numzeros];
-  hash->headz[numzeros] = wpos;
+/*the amount of equal bytes at a and b, counting up to b reaching end*/
+static unsigned matchLength(const unsigned char* a, const unsigned char* b, const unsigned char* end)
+{
+  const unsigned char* start = b;
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+  /*compare 8 bytes at once, the lowest differing bit is in the first differing byte*/
+  while(end - b >= 8)
+  {
+    __extension__ unsigned long long x, y;
+    memcpy(&x, a, 8);
+    memcpy(&y, b, 8);
+    if(x != y) return (unsigned)(b - start) + ((unsigned)__builtin_ctzll(x ^ y) >> 3);
+    a += 8;
+    b += 8;
+  }
+#endif
+  while(b != end && *a == *b)
+  {
+    ++a;
+    ++b;
+  }
+  return (unsigned)(b - start);
 }
 
 /*
@@ -1451,178 +1671,192 @@ It uses a hash table technique to let it encode faster. When doing LZ77 encoding
 sliding window (of windowsize) is used, and all past bytes in that window can be used as
 the "dictionary". A brute force search through all possible distances would be slow, and
 this hash technique is one out of several ways to speed this up.
+Like zlib, the search of the hash chain is bounded by maxchainlength, shortened to a
+quarter once a match of goodmatch is found and stopped at nicematch. With lazy matching,
+a match is only given up for a longer one at the next byte if it's shorter than
+maxlazymatch. Without lazy matching, positions inside matches longer than that aren't
+added to the hash chains.
 */
+/*
+LZ77 with a window of 1: only repeats of the previous byte can be matched, which is a
+run length encoding that doesn't need the hash chains.
+*/
+static unsigned encodeRLE(uivector* out, const unsigned char* in, size_t inpos, size_t insize,
+                          unsigned minmatch)
+{
+  size_t pos = inpos;
+  while(pos < insize)
+  {
+    unsigned length = 0;
+    if(pos > 0)
+    {
+      const unsigned char* lastptr = &in[insize < pos + MAX_SUPPORTED_DEFLATE_LENGTH
+                                         ? insize : pos + MAX_SUPPORTED_DEFLATE_LENGTH];
+      length = matchLength(&in[pos - 1], &in[pos], lastptr);
+    }
+    if(length >= 3 && length >= minmatch)
+    {
+      addLengthDistance(out, length, 1);
+      pos += length;
+    }
+    else
+    {
+      if(!uivector_push_back(out, in[pos])) return 83; /*alloc fail*/
+      ++pos;
+    }
+  }
+  return 0;
+}
+
 static unsigned encodeLZ77(uivector* out, Hash* hash,
-                           const unsigned char* in, size_t inpos, size_t insize, unsigned windowsize,
-                           unsigned minmatch, unsigned nicematch, unsigned lazymatching)
+                           const unsigned char* in, size_t inpos, size_t insize,
+                           const LodePNGCompressSettings* settings)
 {
   size_t pos;
   unsigned i, error = 0;
-  /*for large window lengths, assume the user wants no compression loss. Otherwise, max hash chain length speedup.*/
-  unsigned maxchainlength = windowsize >= 8192 ? windowsize : windowsize / 8;
-  unsigned maxlazymatch = windowsize >= 8192 ? MAX_SUPPORTED_DEFLATE_LENGTH : 64;
-
-  unsigned usezeros = 1; /*not sure if setting it to false for windowsize < 8192 is better or worse*/
-  unsigned numzeros = 0;
+  unsigned windowsize = settings->windowsize;
+  unsigned minmatch = settings->minmatch;
+  unsigned nicematch = settings->nicematch;
+  unsigned goodmatch = settings->goodmatch ? settings->goodmatch : MAX_SUPPORTED_DEFLATE_LENGTH + 1;
+  unsigned lazymatching = settings->lazymatching;
+  /*when not set, for large window lengths assume the user wants no compression loss. Otherwise, max hash chain length speedup.*/
+  unsigned maxchainlength = settings->maxchainlength ? settings->maxchainlength
+                          : (windowsize >= 8192 ? windowsize : windowsize / 8);
+  unsigned maxlazymatch = settings->maxlazymatch ? settings->maxlazymatch
+                        : (windowsize >= 8192 ? MAX_SUPPORTED_DEFLATE_LENGTH : 64);
 
   unsigned offset; /*the offset represents the distance in LZ77 terminology*/
   unsigned length;
+  /*with lazy matching, the match found at pos - 1 that waits for the result at pos*/
   unsigned lazy = 0;
   unsigned lazylength = 0, lazyoffset = 0;
-  unsigned hashval;
-  unsigned current_offset, current_length;
-  unsigned prev_offset;
-  const unsigned char *lastptr, *foreptr, *backptr;
-  unsigned hashpos;
 
   if(windowsize == 0 || windowsize > 32768) return 60; /*error: windowsize smaller/larger than allowed*/
   if((windowsize & (windowsize - 1)) != 0) return 90; /*error: must be power of two*/
 
+  if(windowsize == 1) return encodeRLE(out, in, inpos, insize, minmatch);
+
   if(nicematch > MAX_SUPPORTED_DEFLATE_LENGTH) nicematch = MAX_SUPPORTED_DEFLATE_LENGTH;
 
-  for(pos = inpos; pos < insize; ++pos)
+  for(pos = inpos; pos < insize; )
   {
-    size_t wpos = pos & (windowsize - 1); /*position for in 'circular' hash buffers*/
-    unsigned chainlength = 0;
-
-    hashval = getHash(in, insize, pos);
-
-    if(usezeros && hashval == 0)
-    {
-      if (numzeros == 0) numzeros = countZeros(in, insize, pos);
-      else if (pos + numzeros > insize || in[pos + numzeros - 1] != 0) --numzeros;
-    }
-    else
-    {
-      numzeros = 0;
-    }
-
-    updateHashChain(hash, wpos, hashval, numzeros);
-
     /*the length and offset found for the current position*/
     length = 0;
     offset = 0;
 
-    hashpos = hash->chain[wpos];
-
-    lastptr = &in[insize < pos + MAX_SUPPORTED_DEFLATE_LENGTH ? insize : pos + MAX_SUPPORTED_DEFLATE_LENGTH];
-
-    /*search for the longest string*/
-    prev_offset = 0;
-    for(;;)
+    if(pos + HASH_MIN_LENGTH <= insize)
     {
-      if(chainlength++ >= maxchainlength) break;
-      current_offset = hashpos <= wpos ? wpos - hashpos : wpos - hashpos + windowsize;
+      unsigned hashpos3;
+      unsigned hashpos = updateHashChain(hash, in, pos, pos & (windowsize - 1), &hashpos3);
+      unsigned chainlength = maxchainlength;
+      const unsigned char* lastptr = &in[insize < pos + MAX_SUPPORTED_DEFLATE_LENGTH
+                                         ? insize : pos + MAX_SUPPORTED_DEFLATE_LENGTH];
 
-      if(current_offset < prev_offset) break; /*stop when went completely around the circular buffer*/
-      prev_offset = current_offset;
-      if(current_offset > 0)
-      {
-        /*test the next characters*/
-        foreptr = &in[pos];
-        backptr = &in[pos - current_offset];
-
-        /*common case in PNGs is lots of zeros. Quickly skip over them as a speedup*/
-        if(numzeros >= 3)
-        {
-          unsigned skip = hash->zeros[hashpos];
-          if(skip > numzeros) skip = numzeros;
-          backptr += skip;
-          foreptr += skip;
-        }
-
-        while(foreptr != lastptr && *backptr == *foreptr) /*maximum supported length by deflate is max length*/
-        {
-          ++backptr;
-          ++foreptr;
-        }
-        current_length = (unsigned)(foreptr - &in[pos]);
+      if(lazy && lazylength >= goodmatch) chainlength >>= 2;
+      /*a long enough match waiting from the previous byte is taken without searching*/
+      if(lazy && lazylength >= maxlazymatch) chainlength = 0;
 
-        if(current_length > length)
+      /*search for the longest string, the chain goes to ever older positions until outside the window*/
+      while(chainlength > 0 && hashpos < pos && pos - hashpos <= windowsize)
+      {
+        unsigned current_offset = (unsigned)(pos - hashpos);
+        unsigned next;
+        /*the byte at the best length so far must match to be an improvement, check that first*/
+        if(in[hashpos + length] == in[pos + length])
         {
-          length = current_length; /*the longest length*/
-          offset = current_offset; /*the offset that is related to this longest length*/
-          /*jump out once a length of max length is found (speed gain). This also jumps
-          out if length is MAX_SUPPORTED_DEFLATE_LENGTH*/
-          if(current_length >= nicematch) break;
+          unsigned current_length = matchLength(&in[hashpos], &in[pos], lastptr);
+          if(current_length > length)
+          {
+            length = current_length; /*the longest length*/
+            offset = current_offset; /*the offset that is related to this longest length*/
+            /*jump out once a length of max length is found (speed gain). This also jumps
+            out if length is MAX_SUPPORTED_DEFLATE_LENGTH or reaches the end of the data*/
+            if(current_length >= nicematch || &in[pos] + current_length == lastptr) break;
+          }
         }
+        --chainlength;
+        next = hash->chain[hashpos & (windowsize - 1)];
+        /*the entry was overwritten by a newer position once the window went around*/
+        if(next >= hashpos) break;
+        hashpos = next;
       }
 
-      if(hashpos == hash->chain[hashpos]) break;
-
-      if(numzeros >= 3 && length > numzeros) {
-        hashpos = hash->chainz[hashpos];
-        if(hash->zeros[hashpos] != numzeros) break;
-      } else {
-        hashpos = hash->chain[hashpos];
-        /*outdated hash value, happens if particular value was not encountered in whole last window*/
-        if(hash->val[hashpos] != (int)hashval) break;
+      /*3 bytes are only worth a match at a short distance*/
+      if(length < 3 && hashpos3 < pos && pos - hashpos3 <= windowsize && pos - hashpos3 <= 4096
+         && in[hashpos3] == in[pos] && in[hashpos3 + 1] == in[pos + 1] && in[hashpos3 + 2] == in[pos + 2])
+      {
+        length = 3;
+        offset = (unsigned)(pos - hashpos3);
       }
     }
 
+    /*too short, or compensate for the fact that longer offsets have more extra bits,
+    a length of only 3 may be not worth it then*/
+    if(length < 3 || length < minmatch || (length == 3 && offset > 4096)) length = 0;
+
     if(lazymatching)
     {
-      if(!lazy && length >= 3 && length <= maxlazymatch && length < MAX_SUPPORTED_DEFLATE_LENGTH)
+      if(lazy && length <= lazylength)
       {
-        lazy = 1;
-        lazylength = length;
-        lazyoffset = offset;
-        continue; /*try the next byte*/
+        /*the match from the previous byte is at least as good, it starts at pos - 1*/
+        if(lazyoffset > windowsize) ERROR_BREAK(86 /*too big (or overflown negative) offset*/);
+        addLengthDistance(out, lazylength, lazyoffset);
+        /*pos is already in the hash chains, the rest of the match is added now*/
+        for(i = 2; i < lazylength; ++i)
+        {
+          ++pos;
+          if(pos + HASH_MIN_LENGTH <= insize) updateHashChain(hash, in, pos, pos & (windowsize - 1), 0);
+        }
+        ++pos;
+        lazy = 0;
+        continue;
       }
       if(lazy)
       {
+        /*the match at pos is longer, push the previous character as literal*/
+        if(!uivector_push_back(out, in[pos - 1])) ERROR_BREAK(83 /*alloc fail*/);
         lazy = 0;
-        if(pos == 0) ERROR_BREAK(81);
-        if(length > lazylength + 1)
-        {
-          /*push the previous character as literal*/
-          if(!uivector_push_back(out, in[pos - 1])) ERROR_BREAK(83 /*alloc fail*/);
-        }
-        else
-        {
-          length = lazylength;
-          offset = lazyoffset;
-          hash->head[hashval] = -1; /*the same hashchain update will be done, this ensures no wrong alteration*/
-          hash->headz[numzeros] = -1; /*idem*/
-          --pos;
-        }
       }
-    }
-    if(length >= 3 && offset > windowsize) ERROR_BREAK(86 /*too big (or overflown negative) offset*/);
-
-    /*encode it as length/distance pair or literal value*/
-    if(length < 3) /*only lengths of 3 or higher are supported as length/distance pair*/
-    {
-      if(!uivector_push_back(out, in[pos])) ERROR_BREAK(83 /*alloc fail*/);
-    }
-    else if(length < minmatch || (length == 3 && offset > 4096))
-    {
-      /*compensate for the fact that longer offsets have more extra bits, a
-      length of only 3 may be not worth it then*/
+      if(length > 0)
+      {
+        lazy = 1;
+        lazylength = length;
+        lazyoffset = offset;
+        ++pos; /*try the next byte*/
+        continue;
+      }
       if(!uivector_push_back(out, in[pos])) ERROR_BREAK(83 /*alloc fail*/);
+      ++pos;
     }
-    else
+    else if(length > 0)
     {
+      if(offset > windowsize) ERROR_BREAK(86 /*too big (or overflown negative) offset*/);
       addLengthDistance(out, length, offset);
-      for(i = 1; i < length; ++i)
+      if(length <= maxlazymatch)
       {
-        ++pos;
-        wpos = pos & (windowsize - 1);
-        hashval = getHash(in, insize, pos);
-        if(usezeros && hashval == 0)
+        for(i = 1; i < length; ++i)
         {
-          if (numzeros == 0) numzeros = countZeros(in, insize, pos);
-          else if (pos + numzeros > insize || in[pos + numzeros - 1] != 0) --numzeros;
+          ++pos;
+          if(pos + HASH_MIN_LENGTH <= insize) updateHashChain(hash, in, pos, pos & (windowsize - 1), 0);
         }
-        else
-        {
-          numzeros = 0;
-        }
-        updateHashChain(hash, wpos, hashval, numzeros);
+        ++pos;
       }
+      else pos += length;
+    }
+    else
+    {
+      if(!uivector_push_back(out, in[pos])) ERROR_BREAK(83 /*alloc fail*/);
+      ++pos;
     }
   } /*end of the loop through each character of input*/
 
+  /*a match found at the last byte is still waiting*/
+  if(!error && lazy)
+  {
+    if(lazyoffset > windowsize) error = 86; /*too big (or overflown negative) offset*/
+    else addLengthDistance(out, lazylength, lazyoffset);
+  }
+
   return error;
 }
 
@@ -1635,6 +1869,7 @@ static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, s
 
   size_t i, j, numdeflateblocks = (datasize + 65534) / 65535;
   unsigned datapos = 0;
+  if(numdeflateblocks == 0) numdeflateblocks = 1; /*empty data still needs a final block*/
   for(i = 0; i != numdeflateblocks; ++i)
   {
     unsigned BFINAL, BTYPE, LEN, NLEN;
@@ -1760,8 +1995,7 @@ static unsigned deflateDynamic(ucvector* out, size_t* bp, Hash* hash,
   {
     if(settings->use_lz77)
     {
-      error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
-                         settings->minmatch, settings->nicematch, settings->lazymatching);
+      error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings);
       if(error) break;
     }
     else
@@ -1970,8 +2204,7 @@ static unsigned deflateFixed(ucvector* out, size_t* bp, Hash* hash,
   {
     uivector lz77_encoded;
     uivector_init(&lz77_encoded);
-    error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
-                       settings->minmatch, settings->nicematch, settings->lazymatching);
+    error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings);
     if(!error) writeLZ77data(bp, out, &lz77_encoded, &tree_ll, &tree_d);
     uivector_cleanup(&lz77_encoded);
   }
@@ -1992,16 +2225,168 @@ static unsigned deflateFixed(ucvector* out, size_t* bp, Hash* hash,
   return error;
 }
 
+static unsigned update_adler32(unsigned adler, const unsigned char* data, unsigned len);
+static unsigned adler32_combine(unsigned adler1, unsigned adler2, size_t len2);
+
+/*
+With the threads setting, the input is split in blocks of this size, each deflated on its own
+after filling the hash with the window before it, and ended with an empty stored block to end on
+a byte boundary (like zlib's Z_SYNC_FLUSH), so that the compressed blocks can be concatenated.
+*/
+#define DEFLATE_PARALLEL_BLOCKSIZE 131072u
+
+typedef struct DeflateParallel
+{
+  const unsigned char* in;
+  size_t insize;
+  const LodePNGCompressSettings* settings;
+  size_t numblocks;
+  unsigned threads;
+  ucvector* outs; /*compressed data of each block*/
+  unsigned* adlers; /*adler32 of the uncompressed data of each block*/
+  unsigned* errors; /*error of each block*/
+} DeflateParallel;
+
+typedef struct DeflateWorker
+{
+  DeflateParallel* job;
+  unsigned index; /*this worker does the blocks index, index + threads, ...*/
+} DeflateWorker;
+
+static unsigned deflateParallelBlock(ucvector* out, Hash* hash, const unsigned char* in, size_t insize,
+                                     size_t start, size_t end, const LodePNGCompressSettings* settings)
+{
+  unsigned error = 0;
+  unsigned final = (end == insize);
+  size_t bp = 0;
+  size_t pos = start > settings->windowsize ? start - settings->windowsize : 0;
+
+  /*the window before the block is added to the hash, the same as if it was deflated before*/
+  hash_clear(hash);
+  for(; pos < start && pos + HASH_MIN_LENGTH <= insize; ++pos)
+  {
+    updateHashChain(hash, in, pos, pos & (settings->windowsize - 1), 0);
+  }
+
+  if(settings->btype == 1) error = deflateFixed(out, &bp, hash, in, start, end, settings, final);
+  else error = deflateDynamic(out, &bp, hash, in, start, end, settings, final);
+
+  if(!error && !final)
+  {
+    /*empty non-final stored block: 3 header bits, the rest of the byte, LEN 0 and NLEN 65535*/
+    addBitsToStream(&bp, out, 0, 3);
+    ucvector_push_back(out, 0);
+    ucvector_push_back(out, 0);
+    ucvector_push_back(out, 255);
+    if(!ucvector_push_back(out, 255)) error = 83; /*alloc fail*/
+  }
+
+  return error;
+}
+
+static void deflateParallelWork(void* context)
+{
+  DeflateWorker* worker = (DeflateWorker*)context;
+  DeflateParallel* job = worker->job;
+  size_t i;
+  Hash hash;
+  unsigned error = hash_init(&hash, job->settings->windowsize);
+
+  for(i = worker->index; i < job->numblocks; i += job->threads)
+  {
+    size_t start = i * DEFLATE_PARALLEL_BLOCKSIZE;
+    size_t end = start + DEFLATE_PARALLEL_BLOCKSIZE;
+    if(end > job->insize) end = job->insize;
+
+    job->errors[i] = error ? error
+                   : deflateParallelBlock(&job->outs[i], &hash, job->in, job->insize, start, end, job->settings);
+    job->adlers[i] = update_adler32(1u, &job->in[start], (unsigned)(end - start));
+  }
+
+  hash_cleanup(&hash);
+}
+
+/*deflates the blocks on up to settings->threads threads, the compressed blocks are appended to out*/
+static unsigned deflateParallel(ucvector* out, const unsigned char* in, size_t insize,
+                                const LodePNGCompressSettings* settings, unsigned* adler)
+{
+  unsigned error = 0;
+  size_t i;
+  DeflateParallel job;
+  DeflateWorker* workers;
+
+  job.in = in;
+  job.insize = insize;
+  job.settings = settings;
+  job.numblocks = (insize + DEFLATE_PARALLEL_BLOCKSIZE - 1) / DEFLATE_PARALLEL_BLOCKSIZE;
+  job.threads = job.numblocks < settings->threads ? (unsigned)job.numblocks : settings->threads;
+  job.outs = (ucvector*)lodepng_malloc(sizeof(ucvector) * job.numblocks);
+  job.adlers = (unsigned*)lodepng_malloc(sizeof(unsigned) * job.numblocks);
+  job.errors = (unsigned*)lodepng_malloc(sizeof(unsigned) * job.numblocks);
+  workers = (DeflateWorker*)lodepng_malloc(sizeof(DeflateWorker) * job.threads);
+
+  if(!job.outs || !job.adlers || !job.errors || !workers)
+  {
+    error = 83; /*alloc fail*/
+  }
+  else
+  {
+    for(i = 0; i != job.numblocks; ++i) ucvector_init(&job.outs[i]);
+    for(i = 0; i != job.threads; ++i)
+    {
+      workers[i].job = &job;
+      workers[i].index = (unsigned)i;
+    }
+
+    runParallel(deflateParallelWork, workers, sizeof(DeflateWorker), job.threads);
+
+    for(i = 0; i != job.numblocks && !error; ++i)
+    {
+      size_t blocksize = i + 1 == job.numblocks ? insize - i * DEFLATE_PARALLEL_BLOCKSIZE : DEFLATE_PARALLEL_BLOCKSIZE;
+      size_t oldsize = out->size;
+      error = job.errors[i];
+      if(error) break;
+      if(!ucvector_resize(out, oldsize + job.outs[i].size)) ERROR_BREAK(83 /*alloc fail*/);
+      memcpy(&out->data[oldsize], job.outs[i].data, job.outs[i].size);
+      *adler = i == 0 ? job.adlers[0] : adler32_combine(*adler, job.adlers[i], blocksize);
+    }
+
+    for(i = 0; i != job.numblocks; ++i) ucvector_cleanup(&job.outs[i]);
+  }
+
+  lodepng_free(job.outs);
+  lodepng_free(job.adlers);
+  lodepng_free(job.errors);
+  lodepng_free(workers);
+
+  return error;
+}
+
+/*deflates in to the end of out. If adler is not NULL, the adler32 of in is stored in it*/
 static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t insize,
-                                 const LodePNGCompressSettings* settings)
+                                 const LodePNGCompressSettings* settings, unsigned* adler)
 {
   unsigned error = 0;
   size_t i, blocksize, numdeflateblocks;
   size_t bp = 0; /*the bit pointer*/
+  unsigned parallel_adler = 1;
   Hash hash;
 
   if(settings->btype > 2) return 61;
-  else if(settings->btype == 0) return deflateNoCompression(out, in, insize);
+  else if(settings->btype == 0)
+  {
+    error = deflateNoCompression(out, in, insize);
+    if(adler) *adler = update_adler32(1u, in, (unsigned)insize);
+    return error;
+  }
+  else if(settings->threads > 1 && insize > DEFLATE_PARALLEL_BLOCKSIZE)
+  {
+    if(settings->windowsize == 0 || settings->windowsize > 32768) return 60; /*error: windowsize smaller/larger than allowed*/
+    if((settings->windowsize & (settings->windowsize - 1)) != 0) return 90; /*error: must be power of two*/
+    error = deflateParallel(out, in, insize, settings, &parallel_adler);
+    if(adler) *adler = parallel_adler;
+    return error;
+  }
   else if(settings->btype == 1) blocksize = insize;
   else /*if(settings->btype == 2)*/
   {
@@ -2009,8 +2394,8 @@ static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t
     if(blocksize < 65535) blocksize = 65535;
   }
 
-  numdeflateblocks = (insize + blocksize - 1) / blocksize;
-  if(numdeflateblocks == 0) numdeflateblocks = 1;
+  /*empty data still needs a final block*/
+  numdeflateblocks = insize == 0 ? 1 : (insize + blocksize - 1) / blocksize;
 
   error = hash_init(&hash, settings->windowsize);
   if(error) return error;
@@ -2028,6 +2413,8 @@ static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t
 
   hash_cleanup(&hash);
 
+  if(adler) *adler = update_adler32(1u, in, (unsigned)insize);
+
   return error;
 }
 
@@ -2038,7 +2425,7 @@ unsigned lodepng_deflate(unsigned char** out, size_t* outsize,
   unsigned error;
   ucvector v;
   ucvector_init_buffer(&v, *out, *outsize);
-  error = lodepng_deflatev(&v, in, insize, settings);
+  error = lodepng_deflatev(&v, in, insize, settings, 0);
   *out = v.data;
   *outsize = v.size;
   return error;
@@ -2064,7 +2451,7 @@ static unsigned deflate(unsigned char** out, size_t* outsize,
 /* / Adler32                                                                  */
 /* ////////////////////////////////////////////////////////////////////////// */
 
-static unsigned update_adler32(unsigned adler, const unsigned char* data, unsigned len)
+static unsigned update_adler32_scalar(unsigned adler, const unsigned char* data, unsigned len)
 {
    unsigned s1 = adler & 0xffff;
    unsigned s2 = (adler >> 16) & 0xffff;
@@ -2087,6 +2474,130 @@ static unsigned update_adler32(unsigned adler, const unsigned char* data, unsign
   return (s2 << 16) | s1;
 }
 
+#ifdef LODEPNG_X86_SIMD
+/*
+32-byte blocks are summed with the dot product technique: s1 gets the sum of the bytes (psadbw), s2 the bytes
+multiplied by their distance from the end of the block (pmaddubsw) plus 32 times s1 from before the block.
+173 blocks are the most that can be summed before the reduction without overflowing, like 5550 bytes above.
+*/
+#define ADLER32_SIMD_BLOCKS 173u
+
+__attribute__((target("ssse3")))
+static unsigned update_adler32_ssse3(unsigned adler, const unsigned char* data, unsigned len)
+{
+  const __m128i tap1 = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17);
+  const __m128i tap2 = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i ones = _mm_set1_epi16(1);
+  unsigned s1 = adler & 0xffff;
+  unsigned s2 = (adler >> 16) & 0xffff;
+  unsigned blocks = len / 32;
+
+  len -= blocks * 32;
+  while(blocks > 0)
+  {
+    unsigned n = blocks > ADLER32_SIMD_BLOCKS ? ADLER32_SIMD_BLOCKS : blocks;
+    /*v_ps sums s1 before each block, starting with the s1 before this run for all n blocks*/
+    __m128i v_ps = _mm_cvtsi32_si128((int)(s1 * n));
+    __m128i v_s1 = zero;
+    __m128i v_s2 = _mm_cvtsi32_si128((int)s2);
+    blocks -= n;
+    while(n > 0)
+    {
+      const __m128i bytes1 = _mm_loadu_si128((const __m128i*)data);
+      const __m128i bytes2 = _mm_loadu_si128((const __m128i*)(data + 16));
+      v_ps = _mm_add_epi32(v_ps, v_s1);
+      v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes1, zero));
+      v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(bytes1, tap1), ones));
+      v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes2, zero));
+      v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(bytes2, tap2), ones));
+      data += 32;
+      --n;
+    }
+    v_s2 = _mm_add_epi32(v_s2, _mm_slli_epi32(v_ps, 5));
+
+    /*horizontal sums, psadbw leaves s1 in the lower 32 bits of both 64-bit halves*/
+    v_s1 = _mm_add_epi32(v_s1, _mm_shuffle_epi32(v_s1, _MM_SHUFFLE(1, 0, 3, 2)));
+    v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(2, 3, 0, 1)));
+    v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(1, 0, 3, 2)));
+    s1 = (s1 + (unsigned)_mm_cvtsi128_si32(v_s1)) % 65521;
+    s2 = (unsigned)_mm_cvtsi128_si32(v_s2) % 65521;
+  }
+
+  return update_adler32_scalar((s2 << 16) | s1, data, len);
+}
+
+__attribute__((target("avx2")))
+static unsigned update_adler32_avx2(unsigned adler, const unsigned char* data, unsigned len)
+{
+  const __m256i tap = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+                                       16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i ones = _mm256_set1_epi16(1);
+  unsigned s1 = adler & 0xffff;
+  unsigned s2 = (adler >> 16) & 0xffff;
+  unsigned blocks = len / 32;
+
+  len -= blocks * 32;
+  while(blocks > 0)
+  {
+    unsigned n = blocks > ADLER32_SIMD_BLOCKS ? ADLER32_SIMD_BLOCKS : blocks;
+    __m256i v_ps = _mm256_setr_epi32((int)(s1 * n), 0, 0, 0, 0, 0, 0, 0);
+    __m256i v_s1 = zero;
+    __m256i v_s2 = _mm256_setr_epi32((int)s2, 0, 0, 0, 0, 0, 0, 0);
+    __m128i h_s1, h_s2;
+    blocks -= n;
+    while(n > 0)
+    {
+      const __m256i bytes = _mm256_loadu_si256((const __m256i*)data);
+      v_ps = _mm256_add_epi32(v_ps, v_s1);
+      v_s1 = _mm256_add_epi32(v_s1, _mm256_sad_epu8(bytes, zero));
+      v_s2 = _mm256_add_epi32(v_s2, _mm256_madd_epi16(_mm256_maddubs_epi16(bytes, tap), ones));
+      data += 32;
+      --n;
+    }
+    v_s2 = _mm256_add_epi32(v_s2, _mm256_slli_epi32(v_ps, 5));
+
+    h_s1 = _mm_add_epi32(_mm256_castsi256_si128(v_s1), _mm256_extracti128_si256(v_s1, 1));
+    h_s2 = _mm_add_epi32(_mm256_castsi256_si128(v_s2), _mm256_extracti128_si256(v_s2, 1));
+    h_s1 = _mm_add_epi32(h_s1, _mm_shuffle_epi32(h_s1, _MM_SHUFFLE(1, 0, 3, 2)));
+    h_s2 = _mm_add_epi32(h_s2, _mm_shuffle_epi32(h_s2, _MM_SHUFFLE(2, 3, 0, 1)));
+    h_s2 = _mm_add_epi32(h_s2, _mm_shuffle_epi32(h_s2, _MM_SHUFFLE(1, 0, 3, 2)));
+    s1 = (s1 + (unsigned)_mm_cvtsi128_si32(h_s1)) % 65521;
+    s2 = (unsigned)_mm_cvtsi128_si32(h_s2) % 65521;
+  }
+
+  return update_adler32_scalar((s2 << 16) | s1, data, len);
+}
+#endif /*LODEPNG_X86_SIMD*/
+
+static unsigned update_adler32(unsigned adler, const unsigned char* data, unsigned len)
+{
+#ifdef LODEPNG_X86_SIMD
+  if(len >= 64)
+  {
+    if(__builtin_cpu_supports("avx2")) return update_adler32_avx2(adler, data, len);
+    if(__builtin_cpu_supports("ssse3")) return update_adler32_ssse3(adler, data, len);
+  }
+#endif /*LODEPNG_X86_SIMD*/
+  return update_adler32_scalar(adler, data, len);
+}
+
+/*Return the adler32 of two parts of data after each other from their adler32s, len2 is the length of the second*/
+static unsigned adler32_combine(unsigned adler1, unsigned adler2, size_t len2)
+{
+  unsigned rem = (unsigned)(len2 % 65521);
+  unsigned s1 = adler1 & 0xffff;
+  unsigned s2 = (rem * s1) % 65521;
+  s1 += (adler2 & 0xffff) + 65521 - 1;
+  s2 += (adler1 >> 16) + (adler2 >> 16) + 65521 - rem;
+  if(s1 >= 65521) s1 -= 65521;
+  if(s1 >= 65521) s1 -= 65521;
+  if(s2 >= 65521 * 2) s2 -= 65521 * 2;
+  if(s2 >= 65521) s2 -= 65521;
+  return (s2 << 16) | s1;
+}
+
 /*Return the adler32 of the bytes data[0..len-1]*/
 static unsigned adler32(const unsigned char* data, unsigned len)
 {
@@ -2099,10 +2610,9 @@ static unsigned adler32(const unsigned char* data, unsigned len)
 
 #ifdef LODEPNG_COMPILE_DECODER
 
-unsigned lodepng_zlib_decompress(unsigned char** out, size_t* outsize, const unsigned char* in,
-                                 size_t insize, const LodePNGDecompressSettings* settings)
+/*returns the error of the 2 byte zlib header, if it isn't one that PNG allows*/
+static unsigned checkZlibHeader(const unsigned char* in, size_t insize)
 {
-  unsigned error = 0;
   unsigned CM, CINFO, FDICT;
 
   if(insize < 2) return 53; /*error, size of zlib data too small*/
@@ -2130,6 +2640,14 @@ unsigned lodepng_zlib_decompress(unsigned char** out, size_t* outsize, const uns
       "The additional flags shall not specify a preset dictionary."*/
     return 26;
   }
+  return 0;
+}
+
+unsigned lodepng_zlib_decompress(unsigned char** out, size_t* outsize, const unsigned char* in,
+                                 size_t insize, const LodePNGDecompressSettings* settings)
+{
+  unsigned error = checkZlibHeader(in, insize);
+  if(error) return error;
 
   error = inflate(out, outsize, in + 2, insize - 2, settings);
   if(error) return error;
@@ -2157,6 +2675,233 @@ static unsigned zlib_decompress(unsigned char** out, size_t* outsize, const unsi
   }
 }
 
+/*the window of deflate, the largest distance a length and distance pair can go back*/
+#define INFLATE_WINDOW_SIZE 32768u
+
+typedef enum InflateMode
+{
+  INFLATE_HEADER, /*at the header of the next block*/
+  INFLATE_HUFFMAN, /*in a block with fixed or dynamic trees*/
+  INFLATE_STORED, /*in an uncompressed block*/
+  INFLATE_END /*after the final block*/
+} InflateMode;
+
+/*
+Inflates a zlib stream in parts of any size, instead of all at once. Only the window of the
+last 32768 bytes of output is kept, so the memory doesn't depend on the decompressed size.
+*/
+typedef struct InflateStream
+{
+  const unsigned char* in; /*the zlib data*/
+  size_t insize;
+  LodePNGBitReader reader; /*of the deflate data after the zlib header*/
+  InflateMode mode;
+  unsigned final; /*the current block is the final one*/
+  HuffmanTree tree_ll; /*the huffman tree for literal and length codes*/
+  HuffmanTree tree_d; /*the huffman tree for distance codes*/
+  size_t length; /*bytes left of the current length and distance pair, or of the stored block*/
+  size_t distance; /*of the current length and distance pair*/
+  size_t storedpos; /*byte position in the deflate data of the stored block*/
+  unsigned char* window; /*the last output, at the output positions modulo INFLATE_WINDOW_SIZE*/
+  size_t pos; /*the amount of bytes output so far*/
+  unsigned adler; /*of the output so far*/
+} InflateStream;
+
+/*back to the start of the stream*/
+static void inflateStream_rewind(InflateStream* stream)
+{
+  LodePNGBitReader_init(&stream->reader, stream->in + 2, stream->insize - 2);
+  stream->mode = INFLATE_HEADER;
+  stream->final = 0;
+  stream->length = 0;
+  stream->pos = 0;
+  stream->adler = 1;
+}
+
+static unsigned inflateStream_init(InflateStream* stream, const unsigned char* in, size_t insize)
+{
+  unsigned error = checkZlibHeader(in, insize);
+  HuffmanTree_init(&stream->tree_ll);
+  HuffmanTree_init(&stream->tree_d);
+  stream->in = in;
+  stream->insize = insize;
+  stream->window = (unsigned char*)lodepng_malloc(INFLATE_WINDOW_SIZE);
+  if(error) return error;
+  if(!stream->window) return 83; /*alloc fail*/
+  inflateStream_rewind(stream);
+  return 0;
+}
+
+static void inflateStream_cleanup(InflateStream* stream)
+{
+  HuffmanTree_cleanup(&stream->tree_ll);
+  HuffmanTree_cleanup(&stream->tree_d);
+  lodepng_free(stream->window);
+}
+
+/*reads the header of the next block, with its trees or the length of a stored block*/
+static unsigned inflateStream_header(InflateStream* stream)
+{
+  LodePNGBitReader* reader = &stream->reader;
+  unsigned BTYPE;
+  if(reader->bp + 2 >= reader->bitsize) return 52; /*error, bit pointer will jump past memory*/
+  ensureBits(reader);
+  stream->final = readBits(reader, 1);
+  BTYPE = readBits(reader, 2);
+
+  if(BTYPE == 3) return 20; /*error: invalid BTYPE*/
+  else if(BTYPE == 0)
+  {
+    /*go to first boundary of byte, LEN (2 bytes) and NLEN (2 bytes) follow*/
+    size_t p = (reader->bp + 7) >> 3;
+    const unsigned char* in = reader->data;
+    unsigned LEN, NLEN;
+    if(p + 4 >= reader->size) return 52; /*error, bit pointer will jump past memory*/
+    LEN = in[p] + 256u * in[p + 1];
+    NLEN = in[p + 2] + 256u * in[p + 3];
+    /*check if 16-bit NLEN is really the one's complement of LEN*/
+    if(LEN + NLEN != 65535) return 21; /*error: NLEN is not one's complement of LEN*/
+    if(p + 4 + LEN > reader->size) return 23; /*error: reading outside of in buffer*/
+    stream->mode = INFLATE_STORED;
+    stream->storedpos = p + 4;
+    stream->length = LEN;
+    return 0;
+  }
+  else
+  {
+    HuffmanTree_cleanup(&stream->tree_ll);
+    HuffmanTree_cleanup(&stream->tree_d);
+    HuffmanTree_init(&stream->tree_ll);
+    HuffmanTree_init(&stream->tree_d);
+    stream->mode = INFLATE_HUFFMAN;
+    if(BTYPE == 1) return getTreeInflateFixed(&stream->tree_ll, &stream->tree_d);
+    else return getTreeInflateDynamic(&stream->tree_ll, &stream->tree_d, reader);
+  }
+}
+
+/*
+Decodes the next symbol of a huffman block. A literal goes to *literal, which is set to 256 otherwise.
+A length and distance pair is set up in the stream, and the end code finishes the block.
+*/
+static unsigned inflateStream_symbol(InflateStream* stream, unsigned* literal)
+{
+  LodePNGBitReader* reader = &stream->reader;
+  unsigned code_ll, code_d;
+
+  *literal = 256;
+  /*one refill covers a length and distance with their extra bits, at most 15 + 5 + 15 + 13 bits,
+  with 32-bit buffers there's another before the distance*/
+  ensureBits(reader);
+  code_ll = huffmanDecodeSymbol(reader, &stream->tree_ll);
+  if(reader->bp > reader->bitsize) return 10; /*error: end of input memory reached without endcode*/
+  if(code_ll <= 255) *literal = code_ll;
+  else if(code_ll >= FIRST_LENGTH_CODE_INDEX && code_ll <= LAST_LENGTH_CODE_INDEX)
+  {
+    stream->length = LENGTHBASE[code_ll - FIRST_LENGTH_CODE_INDEX]
+                   + readBits(reader, LENGTHEXTRA[code_ll - FIRST_LENGTH_CODE_INDEX]);
+    if(sizeof(size_t) < 8) ensureBits(reader);
+    code_d = huffmanDecodeSymbol(reader, &stream->tree_d);
+    if(code_d > 29)
+    {
+      if(code_d == INVALIDSYMBOL) return 11; /*error: bits that aren't a code of the tree*/
+      else return 18; /*error: invalid distance code (30-31 are never used)*/
+    }
+    stream->distance = DISTANCEBASE[code_d] + readBits(reader, DISTANCEEXTRA[code_d]);
+    if(reader->bp > reader->bitsize) return 51; /*error, bit pointer jumped past memory*/
+    if(stream->distance > stream->pos) return 52; /*too long backward distance*/
+  }
+  else if(code_ll == 256) stream->mode = stream->final ? INFLATE_END : INFLATE_HEADER;
+  else return 11; /*error: bits that aren't a code of the tree, or the unused codes 286-287*/
+  return 0;
+}
+
+/*outputs the next size bytes of the stream, error 91 if it ends before that*/
+static unsigned inflateStream_read(InflateStream* stream, unsigned char* out, size_t size)
+{
+  unsigned char* window = stream->window;
+  size_t i = 0;
+  unsigned error = 0;
+
+  while(i != size && !error)
+  {
+    if(stream->length != 0)
+    {
+      /*as much of the length and distance pair or stored block as fits*/
+      size_t n = size - i < stream->length ? size - i : stream->length;
+      size_t end = i + n;
+      stream->length -= n;
+      if(stream->mode == INFLATE_STORED)
+      {
+        const unsigned char* data = &stream->reader.data[stream->storedpos];
+        stream->storedpos += n;
+        for(; i != end; ++i, ++data, ++stream->pos)
+        {
+          out[i] = window[stream->pos & (INFLATE_WINDOW_SIZE - 1)] = *data;
+        }
+      }
+      else
+      {
+        for(; i != end; ++i, ++stream->pos)
+        {
+          unsigned char value = window[(stream->pos - stream->distance) & (INFLATE_WINDOW_SIZE - 1)];
+          out[i] = window[stream->pos & (INFLATE_WINDOW_SIZE - 1)] = value;
+        }
+      }
+    }
+    else if(stream->mode == INFLATE_HUFFMAN)
+    {
+      unsigned literal;
+      error = inflateStream_symbol(stream, &literal);
+      if(!error && literal <= 255)
+      {
+        out[i++] = window[stream->pos & (INFLATE_WINDOW_SIZE - 1)] = (unsigned char)literal;
+        ++stream->pos;
+      }
+    }
+    else if(stream->mode == INFLATE_STORED)
+    {
+      /*the end of the stored block*/
+      stream->reader.bp = stream->storedpos * 8;
+      stream->mode = stream->final ? INFLATE_END : INFLATE_HEADER;
+    }
+    else if(stream->mode == INFLATE_HEADER) error = inflateStream_header(stream);
+    else error = 91; /*the stream ended before size bytes*/
+  }
+
+  stream->adler = update_adler32(stream->adler, out, (unsigned)i);
+  return error;
+}
+
+/*reads up to the end of the stream, error 91 if there's more output, and checks the adler32*/
+static unsigned inflateStream_finish(InflateStream* stream, const LodePNGDecompressSettings* settings)
+{
+  unsigned error = 0;
+  while(stream->mode != INFLATE_END && !error)
+  {
+    if(stream->length != 0) error = 91; /*more output than expected*/
+    else if(stream->mode == INFLATE_HUFFMAN)
+    {
+      unsigned literal;
+      error = inflateStream_symbol(stream, &literal);
+      if(!error && (literal <= 255 || stream->length != 0)) error = 91;
+    }
+    else if(stream->mode == INFLATE_STORED)
+    {
+      stream->reader.bp = stream->storedpos * 8;
+      stream->mode = stream->final ? INFLATE_END : INFLATE_HEADER;
+    }
+    else error = inflateStream_header(stream);
+  }
+  if(error) return error;
+
+  if(!settings->ignore_adler32)
+  {
+    unsigned ADLER32 = lodepng_read32bitInt(&stream->in[stream->insize - 4]);
+    if(stream->adler != ADLER32) return 58; /*error, adler checksum not correct, data must be corrupted*/
+  }
+  return 0;
+}
+
 #endif /*LODEPNG_COMPILE_DECODER*/
 
 #ifdef LODEPNG_COMPILE_ENCODER
@@ -2186,14 +2931,24 @@ unsigned lodepng_zlib_compress(unsigned char** out, size_t* outsize, const unsig
   ucvector_push_back(&outv, (unsigned char)(CMFFLG / 256));
   ucvector_push_back(&outv, (unsigned char)(CMFFLG % 256));
 
-  error = deflate(&deflatedata, &deflatesize, in, insize, settings);
+  if(settings->custom_deflate)
+  {
+    error = deflate(&deflatedata, &deflatesize, in, insize, settings);
 
-  if(!error)
+    if(!error)
+    {
+      unsigned ADLER32 = adler32(in, (unsigned)insize);
+      for(i = 0; i != deflatesize; ++i) ucvector_push_back(&outv, deflatedata[i]);
+      lodepng_free(deflatedata);
+      lodepng_add32bitInt(&outv, ADLER32);
+    }
+  }
+  else
   {
-    unsigned ADLER32 = adler32(in, (unsigned)insize);
-    for(i = 0; i != deflatesize; ++i) ucvector_push_back(&outv, deflatedata[i]);
-    lodepng_free(deflatedata);
-    lodepng_add32bitInt(&outv, ADLER32);
+    /*deflate directly after the header, the adler32 is computed along with it*/
+    unsigned ADLER32;
+    error = lodepng_deflatev(&outv, in, insize, settings, &ADLER32);
+    if(!error) lodepng_add32bitInt(&outv, ADLER32);
   }
 
   *out = outv.data;
@@ -2255,13 +3010,52 @@ void lodepng_compress_settings_init(LodePNGCompressSettings* settings)
   settings->minmatch = 3;
   settings->nicematch = 128;
   settings->lazymatching = 1;
+  settings->maxchainlength = 0;
+  settings->goodmatch = 0;
+  settings->maxlazymatch = 0;
+  settings->threads = 1;
 
   settings->custom_zlib = 0;
   settings->custom_deflate = 0;
   settings->custom_context = 0;
 }
 
-const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 3, 128, 1, 0, 0, 0};
+const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 3, 128, 1, 0, 0, 0, 1, 0, 0, 0};
+
+void lodepng_compress_settings_set_level(LodePNGCompressSettings* settings, unsigned level)
+{
+  /*the limits of zlib's levels: goodmatch, maxlazymatch, nicematch, maxchainlength, lazymatching*/
+  static const unsigned LEVELS[9][5] = {
+    { 4,   4,   8,    4, 0},
+    { 4,   5,  16,    8, 0},
+    { 4,   6,  32,   32, 0},
+    { 4,   4,  16,   16, 1},
+    { 8,  16,  32,   32, 1},
+    { 8,  16, 128,  128, 1},
+    { 8,  32, 128,  256, 1},
+    {32, 128, 258, 1024, 1},
+    {32, 258, 258, 4096, 1}
+  };
+  const unsigned* l;
+
+  if(level == 0)
+  {
+    settings->btype = 0; /*stored without compression*/
+    return;
+  }
+  if(level > 9) level = 9;
+  l = LEVELS[level - 1];
+
+  settings->btype = 2;
+  settings->use_lz77 = 1;
+  settings->windowsize = 32768;
+  settings->minmatch = 3;
+  settings->goodmatch = l[0];
+  settings->maxlazymatch = l[1];
+  settings->nicematch = l[2];
+  settings->maxchainlength = l[3];
+  settings->lazymatching = l[4];
+}
 
 
 #endif /*LODEPNG_COMPILE_ENCODER*/
@@ -2329,15 +3123,361 @@ static unsigned lodepng_crc32_table[256] = {
   3009837614u, 3294710456u, 1567103746u,  711928724u, 3020668471u, 3272380065u, 1510334235u,  755167117u
 };
 
+/*
+Tables for processing 8 bytes at a time (slicing-by-8): lodepng_crc32_slices[k - 1][b] is the CRC
+of byte b followed by k zero bytes.
+*/
+static const unsigned lodepng_crc32_slices[7][256] = {
+  {
+             0u,  421212481u,  842424962u,  724390851u, 1684849924u, 2105013317u, 1448781702u, 1329698503u,
+    3369699848u, 3519200073u, 4210026634u, 3824474571u, 2897563404u, 3048111693u, 2659397006u, 2274893007u,
+    1254232657u, 1406739216u, 2029285587u, 1643069842u,  783210325u,  934667796u,  479770071u,   92505238u,
+    2182846553u, 2600511768u, 2955803355u, 2838940570u, 3866582365u, 4285295644u, 3561045983u, 3445231262u,
+    2508465314u, 2359236067u, 2813478432u, 3198777185u, 4058571174u, 3908292839u, 3286139684u, 3670389349u,
+    1566420650u, 1145479147u, 1869335592u, 1987116393u,  959540142u,  539646703u,  185010476u,  303839341u,
+    3745920755u, 3327985586u, 3983561841u, 4100678960u, 3140154359u, 2721170102u, 2300350837u, 2416418868u,
+     396344571u,  243568058u,  631889529u, 1018359608u, 1945336319u, 1793607870u, 1103436669u, 1490954812u,
+    4034481925u, 3915546180u, 3259968903u, 3679722694u, 2484439553u, 2366552896u, 2787371139u, 3208174018u,
+     950060301u,  565965900u,  177645455u,  328046286u, 1556873225u, 1171730760u, 1861902987u, 2011255754u,
+    3132841300u, 2745199637u, 2290958294u, 2442530455u, 3738671184u, 3352078609u, 3974232786u, 4126854035u,
+    1919080284u, 1803150877u, 1079293406u, 1498383519u,  370020952u,  253043481u,  607678682u, 1025720731u,
+    1711106983u, 2095471334u, 1472923941u, 1322268772u,   26324643u,  411738082u,  866634785u,  717028704u,
+    2904875439u, 3024081134u, 2668790573u, 2248782444u, 3376948395u, 3495106026u, 4219356713u, 3798300520u,
+     792689142u,  908347575u,  487136116u,   68299317u, 1263779058u, 1380486579u, 2036719216u, 1618931505u,
+    3890672638u, 4278043327u, 3587215740u, 3435896893u, 2206873338u, 2593195963u, 2981909624u, 2829542713u,
+     998479947u,  580430090u,  162921161u,  279890824u, 1609522511u, 1190423566u, 1842954189u, 1958874764u,
+    4082766403u, 3930137346u, 3245109441u, 3631694208u, 2536953671u, 2385372678u, 2768287173u, 3155920004u,
+    1900120602u, 1750776667u, 1131931800u, 1517083097u,  355290910u,  204897887u,  656092572u, 1040194781u,
+    3113746450u, 2692952403u, 2343461520u, 2461357009u, 3723805974u, 3304059991u, 4022511508u, 4141455061u,
+    2919742697u, 3072101800u, 2620513899u, 2234183466u, 3396041197u, 3547351212u, 4166851439u, 3779471918u,
+    1725839073u, 2143618976u, 1424512099u, 1307796770u,   45282277u,  464110244u,  813994343u,  698327078u,
+    3838160568u, 4259225593u, 3606301754u, 3488152955u, 2158586812u, 2578602749u, 2996767038u, 2877569151u,
+     740041904u,  889656817u,  506086962u,  120682355u, 1215357364u, 1366020341u, 2051441462u, 1667084919u,
+    3422213966u, 3538019855u, 4190942668u, 3772220557u, 2945847882u, 3062702859u, 2644537544u, 2226864521u,
+      52649286u,  439905287u,  823476164u,  672009861u, 1733269570u, 2119477507u, 1434057408u, 1281543041u,
+    2167981343u, 2552493150u, 3004082077u, 2853541596u, 3847487515u, 4233048410u, 3613549209u, 3464057816u,
+    1239502615u, 1358593622u, 2077699477u, 1657543892u,  764250643u,  882293586u,  532408465u,  111204816u,
+    1585378284u, 1197851309u, 1816695150u, 1968414767u,  974272232u,  587794345u,  136598634u,  289367339u,
+    2527558116u, 2411481253u, 2760973158u, 3179948583u, 4073438432u, 3956313505u, 3237863010u, 3655790371u,
+     347922877u,  229101820u,  646611775u, 1066513022u, 1892689081u, 1774917112u, 1122387515u, 1543337850u,
+    3697634229u, 3313392372u, 3998419255u, 4148705398u, 3087642289u, 2702352368u, 2319436851u, 2468674930u
+  },
+  {
+             0u,   29518391u,   59036782u,   38190681u,  118073564u,  114017003u,   76381362u,   89069189u,
+     236147128u,  265370511u,  228034006u,  206958561u,  152762724u,  148411219u,  178138378u,  190596925u,
+     472294256u,  501532999u,  530741022u,  509615401u,  456068012u,  451764635u,  413917122u,  426358261u,
+     305525448u,  334993663u,  296822438u,  275991697u,  356276756u,  352202787u,  381193850u,  393929805u,
+     944588512u,  965684439u, 1003065998u,  973863097u, 1061482044u, 1049003019u, 1019230802u, 1023561829u,
+     912136024u,  933002607u,  903529270u,  874031361u,  827834244u,  815125939u,  852716522u,  856752605u,
+     611050896u,  631869351u,  669987326u,  640506825u,  593644876u,  580921211u,  551983394u,  556069653u,
+     712553512u,  733666847u,  704405574u,  675154545u,  762387700u,  749958851u,  787859610u,  792175277u,
+    1889177024u, 1901651959u, 1931368878u, 1927033753u, 2006131996u, 1985040171u, 1947726194u, 1976933189u,
+    2122964088u, 2135668303u, 2098006038u, 2093965857u, 2038461604u, 2017599123u, 2047123658u, 2076625661u,
+    1824272048u, 1836991623u, 1866005214u, 1861914857u, 1807058540u, 1786244187u, 1748062722u, 1777547317u,
+    1655668488u, 1668093247u, 1630251878u, 1625932113u, 1705433044u, 1684323811u, 1713505210u, 1742760333u,
+    1222101792u, 1226154263u, 1263738702u, 1251046777u, 1339974652u, 1310460363u, 1281013650u, 1301863845u,
+    1187289752u, 1191637167u, 1161842422u, 1149379777u, 1103966788u, 1074747507u, 1112139306u, 1133218845u,
+    1425107024u, 1429406311u, 1467333694u, 1454888457u, 1408811148u, 1379576507u, 1350309090u, 1371438805u,
+    1524775400u, 1528845279u, 1499917702u, 1487177649u, 1575719220u, 1546255107u, 1584350554u, 1605185389u,
+    3778354048u, 3774312887u, 3803303918u, 3816007129u, 3862737756u, 3892238699u, 3854067506u, 3833203973u,
+    4012263992u, 4007927823u, 3970080342u, 3982554209u, 3895452388u, 3924658387u, 3953866378u, 3932773565u,
+    4245928176u, 4241609415u, 4271336606u, 4283762345u, 4196012076u, 4225268251u, 4187931714u, 4166823541u,
+    4076923208u, 4072833919u, 4035198246u, 4047918865u, 4094247316u, 4123732899u, 4153251322u, 4132437965u,
+    3648544096u, 3636082519u, 3673983246u, 3678331705u, 3732010428u, 3753090955u, 3723829714u, 3694611429u,
+    3614117080u, 3601426159u, 3572488374u, 3576541825u, 3496125444u, 3516976691u, 3555094634u, 3525581405u,
+    3311336976u, 3298595879u, 3336186494u, 3340255305u, 3260503756u, 3281337595u, 3251864226u, 3222399125u,
+    3410866088u, 3398419871u, 3368647622u, 3372945905u, 3427010420u, 3448139075u, 3485520666u, 3456284973u,
+    2444203584u, 2423127159u, 2452308526u, 2481530905u, 2527477404u, 2539934891u, 2502093554u, 2497740997u,
+    2679949304u, 2659102159u, 2620920726u, 2650438049u, 2562027300u, 2574714131u, 2603727690u, 2599670141u,
+    2374579504u, 2353749767u, 2383274334u, 2412743529u, 2323684844u, 2336421851u, 2298759554u, 2294686645u,
+    2207933576u, 2186809023u, 2149495014u, 2178734801u, 2224278612u, 2236720739u, 2266437690u, 2262135309u,
+    2850214048u, 2820717207u, 2858812622u, 2879680249u, 2934667388u, 2938704459u, 2909776914u, 2897069605u,
+    2817622296u, 2788420399u, 2759153014u, 2780249921u, 2700618180u, 2704950259u, 2742877610u, 2730399645u,
+    3049550800u, 3020298727u, 3057690558u, 3078802825u, 2999835404u, 3004150075u, 2974355298u, 2961925461u,
+    3151438440u, 3121956959u, 3092510214u, 3113327665u, 3168701108u, 3172786307u, 3210370778u, 3197646061u
+  },
+  {
+             0u, 3099354981u, 2852767883u,  313896942u, 2405603159u,  937357362u,  627793884u, 2648127673u,
+    3316918511u, 2097696650u, 1874714724u, 3607201537u, 1255587768u, 4067088605u, 3772741427u, 1482887254u,
+    1343838111u, 3903140090u, 4195393300u, 1118632049u, 3749429448u, 1741137837u, 1970407491u, 3452858150u,
+    2511175536u,  756094997u, 1067759611u, 2266550430u,  449832999u, 2725482306u, 2965774508u,  142231497u,
+    2687676222u,  412010587u,  171665333u, 2995192016u,  793786473u, 2548850444u, 2237264098u, 1038456711u,
+    1703315409u, 3711623348u, 3482275674u, 1999841343u, 3940814982u, 1381529571u, 1089329165u, 4166106984u,
+    4029413537u, 1217896388u, 1512189994u, 3802027855u, 2135519222u, 3354724499u, 3577784189u, 1845280792u,
+     899665998u, 2367928107u, 2677414085u,  657096608u, 3137160985u,   37822588u,  284462994u, 2823350519u,
+    2601801789u,  598228824u,  824021174u, 2309093331u,  343330666u, 2898962447u, 3195996129u,  113467524u,
+    1587572946u, 3860600759u, 4104763481u, 1276501820u, 3519211397u, 1769898208u, 2076913422u, 3279374443u,
+    3406630818u, 1941006535u, 1627703081u, 3652755532u, 1148164341u, 4241751952u, 3999682686u, 1457141531u,
+     247015245u, 3053797416u, 2763059142u,  470583459u, 2178658330u,  963106687u,  735213713u, 2473467892u,
+     992409347u, 2207944806u, 2435792776u,  697522413u, 3024379988u,  217581361u,  508405983u, 2800865210u,
+    4271038444u, 1177467017u, 1419450215u, 3962007554u, 1911572667u, 3377213406u, 3690561584u, 1665525589u,
+    1799331996u, 3548628985u, 3241568279u, 2039091058u, 3831314379u, 1558270126u, 1314193216u, 4142438437u,
+    2928380019u,  372764438u,   75645176u, 3158189981u,  568925988u, 2572515393u, 2346768303u,  861712586u,
+    3982079547u, 1441124702u, 1196457648u, 4293663189u, 1648042348u, 3666298377u, 3358779879u, 1888390786u,
+     686661332u, 2421291441u, 2196002399u,  978858298u, 2811169155u,  523464422u,  226935048u, 3040519789u,
+    3175145892u,  100435649u,  390670639u, 2952089162u,  841119475u, 2325614998u, 2553003640u,  546822429u,
+    2029308235u, 3225988654u, 3539796416u, 1782671013u, 4153826844u, 1328167289u, 1570739863u, 3844338162u,
+    1298864389u, 4124540512u, 3882013070u, 1608431339u, 3255406162u, 2058742071u, 1744848601u, 3501990332u,
+    2296328682u,  811816591u,  584513889u, 2590678532u,  129869501u, 3204563416u, 2914283062u,  352848211u,
+     494030490u, 2781751807u, 3078325777u,  264757620u, 2450577869u,  715964072u,  941166918u, 2158327331u,
+    3636881013u, 1618608400u, 1926213374u, 3396585883u, 1470427426u, 4011365959u, 4255988137u, 1158766284u,
+    1984818694u, 3471935843u, 3695453837u, 1693991400u, 4180638033u, 1100160564u, 1395044826u, 3952793279u,
+    3019491049u,  189112716u,  435162722u, 2706139399u, 1016811966u, 2217162459u, 2526189877u,  774831696u,
+     643086745u, 2666061564u, 2354934034u,  887166583u, 2838900430u,  294275499u,   54519365u, 3145957664u,
+    3823145334u, 1532818963u, 1240029693u, 4048895640u, 1820460577u, 3560857924u, 3331051178u, 2117577167u,
+    3598663992u, 1858283101u, 2088143283u, 3301633750u, 1495127663u, 3785470218u, 4078182116u, 1269332353u,
+     332098007u, 2876706482u, 3116540252u,   25085497u, 2628386432u,  605395429u,  916469259u, 2384220526u,
+    2254837415u, 1054503362u,  745528876u, 2496903497u,  151290352u, 2981684885u, 2735556987u,  464596510u,
+    1137851976u, 4218313005u, 3923506883u, 1365741990u, 3434129695u, 1946996346u, 1723425172u, 3724871409u
+  },
+  {
+             0u, 1029712304u, 2059424608u, 1201699536u, 4118849216u, 3370159984u, 2403399072u, 2988497936u,
+     812665793u,  219177585u, 1253054625u, 2010132753u, 3320900865u, 4170237105u, 3207642721u, 2186319825u,
+    1625331586u, 1568718386u,  438355170u,  658566482u, 2506109250u, 2818578674u, 4020265506u, 3535817618u,
+    1351670851u, 1844508147u,  709922595u,  389064339u, 2769320579u, 2557498163u, 3754961379u, 3803185235u,
+    3250663172u, 4238411444u, 3137436772u, 2254525908u,  876710340u,  153198708u, 1317132964u, 1944187668u,
+    4054934725u, 3436268917u, 2339452837u, 3054575125u,   70369797u,  961670069u, 2129760613u, 1133623509u,
+    2703341702u, 2621542710u, 3689016294u, 3867263574u, 1419845190u, 1774270454u,  778128678u,  318858390u,
+    2438067015u, 2888948471u, 3952189479u, 3606153623u, 1691440519u, 1504803895u,  504432359u,  594620247u,
+    1492342857u, 1704161785u,  573770537u,  525542041u, 2910060169u, 2417219385u, 3618876905u, 3939730521u,
+    1753420680u, 1440954936u,  306397416u,  790849880u, 2634265928u, 2690882808u, 3888375336u, 3668168600u,
+     940822475u,   91481723u, 1121164459u, 2142483739u, 3448989963u, 4042473659u, 3075684971u, 2318603227u,
+     140739594u,  889433530u, 1923340138u, 1338244826u, 4259521226u, 3229813626u, 2267247018u, 3124975642u,
+    2570221389u, 2756861693u, 3824297005u, 3734113693u, 1823658381u, 1372780605u,  376603373u,  722643805u,
+    2839690380u, 2485261628u, 3548540908u, 4007806556u, 1556257356u, 1638052860u,  637716780u,  459464860u,
+    4191346895u, 3300051327u, 2199040943u, 3195181599u,  206718479u,  825388991u, 1989285231u, 1274166495u,
+    3382881038u, 4106388158u, 3009607790u, 2382549470u, 1008864718u,   21111934u, 1189240494u, 2072147742u,
+    2984685714u, 2357631266u, 3408323570u, 4131834434u, 1147541074u, 2030452706u, 1051084082u,   63335554u,
+    2174155603u, 3170292451u, 4216760371u, 3325460867u, 1947622803u, 1232499747u,  248909555u,  867575619u,
+    3506841360u, 3966111392u, 2881909872u, 2527485376u,  612794832u,  434546784u, 1581699760u, 1663499008u,
+    3782634705u, 3692447073u, 2612412337u, 2799048193u,  351717905u,  697754529u, 1849071985u, 1398190273u,
+    1881644950u, 1296545318u,  182963446u,  931652934u, 2242328918u, 3100053734u, 4284967478u, 3255255942u,
+    1079497815u, 2100821479u,  983009079u,  133672583u, 3050795671u, 2293717799u, 3474399735u, 4067887175u,
+     281479188u,  765927844u, 1778867060u, 1466397380u, 3846680276u, 3626469220u, 2676489652u, 2733102084u,
+     548881365u,  500656741u, 1517752501u, 1729575173u, 3577210133u, 3898068133u, 2952246901u, 2459410373u,
+    3910527195u, 3564487019u, 2480257979u, 2931134987u,  479546907u,  569730987u, 1716854139u, 1530213579u,
+    3647316762u, 3825568426u, 2745561210u, 2663766474u,  753206746u,  293940330u, 1445287610u, 1799716618u,
+    2314567513u, 3029685993u, 4080348217u, 3461678473u, 2088098201u, 1091956777u,  112560889u, 1003856713u,
+    3112514712u, 2229607720u, 3276105720u, 4263857736u, 1275433560u, 1902492648u,  918929720u,  195422344u,
+     685033439u,  364179055u, 1377080511u, 1869921551u, 3713294623u, 3761522863u, 2811507327u, 2599689167u,
+     413436958u,  633644462u, 1650777982u, 1594160846u, 3978570462u, 3494118254u, 2548332990u, 2860797966u,
+    1211387997u, 1968470509u,  854852413u,  261368461u, 3182753437u, 2161434413u, 3346310653u, 4195650637u,
+    2017729436u, 1160000044u,   42223868u, 1071931724u, 2378480988u, 2963576044u, 4144295484u, 3395602316u
+  },
+  {
+             0u, 3411858341u, 1304994059u, 2257875630u, 2609988118u, 1355649459u, 3596215069u,  486879416u,
+    3964895853u,  655315400u, 2711298918u, 1791488195u, 2009251963u, 3164476382u,  973758832u, 4048990933u,
+      64357019u, 3364540734u, 1310630800u, 2235723829u, 2554806413u, 1394316072u, 3582976390u,  517157411u,
+    4018503926u,  618222419u, 2722963965u, 1762783832u, 1947517664u, 3209171269u,  970744811u, 4068520014u,
+     128714038u, 3438335635u, 1248109629u, 2167961496u, 2621261600u, 1466012805u, 3522553387u,  447296910u,
+    3959392091u,  547575038u, 2788632144u, 1835791861u, 1886307661u, 3140622056u, 1034314822u, 4143626211u,
+      75106221u, 3475428360u, 1236444838u, 2196665603u, 2682996155u, 1421317662u, 3525567664u,  427767573u,
+    3895035328u,  594892389u, 2782995659u, 1857943406u, 1941489622u, 3101955187u, 1047553757u, 4113347960u,
+     257428076u, 3288652233u, 1116777319u, 2311878850u, 2496219258u, 1603640287u, 3640781169u,  308099796u,
+    3809183745u,  676813732u, 2932025610u, 1704983215u, 2023410199u, 3016104370u,  894593820u, 4262377657u,
+     210634999u, 3352484690u, 1095150076u, 2316991065u, 2535410401u, 1547934020u, 3671583722u,  294336591u,
+    3772615322u,  729897279u, 2903845777u, 1716123700u, 2068629644u, 2953845545u,  914647431u, 4258839074u,
+     150212442u, 3282623743u, 1161604689u, 2388688372u, 2472889676u, 1480171241u, 3735940167u,  368132066u,
+    3836185911u,  805002898u, 2842635324u, 1647574937u, 2134298401u, 3026852996u,  855535146u, 4188192143u,
+     186781121u, 3229539940u, 1189784778u, 2377547631u, 2427670487u, 1542429810u, 3715886812u,  371670393u,
+    3882979244u,  741170185u, 2864262823u, 1642462466u, 2095107514u, 3082559007u,  824732849u, 4201955092u,
+     514856152u, 3589064573u, 1400419795u, 2552522358u, 2233554638u, 1316849003u, 3370776517u,   62202976u,
+    4075001525u,  968836368u, 3207280574u, 1954014235u, 1769133219u, 2720925446u,  616199592u, 4024870413u,
+     493229635u, 3594175974u, 1353627464u, 2616354029u, 2264355925u, 1303087088u, 3409966430u,    6498043u,
+    4046820398u,  979978123u, 3170710821u, 2007099008u, 1789187640u, 2717386141u,  661419827u, 3962610838u,
+     421269998u, 3527459403u, 1423225061u, 2676515648u, 2190300152u, 1238466653u, 3477467891u,   68755798u,
+    4115633027u, 1041448998u, 3095868040u, 1943789869u, 1860096405u, 2776760880u,  588673182u, 3897205563u,
+     449450869u, 3516317904u, 1459794558u, 2623431131u, 2170245475u, 1242006214u, 3432247400u,  131015629u,
+    4137259288u, 1036337853u, 3142660115u, 1879958454u, 1829294862u, 2790523051u,  549483013u, 3952910752u,
+     300424884u, 3669282065u, 1545650111u, 2541513754u, 2323209378u, 1092980487u, 3350330793u,  216870412u,
+    4256931033u,  921128828u, 2960342482u, 2066738807u, 1714085583u, 2910195050u,  736264132u, 3770592353u,
+     306060335u, 3647131530u, 1610005796u, 2494197377u, 2309971513u, 1123257756u, 3295149874u,  255536279u,
+    4268596802u,  892423655u, 3013951305u, 2029645036u, 1711070292u, 2929725425u,  674528607u, 3815288570u,
+     373562242u, 3709388839u, 1535949449u, 2429577516u, 2379569556u, 1183418929u, 3223189663u,  188820282u,
+    4195850735u,  827017802u, 3084859620u, 2089020225u, 1636228089u, 2866415708u,  743340786u, 3876759895u,
+     361896217u, 3738094268u, 1482340370u, 2466671543u, 2382584591u, 1163888810u, 3284924932u,  144124321u,
+    4190215028u,  849168593u, 3020503679u, 2136336858u, 1649465698u, 2836138695u,  798521449u, 3838094284u
+  },
+  {
+             0u, 2792819636u, 2543784233u,  837294749u, 4098827283u, 1379413927u, 1674589498u, 3316072078u,
+     871321191u, 2509784531u, 2758827854u,   34034938u, 3349178996u, 1641505216u, 1346337629u, 4131942633u,
+    1742642382u, 3249117050u, 4030828007u, 1446413907u, 2475800797u,  904311657u,   68069876u, 2725880384u,
+    1412551337u, 4064729373u, 3283010432u, 1708771380u, 2692675258u,  101317902u,  937551763u, 2442587175u,
+    3485284764u, 1774858792u, 1478633653u, 4266992385u, 1005723023u, 2642744891u, 2892827814u,  169477906u,
+    4233263099u, 1512406095u, 1808623314u, 3451546982u,  136139752u, 2926205020u, 2676114113u,  972376437u,
+    2825102674u,  236236518u, 1073525883u, 2576072655u, 1546420545u, 4200303349u, 3417542760u, 1841601500u,
+    2609703733u, 1039917185u,  202635804u, 2858742184u, 1875103526u, 3384067218u, 4166835727u, 1579931067u,
+    1141601657u, 3799809741u, 3549717584u, 1977839588u, 2957267306u,  372464350u,  668680259u, 2175552503u,
+    2011446046u, 3516084394u, 3766168119u, 1175200131u, 2209029901u,  635180217u,  338955812u, 2990736784u,
+     601221559u, 2242044419u, 3024812190u,  306049834u, 3617246628u, 1911408144u, 1074125965u, 3866285881u,
+     272279504u, 3058543716u, 2275784441u,  567459149u, 3832906691u, 1107462263u, 1944752874u, 3583875422u,
+    2343980261u,  767641425u,  472473036u, 3126744696u, 2147051766u, 3649987394u, 3899029983u, 1309766251u,
+    3092841090u,  506333494u,  801510315u, 2310084639u, 1276520081u, 3932237093u, 3683203000u, 2113813516u,
+    3966292011u, 1243601823u, 2079834370u, 3716205238u,  405271608u, 3192979340u, 2411259153u,  701492901u,
+    3750207052u, 2045810168u, 1209569125u, 4000285905u,  734575199u, 2378150379u, 3159862134u,  438345922u,
+    2283203314u,  778166598u,  529136603u, 3120492655u, 2086260449u, 3660498261u, 3955679176u, 1303499900u,
+    3153699989u,  495890209u,  744928700u, 2316418568u, 1337360518u, 3921775410u, 3626602927u, 2120129051u,
+    4022892092u, 1237286280u, 2018993941u, 3726666913u,  461853231u, 3186645403u, 2350400262u,  711936178u,
+    3693557851u, 2052076527u, 1270360434u, 3989775046u,  677911624u, 2384402428u, 3220639073u,  427820757u,
+    1202443118u, 3789347034u, 3493118535u, 1984154099u, 3018127229u,  362020041u,  612099668u, 2181885408u,
+    1950653705u, 3526596285u, 3822816288u, 1168934804u, 2148251930u,  645706414u,  395618355u, 2984485767u,
+     544559008u, 2248295444u, 3085590153u,  295523645u, 3560598451u, 1917673479u, 1134918298u, 3855773998u,
+     328860103u, 3052210803u, 2214924526u,  577903450u, 3889505748u, 1101147744u, 1883911421u, 3594338121u,
+    3424493451u, 1785369663u, 1535282850u, 4260726038u,  944946072u, 2653270060u, 2949491377u,  163225861u,
+    4294103532u, 1501944408u, 1752023237u, 3457862513u,  196998655u, 2915761739u, 2619532502u,  978710370u,
+    2881684293u,  229902577u, 1012666988u, 2586515928u, 1603020630u, 4193987810u, 3356702335u, 1852063179u,
+    2553040162u, 1046169238u,  263412747u, 2848217023u, 1818454321u, 3390333573u, 4227627032u, 1569420204u,
+      60859927u, 2782375331u, 2487203646u,  843627658u, 4159668740u, 1368951216u, 1617990445u, 3322386585u,
+     810543216u, 2520310724u, 2815490393u,   27783917u, 3288386659u, 1652017111u, 1402985802u, 4125677310u,
+    1685994201u, 3255382381u, 4091620336u, 1435902020u, 2419138250u,  910562686u,  128847843u, 2715354199u,
+    1469150398u, 4058414858u, 3222168983u, 1719234083u, 2749255853u,   94984985u,  876691844u, 2453031472u
+  },
+  {
+             0u, 3433693342u, 1109723005u, 2391738339u, 2219446010u, 1222643300u, 3329165703u,  180685081u,
+    3555007413u,  525277995u, 2445286600u, 1567235158u, 1471092047u, 2600801745u,  361370162u, 3642757804u,
+    2092642603u, 2953916853u, 1050555990u, 4063508168u, 4176560081u,  878395215u, 3134470316u, 1987983410u,
+    2942184094u, 1676945920u, 3984272867u,  567356797u,  722740324u, 3887998202u, 1764827929u, 2778407815u,
+    4185285206u,  903635656u, 3142804779u, 2012833205u, 2101111980u, 2979425330u, 1058630609u, 4088621903u,
+     714308067u, 3862526333u, 1756790430u, 2753330688u, 2933487385u, 1651734407u, 3975966820u,  542535930u,
+    2244825981u, 1231508451u, 3353891840u,  188896414u,   25648519u, 3442302233u, 1134713594u, 2399689316u,
+    1445480648u, 2592229462u,  336416693u, 3634843435u, 3529655858u,  516441772u, 2420588879u, 1559052753u,
+     698204909u, 3845636723u, 1807271312u, 2803025166u, 2916600855u, 1635634313u, 4025666410u,  593021940u,
+    4202223960u,  919787974u, 3093159461u, 1962401467u, 2117261218u, 2996361020u, 1008193759u, 4038971457u,
+    1428616134u, 2576151384u,  386135227u, 3685348389u, 3513580860u,  499580322u, 2471098945u, 1608776415u,
+    2260985971u, 1248454893u, 3303468814u,  139259792u,   42591881u, 3458459159u, 1085071860u, 2349261162u,
+    3505103035u,  474062885u, 2463016902u, 1583654744u, 1419882049u, 2550902495u,  377792828u, 3660491170u,
+      51297038u, 3483679632u, 1093385331u, 2374089965u, 2269427188u, 1273935210u, 3311514249u,  164344343u,
+    2890961296u, 1627033870u, 4000683757u,  585078387u,  672833386u, 3836780532u, 1782552599u, 2794821769u,
+    2142603813u, 3005188795u, 1032883544u, 4047146438u, 4227826911u,  928351297u, 3118105506u, 1970307900u,
+    1396409818u, 2677114180u,  287212199u, 3719594553u, 3614542624u,  467372990u, 2505346141u, 1509854403u,
+    2162073199u, 1282711281u, 3271268626u,  240228748u,   76845205u, 3359543307u, 1186043880u, 2317064054u,
+     796964081u, 3811226735u, 1839575948u, 2702160658u, 2882189835u, 1734392469u, 3924802934u,  625327592u,
+    4234522436u,  818917338u, 3191908409u, 1927981223u, 2016387518u, 3028656416u,  973776579u, 4137723485u,
+    2857232268u, 1726474002u, 3899187441u,  616751215u,  772270454u, 3803048424u, 1814228491u, 2693328533u,
+    2041117753u, 3036871847u,  999160644u, 4146592730u, 4259508931u,  826864221u, 3217552830u, 1936586016u,
+    3606501031u,  442291769u, 2496909786u, 1484378436u, 1388107869u, 2652297411u,  278519584u, 3694387134u,
+      85183762u, 3384397196u, 1194773103u, 2342308593u, 2170143720u, 1307820918u, 3279733909u,  265733131u,
+    2057717559u, 3054258089u,  948125770u, 4096344276u, 4276898253u,  843467091u, 3167309488u, 1885556270u,
+    2839764098u, 1709792284u, 3949353983u,  667704161u,  755585656u, 3785577190u, 1865176325u, 2743489947u,
+     102594076u, 3401021058u, 1144549729u, 2291298815u, 2186770662u, 1325234296u, 3228729243u,  215514885u,
+    3589828009u,  424832311u, 2547870420u, 1534552650u, 1370645331u, 2635621325u,  328688686u, 3745342640u,
+    2211456353u, 1333405183u, 3254067740u,  224338562u,  127544219u, 3408931589u, 1170156774u, 2299866232u,
+    1345666772u, 2627681866u,  303053225u, 3736746295u, 3565105198u,  416624816u, 2522494803u, 1525692365u,
+    4285207626u,  868291796u, 3176010551u, 1910772649u, 2065767088u, 3079346734u,  956571085u, 4121828691u,
+     747507711u, 3760459617u, 1856702594u, 2717976604u, 2831417605u, 1684930971u, 3940615800u,  642451174u
+  }
+};
+
+#ifdef LODEPNG_X86_SIMD
+/*
+Folds 16-byte blocks with carry-less multiplication, as in Intel's "Fast CRC Computation for Generic
+Polynomials Using PCLMULQDQ Instruction", with the constants of the bit-reflected CRC32 polynomial.
+c is the CRC state before the final inversion, len must be a multiple of 16 and at least 64.
+*/
+__attribute__((target("sse2,pclmul")))
+static unsigned lodepng_crc32_pclmul(unsigned c, const unsigned char* buf, size_t len)
+{
+  /*the 33-bit constants 0x1c6e41596, 0x154442bd4, 0x0ccaa009e, 0x1751997d0, 0x163cd6124, 0x1f7011641
+  and 0x1db710641, as 32-bit halves*/
+  const __m128i k1k2 = _mm_set_epi32(1, (int)0xc6e41596u, 1, (int)0x54442bd4u);
+  const __m128i k3k4 = _mm_set_epi32(0, (int)0xccaa009eu, 1, (int)0x751997d0u);
+  const __m128i k5k0 = _mm_set_epi32(0, 0, 1, (int)0x63cd6124u);
+  const __m128i poly = _mm_set_epi32(1, (int)0xf7011641u, 1, (int)0xdb710641u);
+  const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+  __m128i x1, x2, x3, x4, t1, t2, t3, t4;
+
+  x1 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)buf), _mm_cvtsi32_si128((int)c));
+  x2 = _mm_loadu_si128((const __m128i*)(buf + 16));
+  x3 = _mm_loadu_si128((const __m128i*)(buf + 32));
+  x4 = _mm_loadu_si128((const __m128i*)(buf + 48));
+  buf += 64;
+  len -= 64;
+
+  /*fold 4 blocks in parallel while 64 bytes remain*/
+  while(len >= 64)
+  {
+    t1 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+    t2 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+    t3 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+    t4 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+    x1 = _mm_xor_si128(_mm_clmulepi64_si128(x1, k1k2, 0x11), t1);
+    x2 = _mm_xor_si128(_mm_clmulepi64_si128(x2, k1k2, 0x11), t2);
+    x3 = _mm_xor_si128(_mm_clmulepi64_si128(x3, k1k2, 0x11), t3);
+    x4 = _mm_xor_si128(_mm_clmulepi64_si128(x4, k1k2, 0x11), t4);
+    x1 = _mm_xor_si128(x1, _mm_loadu_si128((const __m128i*)buf));
+    x2 = _mm_xor_si128(x2, _mm_loadu_si128((const __m128i*)(buf + 16)));
+    x3 = _mm_xor_si128(x3, _mm_loadu_si128((const __m128i*)(buf + 32)));
+    x4 = _mm_xor_si128(x4, _mm_loadu_si128((const __m128i*)(buf + 48)));
+    buf += 64;
+    len -= 64;
+  }
+
+  /*fold the 4 blocks into one*/
+  t1 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), t1), x2);
+  t1 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), t1), x3);
+  t1 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), t1), x4);
+
+  /*fold the remaining 16-byte blocks one at a time*/
+  while(len >= 16)
+  {
+    t1 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), t1);
+    x1 = _mm_xor_si128(x1, _mm_loadu_si128((const __m128i*)buf));
+    buf += 16;
+    len -= 16;
+  }
+
+  /*fold 128 bits to 64*/
+  t1 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), t1);
+  t1 = _mm_srli_si128(x1, 4);
+  x1 = _mm_xor_si128(_mm_clmulepi64_si128(_mm_and_si128(x1, mask32), k5k0, 0x00), t1);
+
+  /*Barrett reduction to 32 bits*/
+  t1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), poly, 0x10);
+  t1 = _mm_clmulepi64_si128(_mm_and_si128(t1, mask32), poly, 0x00);
+  x1 = _mm_xor_si128(x1, t1);
+  return (unsigned)_mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
+}
+#endif /*LODEPNG_X86_SIMD*/
+
 /*Return the CRC of the bytes buf[0..len-1].*/
 unsigned lodepng_crc32(const unsigned char* buf, size_t len)
 {
   unsigned c = 0xffffffffL;
-  size_t n;
 
-  for(n = 0; n < len; ++n)
+#ifdef LODEPNG_X86_SIMD
+  if(len >= 64 && __builtin_cpu_supports("pclmul"))
   {
-    c = lodepng_crc32_table[(c ^ buf[n]) & 0xff] ^ (c >> 8);
+    size_t blocks = len & ~(size_t)15;
+    c = lodepng_crc32_pclmul(c, buf, blocks);
+    buf += blocks;
+    len -= blocks;
+  }
+#endif /*LODEPNG_X86_SIMD*/
+
+  if(len >= 16)
+  {
+    while(len >= 8)
+    {
+      c ^= (unsigned)buf[0] | ((unsigned)buf[1] << 8) | ((unsigned)buf[2] << 16) | ((unsigned)buf[3] << 24);
+      c = lodepng_crc32_slices[6][c & 0xff] ^ lodepng_crc32_slices[5][(c >> 8) & 0xff]
+        ^ lodepng_crc32_slices[4][(c >> 16) & 0xff] ^ lodepng_crc32_slices[3][c >> 24]
+        ^ lodepng_crc32_slices[2][buf[4]] ^ lodepng_crc32_slices[1][buf[5]]
+        ^ lodepng_crc32_slices[0][buf[6]] ^ lodepng_crc32_table[buf[7]];
+      buf += 8;
+      len -= 8;
+    }
+  }
+
+  while(len > 0)
+  {
+    c = lodepng_crc32_table[(c ^ *buf) & 0xff] ^ (c >> 8);
+    ++buf;
+    --len;
   }
   return c ^ 0xffffffffL;
 }
@@ -3863,16 +5003,165 @@ unsigned lodepng_inspect(unsigned* w, unsigned* h, LodePNGState* state,
     }
   }
 
-  /*error: only compression method 0 is allowed in the specification*/
-  if(info->compression_method != 0) CERROR_RETURN_ERROR(state->error, 32);
-  /*error: only filter method 0 is allowed in the specification*/
-  if(info->filter_method != 0) CERROR_RETURN_ERROR(state->error, 33);
-  /*error: only interlace methods 0 and 1 exist in the specification*/
-  if(info->interlace_method > 1) CERROR_RETURN_ERROR(state->error, 34);
+  /*error: only compression method 0 is allowed in the specification*/
+  if(info->compression_method != 0) CERROR_RETURN_ERROR(state->error, 32);
+  /*error: only filter method 0 is allowed in the specification*/
+  if(info->filter_method != 0) CERROR_RETURN_ERROR(state->error, 33);
+  /*error: only interlace methods 0 and 1 exist in the specification*/
+  if(info->interlace_method > 1) CERROR_RETURN_ERROR(state->error, 34);
+
+  state->error = checkColorValidity(info->color.colortype, info->color.bitdepth);
+  return state->error;
+}
+
+#ifdef LODEPNG_X86_SIMD
+/*
+SIMD unfilter of scanlines with 3 or 4 byte pixels. Sub, Average and Paeth depend on the pixel to the
+left, so they go one pixel at a time, but with all its channels at once like libpng does. Up has no
+such dependency and goes 16 bytes at a time for any pixel size.
+*/
+__attribute__((target("sse2")))
+static __m128i loadPixel(const unsigned char* p, size_t bytewidth)
+{
+  unsigned v;
+  /*3 bytes are combined in a register, copying them over a 4 byte variable in memory stalls*/
+  if(bytewidth == 4) memcpy(&v, p, 4);
+  else v = p[0] | ((unsigned)p[1] << 8) | ((unsigned)p[2] << 16);
+  return _mm_cvtsi32_si128((int)v);
+}
+
+__attribute__((target("sse2")))
+static void storePixel(unsigned char* p, __m128i pixel, size_t bytewidth)
+{
+  unsigned v = (unsigned)_mm_cvtsi128_si32(pixel);
+  if(bytewidth == 4) memcpy(p, &v, 4);
+  else
+  {
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+  }
+}
+
+__attribute__((target("sse2")))
+static void unfilterUp_sse2(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                            size_t length)
+{
+  size_t i;
+  for(i = 0; i + 16 <= length; i += 16)
+  {
+    __m128i x = _mm_loadu_si128((const __m128i*)&scanline[i]);
+    __m128i b = _mm_loadu_si128((const __m128i*)&precon[i]);
+    _mm_storeu_si128((__m128i*)&recon[i], _mm_add_epi8(x, b));
+  }
+  for(; i != length; ++i) recon[i] = scanline[i] + precon[i];
+}
+
+__attribute__((target("sse2")))
+static void unfilterSub_sse2(unsigned char* recon, const unsigned char* scanline, size_t bytewidth, size_t length)
+{
+  size_t i;
+  __m128i a = _mm_setzero_si128();
+  for(i = 0; i != length; i += bytewidth)
+  {
+    a = _mm_add_epi8(a, loadPixel(&scanline[i], bytewidth));
+    storePixel(&recon[i], a, bytewidth);
+  }
+}
+
+__attribute__((target("sse2")))
+static void unfilterAverage_sse2(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                                 size_t bytewidth, size_t length)
+{
+  size_t i;
+  const __m128i one = _mm_set1_epi8(1);
+  __m128i a = _mm_setzero_si128();
+  for(i = 0; i != length; i += bytewidth)
+  {
+    __m128i b = loadPixel(&precon[i], bytewidth);
+    /*pavgb rounds up, (a + b) / 2 rounds down when a + b is odd*/
+    __m128i average = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+    a = _mm_add_epi8(loadPixel(&scanline[i], bytewidth), average);
+    storePixel(&recon[i], a, bytewidth);
+  }
+}
+
+/*the choice of paethPredictor for 16-bit lanes, given the distances pa, pb and pc*/
+__attribute__((target("sse2")))
+static __m128i paethSelect(__m128i a, __m128i b, __m128i c, __m128i pa, __m128i pb, __m128i pc)
+{
+  __m128i use_c = _mm_and_si128(_mm_cmplt_epi16(pc, pa), _mm_cmplt_epi16(pc, pb));
+  __m128i use_b = _mm_cmplt_epi16(pb, pa);
+  __m128i ab = _mm_or_si128(_mm_and_si128(use_b, b), _mm_andnot_si128(use_b, a));
+  return _mm_or_si128(_mm_and_si128(use_c, c), _mm_andnot_si128(use_c, ab));
+}
 
-  state->error = checkColorValidity(info->color.colortype, info->color.bitdepth);
-  return state->error;
+__attribute__((target("sse2")))
+static void unfilterPaeth_sse2(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                               size_t bytewidth, size_t length)
+{
+  size_t i;
+  const __m128i zero = _mm_setzero_si128();
+  __m128i a = zero, c = zero; /*the pixels to the left, with channels in 16-bit lanes*/
+  for(i = 0; i != length; i += bytewidth)
+  {
+    __m128i b = _mm_unpacklo_epi8(loadPixel(&precon[i], bytewidth), zero);
+    __m128i bc = _mm_sub_epi16(b, c);
+    __m128i ac = _mm_sub_epi16(a, c);
+    __m128i abc = _mm_add_epi16(bc, ac);
+    __m128i pa = _mm_max_epi16(bc, _mm_sub_epi16(zero, bc));
+    __m128i pb = _mm_max_epi16(ac, _mm_sub_epi16(zero, ac));
+    __m128i pc = _mm_max_epi16(abc, _mm_sub_epi16(zero, abc));
+    __m128i predictor = paethSelect(a, b, c, pa, pb, pc);
+    __m128i x = _mm_add_epi8(loadPixel(&scanline[i], bytewidth), _mm_packus_epi16(predictor, predictor));
+    storePixel(&recon[i], x, bytewidth);
+    a = _mm_unpacklo_epi8(x, zero);
+    c = b;
+  }
+}
+
+/*the same with the pabsw instruction of SSSE3*/
+__attribute__((target("ssse3")))
+static void unfilterPaeth_ssse3(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                                size_t bytewidth, size_t length)
+{
+  size_t i;
+  const __m128i zero = _mm_setzero_si128();
+  __m128i a = zero, c = zero; /*the pixels to the left, with channels in 16-bit lanes*/
+  for(i = 0; i != length; i += bytewidth)
+  {
+    __m128i b = _mm_unpacklo_epi8(loadPixel(&precon[i], bytewidth), zero);
+    __m128i bc = _mm_sub_epi16(b, c);
+    __m128i ac = _mm_sub_epi16(a, c);
+    __m128i pa = _mm_abs_epi16(bc);
+    __m128i pb = _mm_abs_epi16(ac);
+    __m128i pc = _mm_abs_epi16(_mm_add_epi16(bc, ac));
+    __m128i predictor = paethSelect(a, b, c, pa, pb, pc);
+    __m128i x = _mm_add_epi8(loadPixel(&scanline[i], bytewidth), _mm_packus_epi16(predictor, predictor));
+    storePixel(&recon[i], x, bytewidth);
+    a = _mm_unpacklo_epi8(x, zero);
+    c = b;
+  }
+}
+
+/*unfilters the scanline and returns 1 if there is a SIMD version for its filter type and pixel size*/
+static int unfilterScanlineSIMD(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                                size_t bytewidth, unsigned char filterType, size_t length)
+{
+  int pixels = bytewidth == 3 || bytewidth == 4;
+  if(!__builtin_cpu_supports("sse2")) return 0;
+  if(filterType == 2 && precon) unfilterUp_sse2(recon, scanline, precon, length);
+  else if(filterType == 1 && pixels) unfilterSub_sse2(recon, scanline, bytewidth, length);
+  else if(filterType == 3 && pixels && precon) unfilterAverage_sse2(recon, scanline, precon, bytewidth, length);
+  else if(filterType == 4 && pixels && precon)
+  {
+    if(__builtin_cpu_supports("ssse3")) unfilterPaeth_ssse3(recon, scanline, precon, bytewidth, length);
+    else unfilterPaeth_sse2(recon, scanline, precon, bytewidth, length);
+  }
+  else return 0;
+  return 1;
 }
+#endif /*LODEPNG_X86_SIMD*/
 
 static unsigned unfilterScanline(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
                                  size_t bytewidth, unsigned char filterType, size_t length)
@@ -3887,6 +5176,9 @@ static unsigned unfilterScanline(unsigned char* recon, const unsigned char* scan
   */
 
   size_t i;
+#ifdef LODEPNG_X86_SIMD
+  if(unfilterScanlineSIMD(recon, scanline, precon, bytewidth, filterType, length)) return 0;
+#endif /*LODEPNG_X86_SIMD*/
   switch(filterType)
   {
     case 0:
@@ -3925,9 +5217,24 @@ static unsigned unfilterScanline(unsigned char* recon, const unsigned char* scan
         {
           recon[i] = (scanline[i] + precon[i]); /*paethPredictor(0, precon[i], 0) is always precon[i]*/
         }
-        for(i = bytewidth; i < length; ++i)
+        if(bytewidth == 1)
+        {
+          /*byte per byte, as in palette images: keep the left and upper left bytes instead of reloading them*/
+          unsigned char a = recon[0], c = precon[0];
+          for(i = 1; i < length; ++i)
+          {
+            unsigned char b = precon[i];
+            a = (unsigned char)(scanline[i] + paethPredictor(a, b, c));
+            recon[i] = a;
+            c = b;
+          }
+        }
+        else
         {
-          recon[i] = (scanline[i] + paethPredictor(recon[i - bytewidth], precon[i], precon[i - bytewidth]));
+          for(i = bytewidth; i < length; ++i)
+          {
+            recon[i] = (scanline[i] + paethPredictor(recon[i - bytewidth], precon[i], precon[i - bytewidth]));
+          }
         }
       }
       else
@@ -4426,18 +5733,15 @@ static unsigned readChunk_pHYs(LodePNGInfo* info, const unsigned char* data, siz
 }
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 
-/*read a PNG, the result will be in the same color type as the PNG (hence "generic")*/
-static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
-                          LodePNGState* state,
-                          const unsigned char* in, size_t insize)
+/*
+Reads the chunks after the header up to IEND into state->info_png, and the data of the IDAT
+chunks into idat. The header must be read by lodepng_inspect already.
+*/
+static void readChunks(LodePNGState* state, ucvector* idat, const unsigned char* in, size_t insize)
 {
   unsigned char IEND = 0;
   const unsigned char* chunk;
   size_t i;
-  ucvector idat; /*the data from idat chunks*/
-  ucvector scanlines;
-  size_t predict;
-  size_t numpixels;
 
   /*for unknown chunk order*/
   unsigned unknown = 0;
@@ -4445,21 +5749,6 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
   unsigned critical_pos = 1; /*1 = after IHDR, 2 = after PLTE, 3 = after IDAT*/
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 
-  /*provide some proper output values if error will happen*/
-  *out = 0;
-
-  state->error = lodepng_inspect(w, h, state, in, insize); /*reads header and resets other parameters in state->info_png*/
-  if(state->error) return;
-
-  numpixels = *w * *h;
-
-  /*multiplication overflow*/
-  if(*h != 0 && numpixels / *h != *w) CERROR_RETURN(state->error, 92);
-  /*multiplication overflow possible further below. Allows up to 2^31-1 pixel
-  bytes with 16-bit RGBA, the rest is room for filter bytes.*/
-  if(numpixels > 268435455) CERROR_RETURN(state->error, 92);
-
-  ucvector_init(&idat);
   chunk = &in[33]; /*first byte of the first chunk after the header*/
 
   /*loop through the chunks, ignoring unknown chunks and stopping at IEND chunk.
@@ -4487,9 +5776,9 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
     /*IDAT chunk, containing compressed image data*/
     if(lodepng_chunk_type_equals(chunk, "IDAT"))
     {
-      size_t oldsize = idat.size;
-      if(!ucvector_resize(&idat, oldsize + chunkLength)) CERROR_BREAK(state->error, 83 /*alloc fail*/);
-      for(i = 0; i != chunkLength; ++i) idat.data[oldsize + i] = data[i];
+      size_t oldsize = idat->size;
+      if(!ucvector_resize(idat, oldsize + chunkLength)) CERROR_BREAK(state->error, 83 /*alloc fail*/);
+      for(i = 0; i != chunkLength; ++i) idat->data[oldsize + i] = data[i];
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
       critical_pos = 3;
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
@@ -4583,6 +5872,35 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
     if(!IEND) chunk = lodepng_chunk_next_const(chunk);
   }
 
+}
+
+/*read a PNG, the result will be in the same color type as the PNG (hence "generic")*/
+static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
+                          LodePNGState* state,
+                          const unsigned char* in, size_t insize)
+{
+  ucvector idat; /*the data from idat chunks*/
+  ucvector scanlines;
+  size_t predict;
+  size_t numpixels;
+
+  /*provide some proper output values if error will happen*/
+  *out = 0;
+
+  state->error = lodepng_inspect(w, h, state, in, insize); /*reads header and resets other parameters in state->info_png*/
+  if(state->error) return;
+
+  numpixels = *w * *h;
+
+  /*multiplication overflow*/
+  if(*h != 0 && numpixels / *h != *w) CERROR_RETURN(state->error, 92);
+  /*multiplication overflow possible further below. Allows up to 2^31-1 pixel
+  bytes with 16-bit RGBA, the rest is room for filter bytes.*/
+  if(numpixels > 268435455) CERROR_RETURN(state->error, 92);
+
+  ucvector_init(&idat);
+  readChunks(state, &idat, in, insize);
+
   ucvector_init(&scanlines);
   /*predict output size, to allocate exact size for output buffer to avoid more dynamic allocation.
   If the decompressed size does not match the prediction, the image must be corrupt.*/
@@ -4670,6 +5988,135 @@ unsigned lodepng_decode(unsigned char** out, unsigned* w, unsigned* h,
   return state->error;
 }
 
+#ifdef LODEPNG_COMPILE_ZLIB
+struct LodePNGRowDecoder
+{
+  LodePNGState* state;
+  unsigned w, h;
+  ucvector idat; /*the data from idat chunks*/
+  InflateStream stream;
+  size_t linebytes; /*the size of a scanline of the PNG, without its filter type byte*/
+  /*two scanlines with their filter type byte, even and odd rows. Unfiltering needs the one above*/
+  unsigned char* lines;
+  unsigned next; /*the next row of the stream*/
+};
+
+unsigned lodepng_row_decoder_create(LodePNGRowDecoder** decoder, unsigned* w, unsigned* h,
+                                    LodePNGState* state,
+                                    const unsigned char* in, size_t insize)
+{
+  LodePNGRowDecoder* d;
+  unsigned error;
+
+  *decoder = 0;
+  state->error = lodepng_inspect(w, h, state, in, insize); /*reads header and resets other parameters in state->info_png*/
+  if(state->error) return state->error;
+
+  /*multiplication overflow, the same limit as lodepng_decode*/
+  if(*w * *h / *h != *w || *w * *h > 268435455) CERROR_RETURN_ERROR(state->error, 92);
+  /*the rows of the final image come from all 7 reduced images of Adam7*/
+  if(state->info_png.interlace_method != 0) CERROR_RETURN_ERROR(state->error, 94);
+
+  d = (LodePNGRowDecoder*)lodepng_malloc(sizeof(LodePNGRowDecoder));
+  if(!d) CERROR_RETURN_ERROR(state->error, 83); /*alloc fail*/
+  d->state = state;
+  d->w = *w;
+  d->h = *h;
+  d->next = 0;
+  d->linebytes = lodepng_get_raw_size_idat(*w, 1, &state->info_png.color);
+  d->lines = (unsigned char*)lodepng_malloc(2 * (d->linebytes + 1));
+  ucvector_init(&d->idat);
+
+  readChunks(state, &d->idat, in, insize);
+  error = inflateStream_init(&d->stream, d->idat.data, d->idat.size);
+  if(!state->error) state->error = error;
+  if(!state->error && !d->lines) state->error = 83; /*alloc fail*/
+
+  if(!state->error)
+  {
+    if(!state->decoder.color_convert)
+    {
+      state->error = lodepng_color_mode_copy(&state->info_raw, &state->info_png.color);
+    }
+    else if(!lodepng_color_mode_equal(&state->info_raw, &state->info_png.color)
+            && !(state->info_raw.colortype == LCT_RGB || state->info_raw.colortype == LCT_RGBA)
+            && !(state->info_raw.bitdepth == 8))
+    {
+      state->error = 56; /*unsupported color mode conversion*/
+    }
+  }
+
+  if(state->error)
+  {
+    lodepng_row_decoder_destroy(d);
+    return state->error;
+  }
+  *decoder = d;
+  return 0;
+}
+
+unsigned lodepng_row_decoder_read(LodePNGRowDecoder* decoder, unsigned char* out, unsigned y)
+{
+  LodePNGState* state = decoder->state;
+  size_t linebytes = decoder->linebytes;
+  /*bytewidth is used for filtering, is 1 when bpp < 8, number of bytes per pixel otherwise*/
+  size_t bytewidth = (lodepng_get_bpp(&state->info_png.color) + 7) / 8;
+  unsigned char* line;
+  size_t i;
+  unsigned error = 0;
+
+  if(y >= decoder->h) CERROR_RETURN_ERROR(state->error, 95);
+
+  /*the stream only goes forward, rows before the last one read start over from the first row*/
+  if(y + 1 < decoder->next)
+  {
+    inflateStream_rewind(&decoder->stream);
+    decoder->next = 0;
+  }
+
+  while(decoder->next <= y && !error)
+  {
+    unsigned char* scanline = &decoder->lines[(decoder->next & 1) * (linebytes + 1)];
+    const unsigned char* prevline = 0;
+    if(decoder->next != 0) prevline = &decoder->lines[((decoder->next - 1) & 1) * (linebytes + 1) + 1];
+
+    error = inflateStream_read(&decoder->stream, scanline, linebytes + 1);
+    if(!error) error = unfilterScanline(&scanline[1], &scanline[1], prevline, bytewidth, scanline[0], linebytes);
+    ++decoder->next;
+    /*after the last row only the end of the zlib stream and its adler32 are left*/
+    if(!error && decoder->next == decoder->h)
+    {
+      error = inflateStream_finish(&decoder->stream, &state->decoder.zlibsettings);
+    }
+  }
+  if(error)
+  {
+    /*the next read starts over*/
+    inflateStream_rewind(&decoder->stream);
+    decoder->next = 0;
+    CERROR_RETURN_ERROR(state->error, error);
+  }
+
+  line = &decoder->lines[(y & 1) * (linebytes + 1) + 1];
+  if(!state->decoder.color_convert || lodepng_color_mode_equal(&state->info_raw, &state->info_png.color))
+  {
+    for(i = 0; i != linebytes; ++i) out[i] = line[i];
+  }
+  else error = lodepng_convert(out, line, &state->info_raw, &state->info_png.color, decoder->w, 1);
+  state->error = error;
+  return error;
+}
+
+void lodepng_row_decoder_destroy(LodePNGRowDecoder* decoder)
+{
+  if(!decoder) return;
+  inflateStream_cleanup(&decoder->stream);
+  ucvector_cleanup(&decoder->idat);
+  lodepng_free(decoder->lines);
+  lodepng_free(decoder);
+}
+#endif /*LODEPNG_COMPILE_ZLIB*/
+
 unsigned lodepng_decode_memory(unsigned char** out, unsigned* w, unsigned* h, const unsigned char* in,
                                size_t insize, LodePNGColorType colortype, unsigned bitdepth)
 {
@@ -5046,6 +6493,37 @@ static unsigned addChunk_pHYs(ucvector* out, const LodePNGInfo* info)
 
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 
+#ifdef LODEPNG_X86_SIMD
+/*the Paeth filter for scanline[start..length-1] with a prevline, 8 bytes at a time in 16-bit lanes*/
+__attribute__((target("sse2")))
+static size_t filterPaeth_sse2(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
+                               size_t start, size_t length, size_t bytewidth)
+{
+  size_t i;
+  const __m128i zero = _mm_setzero_si128();
+  for(i = start; i + 8 <= length; i += 8)
+  {
+    __m128i a = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)&scanline[i - bytewidth]), zero);
+    __m128i b = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)&prevline[i]), zero);
+    __m128i c = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)&prevline[i - bytewidth]), zero);
+    __m128i bc = _mm_sub_epi16(b, c);
+    __m128i ac = _mm_sub_epi16(a, c);
+    __m128i abc = _mm_add_epi16(bc, ac);
+    __m128i pa = _mm_max_epi16(bc, _mm_sub_epi16(zero, bc));
+    __m128i pb = _mm_max_epi16(ac, _mm_sub_epi16(zero, ac));
+    __m128i pc = _mm_max_epi16(abc, _mm_sub_epi16(zero, abc));
+    /*the same choice as paethPredictor*/
+    __m128i use_c = _mm_and_si128(_mm_cmplt_epi16(pc, pa), _mm_cmplt_epi16(pc, pb));
+    __m128i use_b = _mm_cmplt_epi16(pb, pa);
+    __m128i ab = _mm_or_si128(_mm_and_si128(use_b, b), _mm_andnot_si128(use_b, a));
+    __m128i predictor = _mm_or_si128(_mm_and_si128(use_c, c), _mm_andnot_si128(use_c, ab));
+    __m128i s = _mm_loadl_epi64((const __m128i*)&scanline[i]);
+    _mm_storel_epi64((__m128i*)&out[i], _mm_sub_epi8(s, _mm_packus_epi16(predictor, predictor)));
+  }
+  return i;
+}
+#endif /*LODEPNG_X86_SIMD*/
+
 static void filterScanline(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
                            size_t length, size_t bytewidth, unsigned char filterType)
 {
@@ -5086,7 +6564,10 @@ static void filterScanline(unsigned char* out, const unsigned char* scanline, co
       {
         /*paethPredictor(0, prevline[i], 0) is always prevline[i]*/
         for(i = 0; i != bytewidth; ++i) out[i] = (scanline[i] - prevline[i]);
-        for(i = bytewidth; i < length; ++i)
+#ifdef LODEPNG_X86_SIMD
+        if(__builtin_cpu_supports("sse2")) i = filterPaeth_sse2(out, scanline, prevline, bytewidth, length, bytewidth);
+#endif /*LODEPNG_X86_SIMD*/
+        for(; i < length; ++i)
         {
           out[i] = (scanline[i] - paethPredictor(scanline[i - bytewidth], prevline[i], prevline[i - bytewidth]));
         }
@@ -5111,46 +6592,91 @@ static float flog2(float f)
   return result + 1.442695f * (f * f * f / 3 - 3 * f * f / 2 + 3 * f - 1.83333f);
 }
 
-static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w, unsigned h,
-                       const LodePNGColorMode* info, const LodePNGEncoderSettings* settings)
+/*
+The sum of the minimum sum of absolute differences heuristic. The bytes of differences are treated as
+signed: values above 127 are negative and count as 255 - value. Filter type 0 isn't a difference though,
+so it uses unsigned bytes. This means filter type 0 is almost never chosen, but that is justified.
+*/
+static size_t filterSumScalar(const unsigned char* data, size_t start, size_t length, unsigned type)
 {
-  /*
-  For PNG filter method 0
-  out must be a buffer with as size: h + (w * h * bpp + 7) / 8, because there are
-  the scanlines with 1 extra byte per scanline
-  */
+  size_t i, sum = 0;
+  if(type == 0)
+  {
+    for(i = start; i != length; ++i) sum += data[i];
+  }
+  else
+  {
+    for(i = start; i != length; ++i) sum += data[i] < 128 ? data[i] : (255U - data[i]);
+  }
+  return sum;
+}
 
-  unsigned bpp = lodepng_get_bpp(info);
-  /*the width of a scanline in bytes, not including the filter type*/
-  size_t linebytes = (w * bpp + 7) / 8;
-  /*bytewidth is used for filtering, is 1 when bpp < 8, number of bytes per pixel otherwise*/
-  size_t bytewidth = (bpp + 7) / 8;
-  const unsigned char* prevline = 0;
-  unsigned x, y;
-  unsigned error = 0;
-  LodePNGFilterStrategy strategy = settings->filter_strategy;
+#ifdef LODEPNG_X86_SIMD
+/*for negative signed bytes, 255 - value is value with all bits flipped. psadbw adds up 8 bytes at a time*/
+__attribute__((target("sse2")))
+static size_t filterSum_sse2(const unsigned char* data, size_t length, unsigned type)
+{
+  size_t i;
+  const __m128i zero = _mm_setzero_si128();
+  __m128i sum = zero;
+  for(i = 0; i + 16 <= length; i += 16)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i*)&data[i]);
+    if(type != 0) v = _mm_xor_si128(v, _mm_cmplt_epi8(v, zero));
+    sum = _mm_add_epi64(sum, _mm_sad_epu8(v, zero));
+  }
+  /*add the two 64-bit lanes, then take the low and high 32 bits of the total*/
+  sum = _mm_add_epi64(sum, _mm_srli_si128(sum, 8));
+  return (size_t)(unsigned)_mm_cvtsi128_si32(sum)
+       + (((size_t)(unsigned)_mm_cvtsi128_si32(_mm_srli_si128(sum, 4)) << 16) << 16)
+       + filterSumScalar(data, i, length, type);
+}
+#endif /*LODEPNG_X86_SIMD*/
 
-  /*
-  There is a heuristic called the minimum sum of absolute differences heuristic, suggested by the PNG standard:
-   *  If the image type is Palette, or the bit depth is smaller than 8, then do not filter the image (i.e.
-      use fixed filtering, with the filter None).
-   * (The other case) If the image type is Grayscale or RGB (with or without Alpha), and the bit depth is
-     not smaller than 8, then use adaptive filtering heuristic as follows: independently for each row, apply
-     all five filters and select the filter that produces the smallest sum of absolute values per row.
-  This heuristic is used if filter strategy is LFS_MINSUM and filter_palette_zero is true.
+static size_t filterSum(const unsigned char* data, size_t length, unsigned type)
+{
+#ifdef LODEPNG_X86_SIMD
+  if(__builtin_cpu_supports("sse2")) return filterSum_sse2(data, length, type);
+#endif /*LODEPNG_X86_SIMD*/
+  return filterSumScalar(data, 0, length, type);
+}
 
-  If filter_palette_zero is true and filter_strategy is not LFS_MINSUM, the above heuristic is followed,
-  but for "the other case", whatever strategy filter_strategy is set to instead of the minimum sum
-  heuristic is used.
-  */
-  if(settings->filter_palette_zero &&
-     (info->colortype == LCT_PALETTE || info->bitdepth < 8)) strategy = LFS_ZERO;
+/*
+Scanlines are filtered in bands that can run on separate threads, the filter of a scanline only
+depends on the scanline above it in the unfiltered image
+*/
+typedef struct FilterBand
+{
+  unsigned char* out;
+  const unsigned char* in;
+  size_t linebytes;
+  size_t bytewidth;
+  unsigned ystart, yend; /*the scanlines of the band*/
+  LodePNGFilterStrategy strategy;
+  const LodePNGEncoderSettings* settings;
+  /*for LFS_ENTROPY, the entropy of a byte value that occurs n times in a scanline is entropy[n]*/
+  const float* entropy;
+  unsigned error;
+} FilterBand;
 
-  if(bpp == 0) return 31; /*error: invalid color type*/
+/*bands have at least this many bytes, to be worth a thread*/
+#define FILTER_BAND_MIN_BYTES 65536u
+
+static void filterBand(void* context)
+{
+  FilterBand* band = (FilterBand*)context;
+  unsigned char* out = band->out;
+  const unsigned char* in = band->in;
+  size_t linebytes = band->linebytes;
+  size_t bytewidth = band->bytewidth;
+  const LodePNGEncoderSettings* settings = band->settings;
+  LodePNGFilterStrategy strategy = band->strategy;
+  const unsigned char* prevline = band->ystart == 0 ? 0 : &in[(band->ystart - 1) * linebytes];
+  unsigned x, y;
 
   if(strategy == LFS_ZERO)
   {
-    for(y = 0; y != h; ++y)
+    for(y = band->ystart; y != band->yend; ++y)
     {
       size_t outindex = (1 + linebytes) * y; /*the extra filterbyte added to each row*/
       size_t inindex = linebytes * y;
@@ -5170,12 +6696,12 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
     for(type = 0; type != 5; ++type)
     {
       ucvector_init(&attempt[type]);
-      if(!ucvector_resize(&attempt[type], linebytes)) return 83; /*alloc fail*/
+      if(!ucvector_resize(&attempt[type], linebytes)) band->error = 83; /*alloc fail*/
     }
 
-    if(!error)
+    if(!band->error)
     {
-      for(y = 0; y != h; ++y)
+      for(y = band->ystart; y != band->yend; ++y)
       {
         /*try the 5 filter types*/
         for(type = 0; type != 5; ++type)
@@ -5183,22 +6709,7 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
           filterScanline(attempt[type].data, &in[y * linebytes], prevline, linebytes, bytewidth, type);
 
           /*calculate the sum of the result*/
-          sum[type] = 0;
-          if(type == 0)
-          {
-            for(x = 0; x != linebytes; ++x) sum[type] += (unsigned char)(attempt[type].data[x]);
-          }
-          else
-          {
-            for(x = 0; x != linebytes; ++x)
-            {
-              /*For differences, each byte should be treated as signed, values above 127 are negative
-              (converted to signed char). Filtertype 0 isn't a difference though, so use unsigned there.
-              This means filtertype 0 is almost never chosen, but that is justified.*/
-              unsigned char s = attempt[type].data[x];
-              sum[type] += s < 128 ? s : (255U - s);
-            }
-          }
+          sum[type] = filterSum(attempt[type].data, linebytes, type);
 
           /*check if this is smallest sum (or if type == 0 it's the first case so always store the values)*/
           if(type == 0 || sum[type] < smallest)
@@ -5229,10 +6740,10 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
     for(type = 0; type != 5; ++type)
     {
       ucvector_init(&attempt[type]);
-      if(!ucvector_resize(&attempt[type], linebytes)) return 83; /*alloc fail*/
+      if(!ucvector_resize(&attempt[type], linebytes)) band->error = 83; /*alloc fail*/
     }
 
-    for(y = 0; y != h; ++y)
+    for(y = band->ystart; y != band->yend && !band->error; ++y)
     {
       /*try the 5 filter types*/
       for(type = 0; type != 5; ++type)
@@ -5242,11 +6753,7 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
         for(x = 0; x != linebytes; ++x) ++count[attempt[type].data[x]];
         ++count[type]; /*the filter type itself is part of the scanline*/
         sum[type] = 0;
-        for(x = 0; x != 256; ++x)
-        {
-          float p = count[x] / (float)(linebytes + 1);
-          sum[type] += count[x] == 0 ? 0 : flog2(1 / p) * p;
-        }
+        for(x = 0; x != 256; ++x) sum[type] += band->entropy[count[x]];
         /*check if this is smallest sum (or if type == 0 it's the first case so always store the values)*/
         if(type == 0 || sum[type] < smallest)
         {
@@ -5266,7 +6773,7 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
   }
   else if(strategy == LFS_PREDEFINED)
   {
-    for(y = 0; y != h; ++y)
+    for(y = band->ystart; y != band->yend; ++y)
     {
       size_t outindex = (1 + linebytes) * y; /*the extra filterbyte added to each row*/
       size_t inindex = linebytes * y;
@@ -5296,12 +6803,14 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
     images only, so disable it*/
     zlibsettings.custom_zlib = 0;
     zlibsettings.custom_deflate = 0;
+    /*the bands already run on the threads*/
+    zlibsettings.threads = 1;
     for(type = 0; type != 5; ++type)
     {
       ucvector_init(&attempt[type]);
       ucvector_resize(&attempt[type], linebytes); /*todo: give error if resize failed*/
     }
-    for(y = 0; y != h; ++y) /*try the 5 filter types*/
+    for(y = band->ystart; y != band->yend; ++y) /*try the 5 filter types*/
     {
       for(type = 0; type != 5; ++type)
       {
@@ -5326,7 +6835,96 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
     }
     for(type = 0; type != 5; ++type) ucvector_cleanup(&attempt[type]);
   }
-  else return 88; /* unknown filter strategy */
+  else band->error = 88; /* unknown filter strategy */
+}
+
+static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w, unsigned h,
+                       const LodePNGColorMode* info, const LodePNGEncoderSettings* settings)
+{
+  /*
+  For PNG filter method 0
+  out must be a buffer with as size: h + (w * h * bpp + 7) / 8, because there are
+  the scanlines with 1 extra byte per scanline
+  */
+
+  unsigned bpp = lodepng_get_bpp(info);
+  /*the width of a scanline in bytes, not including the filter type*/
+  size_t linebytes = (w * bpp + 7) / 8;
+  /*bytewidth is used for filtering, is 1 when bpp < 8, number of bytes per pixel otherwise*/
+  size_t bytewidth = (bpp + 7) / 8;
+  unsigned i, numbands = 1;
+  unsigned error = 0;
+  float* entropy = 0;
+  FilterBand* bands;
+  LodePNGFilterStrategy strategy = settings->filter_strategy;
+
+  /*
+  There is a heuristic called the minimum sum of absolute differences heuristic, suggested by the PNG standard:
+   *  If the image type is Palette, or the bit depth is smaller than 8, then do not filter the image (i.e.
+      use fixed filtering, with the filter None).
+   * (The other case) If the image type is Grayscale or RGB (with or without Alpha), and the bit depth is
+     not smaller than 8, then use adaptive filtering heuristic as follows: independently for each row, apply
+     all five filters and select the filter that produces the smallest sum of absolute values per row.
+  This heuristic is used if filter strategy is LFS_MINSUM and filter_palette_zero is true.
+
+  If filter_palette_zero is true and filter_strategy is not LFS_MINSUM, the above heuristic is followed,
+  but for "the other case", whatever strategy filter_strategy is set to instead of the minimum sum
+  heuristic is used.
+  */
+  if(settings->filter_palette_zero &&
+     (info->colortype == LCT_PALETTE || info->bitdepth < 8)) strategy = LFS_ZERO;
+
+  if(bpp == 0) return 31; /*error: invalid color type*/
+
+  /*the adaptive strategies are worth running on the threads of the zlib settings*/
+  if(strategy == LFS_MINSUM || strategy == LFS_ENTROPY || strategy == LFS_BRUTE_FORCE)
+  {
+    size_t maxbands = linebytes * h / FILTER_BAND_MIN_BYTES;
+    numbands = settings->zlibsettings.threads;
+    if(numbands > maxbands) numbands = (unsigned)maxbands;
+    if(numbands < 1) numbands = 1;
+  }
+
+  if(strategy == LFS_ENTROPY)
+  {
+    /*a byte value can occur up to linebytes + 1 times in a scanline with its filter type*/
+    size_t n;
+    entropy = (float*)lodepng_malloc(sizeof(float) * (linebytes + 2));
+    if(!entropy) return 83; /*alloc fail*/
+    entropy[0] = 0;
+    for(n = 1; n != linebytes + 2; ++n)
+    {
+      float p = n / (float)(linebytes + 1);
+      entropy[n] = flog2(1 / p) * p;
+    }
+  }
+
+  bands = (FilterBand*)lodepng_malloc(sizeof(FilterBand) * numbands);
+  if(!bands) error = 83; /*alloc fail*/
+  else
+  {
+    for(i = 0; i != numbands; ++i)
+    {
+      bands[i].out = out;
+      bands[i].in = in;
+      bands[i].linebytes = linebytes;
+      bands[i].bytewidth = bytewidth;
+      /*h * i / numbands without overflow*/
+      bands[i].ystart = h / numbands * i + h % numbands * i / numbands;
+      bands[i].yend = h / numbands * (i + 1) + h % numbands * (i + 1) / numbands;
+      bands[i].strategy = strategy;
+      bands[i].settings = settings;
+      bands[i].entropy = entropy;
+      bands[i].error = 0;
+    }
+
+    runParallel(filterBand, bands, sizeof(FilterBand), numbands);
+
+    for(i = 0; i != numbands && !error; ++i) error = bands[i].error;
+  }
+
+  lodepng_free(bands);
+  lodepng_free(entropy);
 
   return error;
 }
@@ -5798,6 +7396,16 @@ void lodepng_encoder_settings_init(LodePNGEncoderSettings* settings)
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 }
 
+void lodepng_encoder_settings_set_fast(LodePNGEncoderSettings* settings)
+{
+  settings->auto_convert = 0;
+  settings->filter_palette_zero = 1;
+  settings->filter_strategy = LFS_ZERO;
+  lodepng_compress_settings_set_level(&settings->zlibsettings, 1);
+  /*only repeats of the previous byte, encoded without hash chains*/
+  settings->zlibsettings.windowsize = 1;
+}
+
 #endif /*LODEPNG_COMPILE_ENCODER*/
 #endif /*LODEPNG_COMPILE_PNG*/
 
@@ -5903,6 +7511,8 @@ const char* lodepng_error_text(unsigned code)
     case 91: return "invalid decompressed idat size";
     case 92: return "too many pixels, not supported";
     case 93: return "zero width or height is invalid";
+    case 94: return "the row decoder doesn't support Adam7 interlaced images";
+    case 95: return "row number outside of the image";
   }
   return "unknown error code";
 }
@@ -71,6 +71,16 @@ the custom_zlib field of the compress and decompress settings*/
 #ifndef LODEPNG_NO_COMPILE_ERROR_TEXT
 #define LODEPNG_COMPILE_ERROR_TEXT
 #endif
+/*SSSE3, AVX2 and PCLMULQDQ versions of the checksums, used on x86 CPUs that support them,
+checked at runtime. Only available with GCC compatible compilers*/
+#ifndef LODEPNG_NO_COMPILE_X86_SIMD
+#define LODEPNG_COMPILE_X86_SIMD
+#endif
+/*run the deflate blocks of the threads setting on Win32 or POSIX threads. If disabled,
+the same blocks are compressed one after another. Needs -lpthread on POSIX systems*/
+#ifndef LODEPNG_NO_COMPILE_THREADS
+#define LODEPNG_COMPILE_THREADS
+#endif
 /*Compile the default allocators (C's free, malloc and realloc). If you disable this,
 you can define the functions lodepng_free, lodepng_malloc and lodepng_realloc in your
 source files with custom allocators.*/
@@ -288,6 +298,10 @@ struct LodePNGCompressSettings /*deflate = compress*/
   unsigned minmatch; /*mininum lz77 length. 3 is normally best, 6 can be better for some PNGs. Default: 0*/
   unsigned nicematch; /*stop searching if >= this length found. Set to 258 for best compression. Default: 128*/
   unsigned lazymatching; /*use lazy matching: better compression but a bit slower. Default: true*/
+  unsigned maxchainlength; /*most earlier positions compared per byte. 0 derives it from windowsize. Default: 0*/
+  unsigned goodmatch; /*compare a quarter as many positions after a match this long. 0 disables it. Default: 0*/
+  unsigned maxlazymatch; /*only try lazy matching for shorter matches. 0 derives it from windowsize. Default: 0*/
+  unsigned threads; /*if > 1, deflate large inputs in independent blocks on this many threads. Default: 1*/
 
   /*use custom zlib encoder instead of built in one (default: null)*/
   unsigned (*custom_zlib)(unsigned char**, size_t*,
@@ -305,6 +319,8 @@ struct LodePNGCompressSettings /*deflate = compress*/
 
 extern const LodePNGCompressSettings lodepng_default_compress_settings;
 void lodepng_compress_settings_init(LodePNGCompressSettings* settings);
+/*sets the LZ77 settings like zlib's compression levels: 0 is no compression, 1 is fastest, 9 compresses most*/
+void lodepng_compress_settings_set_level(LodePNGCompressSettings* settings, unsigned level);
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 #ifdef LODEPNG_COMPILE_PNG
@@ -612,6 +628,9 @@ typedef struct LodePNGEncoderSettings
 } LodePNGEncoderSettings;
 
 void lodepng_encoder_settings_init(LodePNGEncoderSettings* settings);
+/*speed first settings: no automatic color type (the PNG gets the color type of info_png,
+so set it to that of info_raw), no filters and only run length encoding in deflate*/
+void lodepng_encoder_settings_set_fast(LodePNGEncoderSettings* settings);
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 
@@ -657,6 +676,28 @@ information is placed in the info_png field of the LodePNGState.
 unsigned lodepng_inspect(unsigned* w, unsigned* h,
                          LodePNGState* state,
                          const unsigned char* in, size_t insize);
+
+#ifdef LODEPNG_COMPILE_ZLIB
+/*
+Decodes a PNG one row at a time, see "4. Decoding" in the manual below. The memory
+used is that of a few rows and the compressed data, never the whole image.
+*/
+typedef struct LodePNGRowDecoder LodePNGRowDecoder;
+
+/*
+Reads the chunks of the PNG and outputs its size in w and h. state and in must stay
+valid until the decoder is destroyed. On error *decoder is NULL.
+*/
+unsigned lodepng_row_decoder_create(LodePNGRowDecoder** decoder, unsigned* w, unsigned* h,
+                                    LodePNGState* state,
+                                    const unsigned char* in, size_t insize);
+/*
+Outputs row y in the color mode of state->info_raw, lodepng_get_raw_size(w, 1, &state->info_raw)
+bytes. Going to the next row is fast, going back to earlier rows decompresses from the start again.
+*/
+unsigned lodepng_row_decoder_read(LodePNGRowDecoder* decoder, unsigned char* out, unsigned y);
+void lodepng_row_decoder_destroy(LodePNGRowDecoder* decoder);
+#endif /*LODEPNG_COMPILE_ZLIB*/
 #endif /*LODEPNG_COMPILE_DECODER*/
 
 
@@ -1103,6 +1144,22 @@ is done, the resulting data will be as it was in the PNG (after decompression)
 and you'll have to puzzle the colors of the pixels together yourself using the
 color type information in the LodePNGInfo.
 
+Decoding row by row
+-------------------
+
+lodepng_row_decoder_create, lodepng_row_decoder_read and lodepng_row_decoder_destroy
+decode a PNG without holding the whole raw image in memory, only the compressed data,
+two scanlines and the 32 KB window of the decompressor. It's meant for images that are
+processed one row at a time, such as quantizing them with libimagequant's
+liq_image_create_custom. Each row is output in the color mode of info_raw, with the
+padding bits of the last byte of a row if the bit depth is below 8.
+
+Rows are decompressed in order. Reading the same row again or the next one is cheap,
+reading an earlier one decompresses the image again from its first row. Adam7
+interlaced images can't be decoded this way and give error 94. The settings
+custom_zlib and custom_inflate aren't used, the rows always come from the built in
+inflate.
+
 
 5. Encoding
 -----------
@@ -1167,6 +1224,18 @@ can encode the colors of all pixels without information loss.
    true for proper compression.
 *) windowsize: the window size used by the LZ77 encoder (1 - 32768). Has value
    2048 by default, but can be set to 32768 for better, but slow, compression.
+   With 1, only runs of equal bytes are encoded, which is the fastest.
+*) maxchainlength, goodmatch, maxlazymatch, nicematch: limits of the LZ77 match
+   search, like those of zlib. lodepng_compress_settings_set_level sets them, and
+   the window size, to presets like zlib's compression levels 1-9. Level 6 with
+   its 32768 window compresses better than the defaults and is faster.
+*) threads: if more than 1, inputs larger than 128 KB are split into blocks of
+   128 KB that are deflated independently on up to this many threads, each one
+   still finding matches in the window of data before it. The blocks are joined
+   into one zlib stream. The output is the same for any number of threads above
+   1, and slightly larger than with 1 thread. The encoder also runs the
+   LFS_MINSUM, LFS_ENTROPY and LFS_BRUTE_FORCE filter strategies on bands of
+   scanlines of at least 64 KB on these threads, which chooses the same filters.
 *) force_palette: if colortype is 2 or 6, you can make the encoder write a PLTE
    chunk if force_palette is true. This can used as suggested palette to convert
    to by viewers that don't support more than 256 colors (if those still exist)
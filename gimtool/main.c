@@ -4,7 +4,11 @@
 #include <assert.h>
 #include <string.h>
 #include <ctype.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
 #include "lodepng.h"
+#include "pngzlib.h"
 #include "pngquant/libimagequant.h"
 
 #define LONIBBLE(x)  ((uint8_t) ((uint8_t) (x) & (uint8_t) 0x0F))
@@ -13,6 +17,9 @@
 #define TYPE_8BPP 0x13
 #define TYPE_4BPP 0x14
 
+// swizzle_8bpp() only moves pixels within bands of this many rows
+#define SWIZZLE_BAND_HEIGHT 16
+
 typedef struct gimHeader {
 	char magic[16];
 	char title[16];
@@ -122,6 +129,21 @@ void PaletteFilter(uint32_t *unfiltered, uint32_t *filtered, int length)
 	}
 }
 
+// Swizzles 8bpp image in place, using a buffer of only SWIZZLE_BAND_HEIGHT rows
+void swizzle_8bpp_in_place(uint8_t *pixels, size_t width, size_t height)
+{
+	uint8_t *band = malloc(width * SWIZZLE_BAND_HEIGHT);
+
+	for(size_t y = 0; y < height; y += SWIZZLE_BAND_HEIGHT)
+	{
+		size_t band_height = height - y < SWIZZLE_BAND_HEIGHT ? height - y : SWIZZLE_BAND_HEIGHT;
+		memcpy(band, pixels + y * width, width * band_height);
+		swizzle_8bpp(band, pixels + y * width, width, band_height);
+	}
+
+	free(band);
+}
+
 void printGimHeader(gimHeader_t *header)
 {
 	/*
@@ -167,6 +189,65 @@ void printGimHeader(gimHeader_t *header)
 	printf("%02X\n", header->unk12);
 }
 
+// Number of CPUs on Windows and POSIX, 1 where it can't be found
+unsigned cpuCount()
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	long count = info.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+#else
+	long count = 1;
+#endif
+	return count > 0 ? (unsigned)count : 1;
+}
+
+// Converts a GIM palette color to RGBA, replacing its alpha in 0-128 range with the same in 0-255 range
+uint32_t gimColorToRgba(uint32_t color)
+{
+	uint8_t alpha = color >> 24;
+
+	if(alpha > 0)
+		alpha = (alpha <<1)-1;  // scale from 0-128 to 0-255 range
+
+	return (color & 0x00ffffff) | ((uint32_t)alpha << 24);
+}
+
+// Sets up state to store the palette indices of a GIM as they are, with lodepng's fast settings
+void setFastPalette(LodePNGState *state, const uint32_t *palette, int colors)
+{
+	lodepng_encoder_settings_set_fast(&state->encoder);
+	state->info_raw.colortype = LCT_PALETTE;
+	state->info_raw.bitdepth = 8;
+	for(int i = 0; i < colors; i++)
+	{
+		uint32_t color = gimColorToRgba(palette[i]);
+		lodepng_palette_add(&state->info_raw, color & 0xff, (color >> 8) & 0xff, (color >> 16) & 0xff, color >> 24);
+	}
+	lodepng_color_mode_copy(&state->info_png.color, &state->info_raw);
+}
+
+// The PNG that libimagequant reads one row at a time in low memory mode
+typedef struct pngRows {
+	LodePNGRowDecoder *decoder;
+	unsigned error; // the first error, the row callback can't return it
+} pngRows_t;
+
+// liq_image_get_rgba_row_callback decoding the rows of a pngRows_t as RGBA
+void readPngRow(liq_color row_out[], int row, int width, void *user_info)
+{
+	pngRows_t *rows = user_info;
+	unsigned err = lodepng_row_decoder_read(rows->decoder, (unsigned char *)row_out, row);
+	if(err)
+	{
+		memset(row_out, 0, width * sizeof(liq_color));
+		if(!rows->error)
+			rows->error = err;
+	}
+}
+
 void printcsvheader()
 {
 	printf("magic, title, type, width, height, dataOffset, paletteOffset, unk1, unk2, unk3, unk4, unk5, unk6, unk7, unk8, unk9, unk10, unk11, unk12\n");
@@ -183,15 +264,27 @@ int main(int argc, char* argv[])
 	uint32_t*		imageData;
 	size_t 			gimLength;
 	gimHeader_t*	header;
+	int				lowMemory = 0;
+	int				fast = 0;
 
 	if( argc < 3 ) {
 		printf("gim2png - Converts Initial D Special Stage GIM textures to/from PNG files.\n");
 		printf("Usage:\n");
-		printf("Extract: %s e <file.gim>\n", argv[0]);
-		printf("Inject: %s i <file.gim>\n", argv[0]);
+		printf("Extract: %s e <file.gim> [--fast]\n", argv[0]);
+		printf("Inject: %s i <file.gim> [--low-memory]\n", argv[0]);
+		printf("  --fast        write the palette as it is with minimal compression (faster, larger files)\n");
+		printf("  --low-memory  decode and quantize the PNG a row at a time, without keeping copies of the image (slower, lower quality)\n");
 		return EXIT_FAILURE;
 	}
 
+	for(int i = 3; i < argc; i++)
+	{
+		if(strcmp(argv[i], "--low-memory") == 0)
+			lowMemory = 1;
+		else if(strcmp(argv[i], "--fast") == 0)
+			fast = 1;
+	}
+
 	mode = tolower(argv[1][0]);
 	//mode = 'i';
 	gimPath = argv[2];
@@ -240,41 +333,62 @@ int main(int argc, char* argv[])
 			free(filtered);
 		}
 
+		LodePNGState state;
+		unsigned char *png = NULL;
+		size_t pngSize = 0;
+		lodepng_state_init(&state);
+		pngzlib_init(&state);
+		// lodepng writes the same bytes for any number of threads above 1, so use at least 2 to get the
+		// same PNG files on single CPU machines as on the others
+		unsigned cpus = cpuCount();
+		state.encoder.zlibsettings.threads = cpus < 2 ? 2 : cpus;
+
 		imageData = malloc(header->width * header->height * 4);
-		for(int i = 0; i < (header->width * header->height); i++)
+		if(fast && (header->type == TYPE_8BPP || header->type == TYPE_4BPP))
 		{
-			if(header->type == TYPE_8BPP)
+			// one byte palette index per pixel instead of RGBA
+			uint8_t *indices = (uint8_t *)imageData;
+			for(int i = 0; i < (header->width * header->height); i++)
 			{
-				uint8_t pixel = *((uint8_t*)header->dataOffset + i);
-				uint8_t alpha = (*((uint32_t*)header->paletteOffset + pixel) >> 24);
-
-				if(alpha > 0)
-					alpha = (alpha <<1)-1;  // scale from 0-128 to 0-255 range
-
-				imageData[i] = *((uint32_t *)header->paletteOffset + pixel) | (alpha << 24);
+				if(header->type == TYPE_8BPP)
+					indices[i] = *((uint8_t*)header->dataOffset + i);
+				else if(i%2 != 0)
+					indices[i] = (*((uint8_t*)header->dataOffset + i/2) >> 4) & 0x0f;
+				else
+					indices[i] = *((uint8_t*)header->dataOffset + i/2) & 0x0f;
 			}
-			else if(header->type == TYPE_4BPP)
+			setFastPalette(&state, (uint32_t *)header->paletteOffset, header->type == TYPE_8BPP ? 256 : 16);
+		}
+		else
+		{
+			for(int i = 0; i < (header->width * header->height); i++)
 			{
-				uint8_t pixel = *((uint8_t*)header->dataOffset + i/2);
-
-				if(i%2 != 0)
-					pixel = (pixel >> 4) & 0x0f; // first 4 bits
-				else
-					pixel &= 0x0f; // last 4 bits
-
-
-				uint8_t alpha = (*((uint32_t*)header->paletteOffset + pixel) >> 24);
+				if(header->type == TYPE_8BPP)
+				{
+					uint8_t pixel = *((uint8_t*)header->dataOffset + i);
+					imageData[i] = gimColorToRgba(*((uint32_t *)header->paletteOffset + pixel));
+				}
+				else if(header->type == TYPE_4BPP)
+				{
+					uint8_t pixel = *((uint8_t*)header->dataOffset + i/2);
 
-				if(alpha > 0)
-					alpha = (alpha <<1)-1;  // scale from 0-128 to 0-255 range
+					if(i%2 != 0)
+						pixel = (pixel >> 4) & 0x0f; // first 4 bits
+					else
+						pixel &= 0x0f; // last 4 bits
 
-				imageData[i] = *((uint32_t *)header->paletteOffset + pixel) | (alpha << 24);
+					imageData[i] = gimColorToRgba(*((uint32_t *)header->paletteOffset + pixel));
+				}
+				else
+					printf("Unknown image type 0x%02X\n", header->type);
 			}
-			else
-				printf("Unknown image type 0x%02X\n", header->type);
 		}
 
-		int error = lodepng_encode32_file(pngPath, (unsigned char*)imageData, header->width, header->height);
+		unsigned error = lodepng_encode(&png, &pngSize, (unsigned char*)imageData, header->width, header->height, &state);
+		if(!error)
+			error = lodepng_save_file(png, pngSize, pngPath);
+		lodepng_state_cleanup(&state);
+		free(png);
 		if (error)
 		{
 			printf("Error saving PNG...\n");
@@ -296,11 +410,29 @@ int main(int argc, char* argv[])
 	{
         printf("Injecting %s into %s\n", pngPath, gimPath);
         unsigned int width, height;
-
-        int err = lodepng_decode32_file(&pngData, &width, &height, pngPath);
+        unsigned char *png = NULL;
+        size_t pngSize = 0;
+        pngRows_t rows = {NULL, 0};
+        LodePNGState state;
+        lodepng_state_init(&state);
+        pngzlib_init(&state);
+        pngData = NULL;
+
+        unsigned err = lodepng_load_file(&png, &pngSize, pngPath);
+        if(!err && lowMemory)
+        {
+            // decode rows as libimagequant reads them, interlaced PNGs still have to be decoded whole
+            err = lodepng_row_decoder_create(&rows.decoder, &width, &height, &state, png, pngSize);
+            if(err == 94)
+                err = 0;
+        }
+        if(!err && !rows.decoder)
+            err = lodepng_decode(&pngData, &width, &height, &state, png, pngSize);
         if(err)
 		{
 			printf("PNG Error %u: %s\n", err, lodepng_error_text(err));
+			lodepng_state_cleanup(&state);
+			free(png);
 			free(gimData);
 			return EXIT_FAILURE;
 		}
@@ -312,6 +444,7 @@ int main(int argc, char* argv[])
 		}
 
         liq_attr *attr = liq_attr_create();
+		liq_set_low_memory(attr, lowMemory);
 
         if(header->type == TYPE_4BPP) // 4-bit color
 		{
@@ -329,11 +462,20 @@ int main(int argc, char* argv[])
 		}
 
 		/* Quantize image and create new image map and palette */
-		liq_image *image = liq_image_create_rgba(attr, pngData, width, height, 0);
+		liq_image *image;
+		if(rows.decoder)
+		{
+			// rows are decoded in order, threads would read them out of order
+			liq_set_max_threads(attr, 1);
+			image = liq_image_create_custom(attr, readPngRow, &rows, width, height, 0);
+		}
+		else
+			image = liq_image_create_rgba(attr, pngData, width, height, 0);
 		liq_result *res = liq_quantize_image(attr, image);
 
 		if(header->type == TYPE_8BPP)
 		{
+			// remapped rows go directly into the GIM data
 			liq_write_remapped_image(res, image, (uint32_t *)header->dataOffset, width*height);
 		}
 		else if (header->type == TYPE_4BPP)
@@ -341,8 +483,8 @@ int main(int argc, char* argv[])
 			uint8_t *fulldata = malloc(width*height);
 			liq_write_remapped_image(res, image, (uint32_t *)fulldata, width*height);
 
-			// Convert to 4-bit.
-			for(int i = 0; i < (width*height)/2; i++)
+			// Convert to 4-bit, unless rows failed to decode and were remapped as zeros
+			for(int i = 0; !rows.error && i < (width*height)/2; i++)
 			{
 				uint8_t pixel1 = *((uint8_t *)fulldata + i*2);
 				uint8_t pixel2 = *((uint8_t *)fulldata + i*2 + 1);
@@ -353,6 +495,13 @@ int main(int argc, char* argv[])
 			free(fulldata);
 		}
 
+		if(rows.error)
+		{
+			// the GIM is left unchanged on disk
+			printf("PNG Error %u: %s\n", rows.error, lodepng_error_text(rows.error));
+			goto cleanup;
+		}
+
 		/* Update palette in GIM */
 		const liq_palette *pal = liq_get_palette(res);
 		memcpy((void *)header->paletteOffset, pal->entries, pal->count*4);
@@ -366,10 +515,7 @@ int main(int argc, char* argv[])
 
 		if(header->type == TYPE_8BPP) // Swizzle image data and filter palette
 		{
-			unsigned char *original = malloc(width * height);
-			memcpy(original, (uint8_t *)header->dataOffset, width * height);
-			swizzle_8bpp(original, (uint8_t *)header->dataOffset, width, height);
-			free(original);
+			swizzle_8bpp_in_place((uint8_t *)header->dataOffset, width, height);
 
 			uint32_t *filtered = malloc(256 * 4);
 			PaletteFilter((uint32_t *) header->paletteOffset, filtered, 256);
@@ -388,11 +534,17 @@ int main(int argc, char* argv[])
         fwrite(gimData, 1, gimLength, fGim);
         fclose(fGim);
 
+cleanup:
         liq_attr_destroy(attr);
         liq_image_destroy(image);
         liq_result_destroy(res);
+        lodepng_row_decoder_destroy(rows.decoder);
+        lodepng_state_cleanup(&state);
+        free(png);
         free(pngData);
         free(gimData);
+		if(rows.error)
+			return EXIT_FAILURE;
 	}
 	else
 		printf("Invalid mode '%c'. Valid modes are e and i.\n", mode);
@@ -2,111 +2,313 @@
 #include "libimagequant.h"
 #include "pam.h"
 #include "blur.h"
+#include "threadpool.h"
+
+#if USE_SSE && defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 /*
- Blurs image horizontally (width 2*size+1) and writes it transposed to dst (called twice gives 2d blur)
+ Blurs single row j horizontally and writes it as column j of dst
  */
-static void transposing_1d_blur(unsigned char *restrict src, unsigned char *restrict dst, unsigned int width, unsigned int height, const unsigned int size)
+static void transposing_1d_blur_row(const unsigned char *restrict src, unsigned char *restrict dst, unsigned int width, unsigned int height, const unsigned int size, const unsigned int j)
 {
-    for(unsigned int j=0; j < height; j++) {
-        unsigned char *restrict row = src + j*width;
-
-        // accumulate sum for pixels outside line
-        unsigned int sum;
-        sum = row[0]*size;
-        for(unsigned int i=0; i < size; i++) {
-            sum += row[i];
-        }
+    const unsigned char *restrict row = src + j*width;
 
-        // blur with left side outside line
-        for(unsigned int i=0; i < size; i++) {
-            sum -= row[0];
-            sum += row[i+size];
+    // accumulate sum for pixels outside line
+    unsigned int sum;
+    sum = row[0]*size;
+    for(unsigned int i=0; i < size; i++) {
+        sum += row[i];
+    }
 
-            dst[i*height + j] = sum / (size*2);
-        }
+    // blur with left side outside line
+    for(unsigned int i=0; i < size; i++) {
+        sum -= row[0];
+        sum += row[i+size];
 
-        for(unsigned int i=size; i < width-size; i++) {
-            sum -= row[i-size];
-            sum += row[i+size];
+        dst[i*height + j] = sum / (size*2);
+    }
 
-            dst[i*height + j] = sum / (size*2);
-        }
+    for(unsigned int i=size; i < width-size; i++) {
+        sum -= row[i-size];
+        sum += row[i+size];
+
+        dst[i*height + j] = sum / (size*2);
+    }
 
-        // blur with right side outside line
-        for(unsigned int i=width-size; i < width; i++) {
-            sum -= row[i-size];
-            sum += row[width-1];
+    // blur with right side outside line
+    for(unsigned int i=width-size; i < width; i++) {
+        sum -= row[i-size];
+        sum += row[width-1];
 
-            dst[i*height + j] = sum / (size*2);
+        dst[i*height + j] = sum / (size*2);
+    }
+}
+
+struct transposing_1d_blur_job {
+    const unsigned char *src;
+    unsigned char *dst;
+    unsigned int width, height, size;
+    unsigned int first_row; // rows before it are blurred 16 at a time
+#if USE_SSE && defined(__SSE2__)
+    __m128i mul, shift;
+#endif
+};
+
+static void transposing_1d_blur_rows(void *context, unsigned int start_row, unsigned int end_row, unsigned int thread)
+{
+    const struct transposing_1d_blur_job *job = context;
+    (void)thread;
+    for(unsigned int j=job->first_row + start_row; j < job->first_row + end_row; j++) {
+        transposing_1d_blur_row(job->src, job->dst, job->width, job->height, job->size, j);
+    }
+}
+
+#if USE_SSE && defined(__SSE2__)
+
+// number of columns transposed at a time into the on-stack buffer
+#define BLUR_SEGMENT 256
+
+/*
+ Finds multiplier and shift such that ((n*mul) >> 16) >> shift == n / divisor for every n <= max_n,
+ so that division can be done with _mm_mulhi_epu16. Returns false if there isn't one.
+ */
+static bool find_division_magic(const unsigned int divisor, const unsigned int max_n, unsigned int *mul, unsigned int *shift)
+{
+    for(unsigned int p=0; p < 16; p++) {
+        const unsigned int m = ((1U << (16+p)) + divisor - 1) / divisor;
+        if (m > 0xFFFF) {
+            break;
+        }
+        bool exact = true;
+        for(unsigned int n=0; n <= max_n && exact; n++) {
+            exact = (((n*m) >> 16) >> p) == n / divisor;
+        }
+        if (exact) {
+            *mul = m;
+            *shift = p;
+            return true;
         }
     }
+    return false;
 }
 
-/**
- * Picks maximum of neighboring pixels (blur + lighten)
+/*
+ Transposes 16x16 block of bytes. Each round interleaves rows k and k+8,
+ which rotates bits of the (row, column) index by one, so four rounds swap row and column.
+ */
+static void transpose_16x16(const unsigned char *restrict src, const unsigned int stride, unsigned char *restrict dst)
+{
+    __m128i a[16], b[16];
+    for(unsigned int k=0; k < 16; k++) {
+        a[k] = _mm_loadu_si128((const __m128i*)(src + k*stride));
+    }
+    for(unsigned int round=0; round < 4; round += 2) {
+        for(unsigned int k=0; k < 8; k++) {
+            b[2*k]   = _mm_unpacklo_epi8(a[k], a[k+8]);
+            b[2*k+1] = _mm_unpackhi_epi8(a[k], a[k+8]);
+        }
+        for(unsigned int k=0; k < 8; k++) {
+            a[2*k]   = _mm_unpacklo_epi8(b[k], b[k+8]);
+            a[2*k+1] = _mm_unpackhi_epi8(b[k], b[k+8]);
+        }
+    }
+    for(unsigned int k=0; k < 16; k++) {
+        _mm_storeu_si128((__m128i*)(dst + k*16), a[k]);
+    }
+}
+
+/*
+ Same as transposing_1d_blur_row, but for 16 rows starting at j0 at once.
+ Columns of the block are transposed segment by segment into a small buffer, so that
+ a single column of 16 pixels is one SSE register and the running sums are 16-bit lanes.
+ Output of each column is 16 contiguous bytes of dst.
  */
-LIQ_PRIVATE void liq_max3(unsigned char *src, unsigned char *dst, unsigned int width, unsigned int height)
+static void transposing_1d_blur_16_rows(const unsigned char *restrict src, unsigned char *restrict dst, unsigned int width, unsigned int height, const unsigned int size, const unsigned int j0, const __m128i mul, const __m128i shift)
 {
-    for(unsigned int j=0; j < height; j++) {
-        const unsigned char *row = src + j*width,
-        *prevrow = src + (j > 1 ? j-1 : 0)*width,
-        *nextrow = src + MIN(height-1,j+1)*width;
+    unsigned char columns[(BLUR_SEGMENT + 2*size) * 16];
+    const unsigned char *restrict block = src + j0*width;
+    const __m128i zero = _mm_setzero_si128();
+    __m128i sum_lo = zero, sum_hi = zero;
 
-        unsigned char prev,curr=row[0],next=row[0];
+    for(unsigned int seg=0; seg < width; seg += BLUR_SEGMENT) {
+        // columns needed by this segment, including the ones the window reaches outside it
+        const unsigned int col_start = seg > size ? seg - size : 0;
+        const unsigned int col_end = MIN(width, seg + BLUR_SEGMENT + size);
 
-        for(unsigned int i=0; i < width-1; i++) {
-            prev=curr;
-            curr=next;
-            next=row[i+1];
+        unsigned int c = col_start;
+        for(; c+16 <= col_end; c += 16) {
+            transpose_16x16(block + c, width, columns + (c - col_start)*16);
+        }
+        for(; c < col_end; c++) {
+            for(unsigned int k=0; k < 16; k++) {
+                columns[(c - col_start)*16 + k] = block[k*width + c];
+            }
+        }
 
-            unsigned char t1 = MAX(prev,next);
-            unsigned char t2 = MAX(nextrow[i],prevrow[i]);
-            *dst++ = MAX(curr,MAX(t1,t2));
+        #define BLUR_COLUMN(i) _mm_loadu_si128((const __m128i*)(columns + ((i) - col_start)*16))
+
+        if (seg == 0) {
+            // accumulate sum for pixels outside line
+            const __m128i first = BLUR_COLUMN(0);
+            const __m128i times = _mm_set1_epi16(size);
+            sum_lo = _mm_mullo_epi16(_mm_unpacklo_epi8(first, zero), times);
+            sum_hi = _mm_mullo_epi16(_mm_unpackhi_epi8(first, zero), times);
+            for(unsigned int i=0; i < size; i++) {
+                const __m128i px = BLUR_COLUMN(i);
+                sum_lo = _mm_add_epi16(sum_lo, _mm_unpacklo_epi8(px, zero));
+                sum_hi = _mm_add_epi16(sum_hi, _mm_unpackhi_epi8(px, zero));
+            }
         }
-        unsigned char t1 = MAX(curr,next);
-        unsigned char t2 = MAX(nextrow[width-1],prevrow[width-1]);
-        *dst++ = MAX(t1,t2);
+
+        const unsigned int seg_end = MIN(width, seg + BLUR_SEGMENT);
+        for(unsigned int i=seg; i < seg_end; i++) {
+            // pixels outside the line are copies of the edge pixels
+            const __m128i sub = BLUR_COLUMN(i > size ? i - size : 0);
+            const __m128i add = BLUR_COLUMN(MIN(width-1, i + size));
+
+            sum_lo = _mm_sub_epi16(sum_lo, _mm_unpacklo_epi8(sub, zero));
+            sum_hi = _mm_sub_epi16(sum_hi, _mm_unpackhi_epi8(sub, zero));
+            sum_lo = _mm_add_epi16(sum_lo, _mm_unpacklo_epi8(add, zero));
+            sum_hi = _mm_add_epi16(sum_hi, _mm_unpackhi_epi8(add, zero));
+
+            const __m128i avg_lo = _mm_srl_epi16(_mm_mulhi_epu16(sum_lo, mul), shift);
+            const __m128i avg_hi = _mm_srl_epi16(_mm_mulhi_epu16(sum_hi, mul), shift);
+            _mm_storeu_si128((__m128i*)(dst + i*height + j0), _mm_packus_epi16(avg_lo, avg_hi));
+        }
+
+        #undef BLUR_COLUMN
     }
 }
 
-/**
- * Picks minimum of neighboring pixels (blur + darken)
+static void transposing_1d_blur_blocks(void *context, unsigned int start_block, unsigned int end_block, unsigned int thread)
+{
+    const struct transposing_1d_blur_job *job = context;
+    (void)thread;
+    for(unsigned int b=start_block; b < end_block; b++) {
+        transposing_1d_blur_16_rows(job->src, job->dst, job->width, job->height, job->size, b*16, job->mul, job->shift);
+    }
+}
+#endif
+
+/*
+ Blurs image horizontally (width 2*size+1) and writes it transposed to dst (called twice gives 2d blur)
  */
-LIQ_PRIVATE void liq_min3(unsigned char *src, unsigned char *dst, unsigned int width, unsigned int height)
+static void transposing_1d_blur(unsigned char *restrict src, unsigned char *restrict dst, unsigned int width, unsigned int height, const unsigned int size, liq_thread_pool *pool, unsigned int threads)
+{
+    struct transposing_1d_blur_job job = {
+        .src = src, .dst = dst,
+        .width = width, .height = height, .size = size,
+    };
+    const unsigned int job_threads = width*height > 16384 ? threads : 1;
+
+#if USE_SSE && defined(__SSE2__)
+    unsigned int mul, shift;
+    // sums of 2*size pixels must fit in 16-bit lanes
+    if (height >= 16 && size <= 128 && find_division_magic(size*2, 255*size*2, &mul, &shift)) {
+        job.first_row = height & ~15U;
+        job.mul = _mm_set1_epi16(mul);
+        job.shift = _mm_cvtsi32_si128(shift);
+        liq_parallel_for(pool, job_threads, job.first_row / 16, transposing_1d_blur_blocks, &job);
+    }
+#endif
+
+    const unsigned int rows = height - job.first_row;
+    liq_parallel_for(pool, MIN(job_threads, rows), rows, transposing_1d_blur_rows, &job);
+}
+
+ALWAYS_INLINE static void minmax3_row(const unsigned char *prevrow, const unsigned char *row, const unsigned char *nextrow, unsigned char *dst, const unsigned int width, const bool pick_max);
+inline static void minmax3_row(const unsigned char *prevrow, const unsigned char *row, const unsigned char *nextrow, unsigned char *dst, const unsigned int width, const bool pick_max)
 {
-    for(unsigned int j=0; j < height; j++) {
-        const unsigned char *row = src + j*width,
-        *prevrow = src + (j > 1 ? j-1 : 0)*width,
-        *nextrow = src + MIN(height-1,j+1)*width;
+    #define MINMAX(a,b) (pick_max ? MAX(a,b) : MIN(a,b))
+
+    // pixels outside the image are copies of the edge pixels
+    dst[0] = MINMAX(MINMAX(row[0], row[MIN(1, width-1)]), MINMAX(prevrow[0], nextrow[0]));
+
+    unsigned int i=1;
+#if USE_SSE && defined(__SSE2__)
+    for(; i+16 < width; i += 16) {
+        const __m128i prev = _mm_loadu_si128((const __m128i*)(row + i - 1));
+        const __m128i curr = _mm_loadu_si128((const __m128i*)(row + i));
+        const __m128i next = _mm_loadu_si128((const __m128i*)(row + i + 1));
+        const __m128i above = _mm_loadu_si128((const __m128i*)(prevrow + i));
+        const __m128i below = _mm_loadu_si128((const __m128i*)(nextrow + i));
+        __m128i res;
+        if (pick_max) {
+            res = _mm_max_epu8(_mm_max_epu8(curr, _mm_max_epu8(prev, next)), _mm_max_epu8(above, below));
+        } else {
+            res = _mm_min_epu8(_mm_min_epu8(curr, _mm_min_epu8(prev, next)), _mm_min_epu8(above, below));
+        }
+        _mm_storeu_si128((__m128i*)(dst + i), res);
+    }
+#endif
+    for(; i+1 < width; i++) {
+        const unsigned char t1 = MINMAX(row[i-1], row[i+1]);
+        const unsigned char t2 = MINMAX(nextrow[i], prevrow[i]);
+        dst[i] = MINMAX(row[i], MINMAX(t1, t2));
+    }
+
+    if (width > 1) {
+        const unsigned char t1 = MINMAX(row[width-2], row[width-1]);
+        const unsigned char t2 = MINMAX(nextrow[width-1], prevrow[width-1]);
+        dst[width-1] = MINMAX(t1, t2);
+    }
 
-        unsigned char prev,curr=row[0],next=row[0];
+    #undef MINMAX
+}
+
+struct minmax3_job {
+    const unsigned char *src;
+    unsigned char *dst;
+    unsigned int width, height;
+    bool pick_max;
+};
 
-        for(unsigned int i=0; i < width-1; i++) {
-            prev=curr;
-            curr=next;
-            next=row[i+1];
+static void minmax3_rows(void *context, unsigned int start_row, unsigned int end_row, unsigned int thread)
+{
+    const struct minmax3_job *job = context;
+    (void)thread;
+    const unsigned char *src = job->src;
+    const unsigned int width = job->width, height = job->height;
 
-            unsigned char t1 = MIN(prev,next);
-            unsigned char t2 = MIN(nextrow[i],prevrow[i]);
-            *dst++ = MIN(curr,MIN(t1,t2));
+    for(unsigned int j=start_row; j < end_row; j++) {
+        if (job->pick_max) {
+            minmax3_row(src + (j > 0 ? j-1 : 0)*width, src + j*width, src + MIN(height-1,j+1)*width, job->dst + j*width, width, true);
+        } else {
+            minmax3_row(src + (j > 0 ? j-1 : 0)*width, src + j*width, src + MIN(height-1,j+1)*width, job->dst + j*width, width, false);
         }
-        unsigned char t1 = MIN(curr,next);
-        unsigned char t2 = MIN(nextrow[width-1],prevrow[width-1]);
-        *dst++ = MIN(t1,t2);
     }
 }
 
+/**
+ * Picks maximum of neighboring pixels (blur + lighten)
+ */
+LIQ_PRIVATE void liq_max3(unsigned char *src, unsigned char *dst, unsigned int width, unsigned int height, liq_thread_pool *pool, unsigned int threads)
+{
+    struct minmax3_job job = {src, dst, width, height, true};
+    liq_parallel_for(pool, width*height > 16384 ? threads : 1, height, minmax3_rows, &job);
+}
+
+/**
+ * Picks minimum of neighboring pixels (blur + darken)
+ */
+LIQ_PRIVATE void liq_min3(unsigned char *src, unsigned char *dst, unsigned int width, unsigned int height, liq_thread_pool *pool, unsigned int threads)
+{
+    struct minmax3_job job = {src, dst, width, height, false};
+    liq_parallel_for(pool, width*height > 16384 ? threads : 1, height, minmax3_rows, &job);
+}
+
 /*
  Filters src image and saves it to dst, overwriting tmp in the process.
  Image must be width*height pixels high. Size controls radius of box blur.
  */
-LIQ_PRIVATE void liq_blur(unsigned char *src, unsigned char *tmp, unsigned char *dst, unsigned int width, unsigned int height, unsigned int size)
+LIQ_PRIVATE void liq_blur(unsigned char *src, unsigned char *tmp, unsigned char *dst, unsigned int width, unsigned int height, unsigned int size, liq_thread_pool *pool, unsigned int threads)
 {
     assert(size > 0);
     if (width < 2*size+1 || height < 2*size+1) {
         return;
     }
-    transposing_1d_blur(src, tmp, width, height, size);
-    transposing_1d_blur(tmp, dst, height, width, size);
+    transposing_1d_blur(src, tmp, width, height, size, pool, threads);
+    transposing_1d_blur(tmp, dst, height, width, size, pool, threads);
 }
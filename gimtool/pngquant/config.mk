@@ -0,0 +1,8 @@
+
+# auto-generated by configure
+PREFIX = /usr/local
+VERSION = 2.3.1
+CC = gcc
+CFLAGS = -O3 -fno-math-errno -funroll-loops -fomit-frame-pointer -Wall -std=c99 -I. -DNDEBUG -DUSE_SSE=1 -msse -mfpmath=sse -fexcess-precision=fast
+LDFLAGS =  -lm lib/libimagequant.a -lpthread -lm
+
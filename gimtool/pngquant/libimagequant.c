@@ -26,13 +26,6 @@
 #error "Ignore torrent of syntax errors that may follow. It's only because compiler is set to use too old C version."
 #endif
 
-#ifdef _OPENMP
-#include <omp.h>
-#else
-#define omp_get_max_threads() 1
-#define omp_get_thread_num() 0
-#endif
-
 #include "libimagequant.h"
 
 #include "pam.h"
@@ -40,6 +33,8 @@
 #include "nearest.h"
 #include "blur.h"
 #include "viter.h"
+#include "mempool.h"
+#include "threadpool.h"
 
 #define LIQ_HIGH_MEMORY_LIMIT (1<<26)  /* avoid allocating buffers larger than 64MB */
 
@@ -50,6 +45,17 @@ static const char *const liq_attr_magic = "liq_attr", *const liq_image_magic = "
 #define CHECK_STRUCT_TYPE(attr, kind) liq_crash_if_invalid_handle_pointer_given((const liq_attr*)attr, kind ## _magic)
 #define CHECK_USER_POINTER(ptr) liq_crash_if_invalid_pointer_given(ptr)
 
+/*
+ Memory for temporary data of quantizations and remappings done with the same liq_attr (see liq_set_arena).
+ When the last call using it returns, it's reset rather than freed.
+ */
+typedef struct liq_arena {
+    mempool pool;
+    unsigned int refcount; // liq_attr and liq_results that share the arena
+    unsigned int users;    // calls currently allocating from the pool
+    void (*free)(void*);
+} liq_arena;
+
 struct liq_attr {
     const char *magic_header;
     void* (*malloc)(size_t);
@@ -60,12 +66,22 @@ struct liq_attr {
     unsigned int max_colors, max_histogram_entries;
     unsigned int min_posterization_output /* user setting */, min_posterization_input /* speed setting */;
     unsigned int voronoi_iterations, feedback_loop_trials;
-    bool last_index_transparent, use_contrast_maps, use_dither_map, fast_palette;
+    bool last_index_transparent, use_contrast_maps, use_dither_map;
+    bool low_memory; // never keep converted image or per-pixel maps, see liq_set_low_memory()
     unsigned int speed;
+    unsigned int time_limit_ms; // 0 = no limit
+    double lut_gamma; // gamma of the tables below, which are reused for results of all images with that gamma
+    float gamma_lut[256], rgb_lut[256];
+    liq_arena *arena;
+    unsigned int max_threads;
+    liq_thread_pool *thread_pool; // created on first use, unless set by liq_set_thread_pool()
+    bool own_thread_pool;
     liq_log_callback_function *log_callback;
     void *log_callback_user_info;
     liq_log_flush_callback_function *log_flush_callback;
     void *log_flush_callback_user_info;
+    liq_progress_callback_function *progress_callback;
+    void *progress_callback_user_info;
 };
 
 struct liq_image {
@@ -80,8 +96,10 @@ struct liq_image {
     unsigned char *noise, *edges, *dither_map;
     rgba_pixel *pixels, *temp_row;
     f_pixel *temp_f_row;
+    float gamma_lut[256], alpha_lut[256]; // to_f() tables, computed once as rows may be converted many times
     liq_image_get_rgba_row_callback *row_callback;
     void *row_callback_user_info;
+    unsigned int max_threads; // temp_row and temp_f_row have a row for each thread
     float min_opaque_val;
     bool free_pixels, free_rows, free_rows_internal;
 };
@@ -110,15 +128,22 @@ struct liq_result {
     float dither_level;
     double gamma, palette_error;
     int min_posterization_output;
-    bool use_dither_map, fast_palette;
+    bool use_dither_map;
+    double lut_gamma; // gamma of the tables below, set_rounded_palette() updates them if gamma changed
+    float gamma_lut[256], rgb_lut[256];
+    liq_arena *arena; // shared with liq_attr, used by remapping
+    liq_thread_pool *thread_pool;
+    unsigned int max_threads;
+    liq_progress_callback_function *progress_callback; // copied from liq_attr for remapping
+    void *progress_callback_user_info;
 };
 
-static liq_result *pngquant_quantize(histogram *hist, const liq_attr *options, double gamma);
+static liq_error pngquant_quantize(histogram *hist, const liq_attr *options, double gamma, double deadline, mempool *arena, liq_thread_pool *pool, unsigned int threads, liq_result **result_output);
 static void modify_alpha(liq_image *input_image, rgba_pixel *const row_pixels);
-static void contrast_maps(liq_image *image);
-static histogram *get_histogram(liq_image *input_image, const liq_attr *options);
-static const rgba_pixel *liq_image_get_row_rgba(liq_image *input_image, unsigned int row);
-static const f_pixel *liq_image_get_row_f(liq_image *input_image, unsigned int row);
+static void contrast_maps(liq_image *image, mempool *arena, liq_thread_pool *pool, unsigned int threads);
+static liq_error get_histogram(liq_image *input_image, const liq_attr *options, histogram **hist_output, mempool *arena, liq_thread_pool *pool, unsigned int threads);
+static const rgba_pixel *liq_image_get_row_rgba(liq_image *input_image, unsigned int row, unsigned int thread);
+static const f_pixel *liq_image_get_row_f(liq_image *input_image, unsigned int row, unsigned int thread);
 static void liq_remapping_result_destroy(liq_remapping_result *result);
 
 static void liq_verbose_printf(const liq_attr *context, const char *fmt, ...)
@@ -293,8 +318,7 @@ LIQ_EXPORT liq_error liq_set_speed(liq_attr* attr, int speed)
 
     attr->max_histogram_entries = (1<<17) + (1<<18)*(10-speed);
     attr->min_posterization_input = (speed >= 8) ? 1 : 0;
-    attr->fast_palette = (speed >= 7);
-    attr->use_dither_map = (speed <= (omp_get_max_threads() > 1 ? 7 : 5)); // parallelized dither map might speed up floyd remapping
+    attr->use_dither_map = (speed <= (attr->max_threads > 1 ? 7 : 5)); // parallelized dither map might speed up floyd remapping
     attr->use_contrast_maps = (speed <= 7) || attr->use_dither_map;
     attr->speed = speed;
     return LIQ_OK;
@@ -307,6 +331,30 @@ LIQ_EXPORT int liq_get_speed(const liq_attr *attr)
     return attr->speed;
 }
 
+LIQ_EXPORT liq_error liq_set_time_limit_ms(liq_attr* attr, int milliseconds)
+{
+    if (!CHECK_STRUCT_TYPE(attr, liq_attr)) return LIQ_INVALID_POINTER;
+    if (milliseconds < 0) return LIQ_VALUE_OUT_OF_RANGE;
+
+    attr->time_limit_ms = milliseconds;
+    return LIQ_OK;
+}
+
+LIQ_EXPORT int liq_get_time_limit_ms(const liq_attr *attr)
+{
+    if (!CHECK_STRUCT_TYPE(attr, liq_attr)) return -1;
+
+    return attr->time_limit_ms;
+}
+
+/*
+ Deadline is liq_time_ms() time after which palette search should stop improving the palette, or 0 if there's no limit
+ */
+inline static bool past_deadline(const double deadline)
+{
+    return deadline > 0 && liq_time_ms() > deadline;
+}
+
 LIQ_EXPORT liq_error liq_set_output_gamma(liq_result* res, double gamma)
 {
     if (!CHECK_STRUCT_TYPE(res, liq_result)) return LIQ_INVALID_POINTER;
@@ -344,6 +392,13 @@ LIQ_EXPORT void liq_set_last_index_transparent(liq_attr* attr, int is_last)
     attr->last_index_transparent = !!is_last;
 }
 
+LIQ_EXPORT void liq_set_low_memory(liq_attr* attr, int enabled)
+{
+    if (!CHECK_STRUCT_TYPE(attr, liq_attr)) return;
+
+    attr->low_memory = !!enabled;
+}
+
 LIQ_EXPORT void liq_set_log_callback(liq_attr *attr, liq_log_callback_function *callback, void* user_info)
 {
     if (!CHECK_STRUCT_TYPE(attr, liq_attr)) return;
@@ -361,6 +416,130 @@ LIQ_EXPORT void liq_set_log_flush_callback(liq_attr *attr, liq_log_flush_callbac
     attr->log_flush_callback_user_info = user_info;
 }
 
+LIQ_EXPORT void liq_set_progress_callback(liq_attr *attr, liq_progress_callback_function *callback, void* user_info)
+{
+    if (!CHECK_STRUCT_TYPE(attr, liq_attr)) return;
+
+    attr->progress_callback = callback;
+    attr->progress_callback_user_info = user_info;
+}
+
+/*
+ Returns false if the callback has asked to abort
+ */
+static bool liq_progress(liq_progress_callback_function *callback, void *user_info, const liq_progress_stage stage, const float percent)
+{
+    return !callback || callback(stage, percent, user_info);
+}
+
+static liq_arena *liq_arena_create(void* (*malloc)(size_t), void (*free)(void*))
+{
+    liq_arena *arena = malloc(sizeof(liq_arena));
+    if (!arena) return NULL;
+    *arena = (liq_arena){
+        .refcount = 1,
+        .free = free,
+    };
+    if (!mempool_create(&arena->pool, 0, 0, malloc, free)) {
+        free(arena);
+        return NULL;
+    }
+    return arena;
+}
+
+static liq_arena *liq_arena_retain(liq_arena *arena)
+{
+    if (arena) arena->refcount++;
+    return arena;
+}
+
+static void liq_arena_release(liq_arena *arena)
+{
+    if (arena && !--arena->refcount) {
+        mempool_destroy(arena->pool);
+        arena->free(arena);
+    }
+}
+
+/*
+ Returns pool for temporary allocations or NULL if the arena is not used.
+ Everything allocated from it is released by the outermost liq_arena_leave().
+ */
+static mempool *liq_arena_enter(liq_arena *arena)
+{
+    if (!arena) return NULL;
+
+    arena->users++;
+    return arena->pool ? &arena->pool : NULL; // pool is NULL if reset failed to allocate
+}
+
+static void liq_arena_leave(liq_arena *arena)
+{
+    if (arena && !--arena->users) {
+        mempool_reset(&arena->pool);
+    }
+}
+
+LIQ_EXPORT liq_error liq_set_arena(liq_attr *attr, int enabled)
+{
+    if (!CHECK_STRUCT_TYPE(attr, liq_attr)) return LIQ_INVALID_POINTER;
+
+    if (!enabled) {
+        liq_arena_release(attr->arena);
+        attr->arena = NULL;
+    } else if (!attr->arena) {
+        attr->arena = liq_arena_create(attr->malloc, attr->free);
+        if (!attr->arena) return LIQ_OUT_OF_MEMORY;
+    }
+    return LIQ_OK;
+}
+
+LIQ_EXPORT liq_error liq_set_max_threads(liq_attr *attr, int threads)
+{
+    if (!CHECK_STRUCT_TYPE(attr, liq_attr)) return LIQ_INVALID_POINTER;
+    if (threads < 1 || threads > LIQ_MAX_THREADS) return LIQ_VALUE_OUT_OF_RANGE;
+
+    attr->max_threads = threads;
+    if (attr->own_thread_pool) {
+        // will be created again with the new number of threads
+        liq_thread_pool_release(attr->thread_pool);
+        attr->thread_pool = NULL;
+        attr->own_thread_pool = false;
+    }
+    liq_set_speed(attr, attr->speed); // speed settings depend on number of threads
+    return LIQ_OK;
+}
+
+LIQ_EXPORT int liq_get_max_threads(const liq_attr *attr)
+{
+    if (!CHECK_STRUCT_TYPE(attr, liq_attr)) return -1;
+
+    return attr->max_threads;
+}
+
+LIQ_EXPORT liq_error liq_set_thread_pool(liq_attr *attr, liq_thread_pool *pool)
+{
+    if (!CHECK_STRUCT_TYPE(attr, liq_attr)) return LIQ_INVALID_POINTER;
+    if (pool && !CHECK_USER_POINTER(pool)) return LIQ_INVALID_POINTER;
+
+    liq_thread_pool_release(attr->thread_pool);
+    attr->thread_pool = liq_thread_pool_retain(pool);
+    attr->own_thread_pool = false;
+    return LIQ_OK;
+}
+
+/*
+ Returns NULL if work should be done in the calling thread only
+ */
+static liq_thread_pool *liq_attr_get_thread_pool(liq_attr *attr)
+{
+    if (!attr->thread_pool && attr->max_threads > 1) {
+        attr->thread_pool = liq_thread_pool_create_internal(attr->max_threads, attr->malloc, attr->free);
+        attr->own_thread_pool = attr->thread_pool != NULL;
+    }
+    return attr->thread_pool;
+}
+
 LIQ_EXPORT liq_attr* liq_attr_create()
 {
     return liq_attr_create_with_allocator(NULL, NULL);
@@ -374,6 +553,9 @@ LIQ_EXPORT void liq_attr_destroy(liq_attr *attr)
 
     liq_verbose_printf_flush(attr);
 
+    liq_arena_release(attr->arena);
+    liq_thread_pool_release(attr->thread_pool);
+
     attr->magic_header = liq_freed_magic;
     attr->free(attr);
 }
@@ -387,6 +569,11 @@ LIQ_EXPORT liq_attr* liq_attr_copy(liq_attr *orig)
     liq_attr *attr = orig->malloc(sizeof(liq_attr));
     if (!attr) return NULL;
     *attr = *orig;
+    if (orig->arena) {
+        // arena is not thread-safe, so copies get their own
+        attr->arena = liq_arena_create(orig->malloc, orig->free);
+    }
+    liq_thread_pool_retain(attr->thread_pool);
     return attr;
 }
 
@@ -437,6 +624,7 @@ LIQ_EXPORT liq_attr* liq_attr_create_with_allocator(void* (*custom_malloc)(size_
         .last_index_transparent = false, // puts transparent color at last index. This is workaround for blu-ray subtitles.
         .target_mse = 0,
         .max_mse = MAX_DIFF,
+        .max_threads = liq_cpu_count(),
     };
     liq_set_speed(attr, 3);
     return attr;
@@ -444,7 +632,7 @@ LIQ_EXPORT liq_attr* liq_attr_create_with_allocator(void* (*custom_malloc)(size_
 
 static bool liq_image_use_low_memory(liq_image *img)
 {
-    img->temp_f_row = img->malloc(sizeof(img->f_pixels[0]) * img->width * omp_get_max_threads());
+    img->temp_f_row = img->malloc(sizeof(img->f_pixels[0]) * img->width * img->max_threads);
     return img->temp_f_row != NULL;
 }
 
@@ -483,16 +671,22 @@ static liq_image *liq_image_create_internal(liq_attr *attr, rgba_pixel* rows[],
         .rows = rows,
         .row_callback = row_callback,
         .row_callback_user_info = row_callback_user_info,
+        .max_threads = attr->max_threads,
         .min_opaque_val = attr->min_opaque_val,
     };
 
+    to_f_set_gamma(img->gamma_lut, img->gamma);
+    for(unsigned int i=0; i < 256; i++) {
+        img->alpha_lut[i] = i/255.f;
+    }
+
     if (!rows || attr->min_opaque_val < 1.f) {
-        img->temp_row = attr->malloc(sizeof(img->temp_row[0]) * width * omp_get_max_threads());
+        img->temp_row = attr->malloc(sizeof(img->temp_row[0]) * width * img->max_threads);
         if (!img->temp_row) return NULL;
     }
 
     // if image is huge or converted pixels are not likely to be reused then don't cache converted pixels
-    if (liq_image_should_use_low_memory(img, !img->temp_row && !attr->use_contrast_maps && !attr->use_dither_map)) {
+    if (attr->low_memory || liq_image_should_use_low_memory(img, !img->temp_row && !attr->use_contrast_maps && !attr->use_dither_map)) {
         verbose_print(attr, "  conserving memory");
         if (!liq_image_use_low_memory(img)) return NULL;
     }
@@ -600,14 +794,15 @@ inline static bool liq_image_can_use_rows(liq_image *img)
     return (img->rows && !iebug);
 }
 
-static const rgba_pixel *liq_image_get_row_rgba(liq_image *img, unsigned int row)
+static const rgba_pixel *liq_image_get_row_rgba(liq_image *img, unsigned int row, unsigned int thread)
 {
     if (liq_image_can_use_rows(img)) {
         return img->rows[row];
     }
 
     assert(img->temp_row);
-    rgba_pixel *temp_row = img->temp_row + img->width * omp_get_thread_num();
+    assert(thread < img->max_threads);
+    rgba_pixel *temp_row = img->temp_row + img->width * thread;
     if (img->rows) {
         memcpy(temp_row, img->rows[row], img->width * sizeof(temp_row[0]));
     } else {
@@ -618,42 +813,55 @@ static const rgba_pixel *liq_image_get_row_rgba(liq_image *img, unsigned int row
     return temp_row;
 }
 
-static void convert_row_to_f(liq_image *img, f_pixel *row_f_pixels, const unsigned int row, const float gamma_lut[])
+static void convert_row_to_f(liq_image *img, f_pixel *row_f_pixels, const unsigned int row, const unsigned int thread)
 {
     assert(row_f_pixels);
     assert(!USE_SSE || 0 == ((uintptr_t)row_f_pixels & 15));
 
-    const rgba_pixel *const row_pixels = liq_image_get_row_rgba(img, row);
+    const rgba_pixel *const row_pixels = liq_image_get_row_rgba(img, row, thread);
+    const float *const gamma_lut = img->gamma_lut;
 
+#if USE_SSE
+    // same as to_f(), but the premultiplication is done on all channels at once
+    // and alpha comes from a table instead of a division
+    const float *const alpha_lut = img->alpha_lut;
+    for(unsigned int col=0; col < img->width; col++) {
+        const rgba_pixel px = row_pixels[col];
+        const __m128 a = _mm_load1_ps(&alpha_lut[px.a]);
+        const __m128 rgb = _mm_setr_ps(1.f, gamma_lut[px.r], gamma_lut[px.g], gamma_lut[px.b]);
+        _mm_store_ps((float*)&row_f_pixels[col], _mm_mul_ps(rgb, a));
+    }
+#else
     for(unsigned int col=0; col < img->width; col++) {
         row_f_pixels[col] = to_f(gamma_lut, row_pixels[col]);
     }
+#endif
 }
 
-static const f_pixel *liq_image_get_row_f(liq_image *img, unsigned int row)
+/*
+ Thread is index of the calling thread in liq_parallel_for(), or 0 outside of it
+ */
+static const f_pixel *liq_image_get_row_f(liq_image *img, unsigned int row, unsigned int thread)
 {
     if (!img->f_pixels) {
         if (img->temp_f_row) {
-            float gamma_lut[256];
-            to_f_set_gamma(gamma_lut, img->gamma);
-            f_pixel *row_for_thread = img->temp_f_row + img->width * omp_get_thread_num();
-            convert_row_to_f(img, row_for_thread, row, gamma_lut);
+            assert(thread < img->max_threads);
+            f_pixel *row_for_thread = img->temp_f_row + img->width * thread;
+            convert_row_to_f(img, row_for_thread, row, thread);
             return row_for_thread;
         }
 
-        assert(omp_get_thread_num() == 0);
+        assert(thread == 0);
         if (!liq_image_should_use_low_memory(img, false)) {
             img->f_pixels = img->malloc(sizeof(img->f_pixels[0]) * img->width * img->height);
         }
         if (!img->f_pixels) {
             if (!liq_image_use_low_memory(img)) return NULL;
-            return liq_image_get_row_f(img, row);
+            return liq_image_get_row_f(img, row, thread);
         }
 
-        float gamma_lut[256];
-        to_f_set_gamma(gamma_lut, img->gamma);
         for(unsigned int i=0; i < img->height; i++) {
-            convert_row_to_f(img, &img->f_pixels[i*img->width], i, gamma_lut);
+            convert_row_to_f(img, &img->f_pixels[i*img->width], i, 0);
         }
     }
     return img->f_pixels + img->width * row;
@@ -671,6 +879,15 @@ LIQ_EXPORT int liq_image_get_height(const liq_image *input_image)
     return input_image->height;
 }
 
+static void set_gamma_luts(float gamma_lut[], float rgb_lut[], double *lut_gamma, const double gamma)
+{
+    if (*lut_gamma != gamma) {
+        to_f_set_gamma(gamma_lut, gamma);
+        to_rgb_set_gamma(rgb_lut, gamma);
+        *lut_gamma = gamma;
+    }
+}
+
 typedef void free_func(void*);
 
 free_func *get_default_free_func(liq_image *img)
@@ -727,21 +944,42 @@ LIQ_EXPORT void liq_image_destroy(liq_image *input_image)
 
 LIQ_EXPORT liq_result *liq_quantize_image(liq_attr *attr, liq_image *img)
 {
-    if (!CHECK_STRUCT_TYPE(attr, liq_attr)) return NULL;
+    liq_result *result;
+    if (liq_image_quantize(img, attr, &result) != LIQ_OK) {
+        return NULL;
+    }
+    return result;
+}
+
+LIQ_EXPORT liq_error liq_image_quantize(liq_image *img, liq_attr *attr, liq_result **result_output)
+{
+    if (!CHECK_STRUCT_TYPE(attr, liq_attr)) return LIQ_INVALID_POINTER;
     if (!CHECK_STRUCT_TYPE(img, liq_image)) {
         liq_log_error(attr, "invalid image pointer");
-        return NULL;
+        return LIQ_INVALID_POINTER;
     }
+    if (!CHECK_USER_POINTER(result_output)) return LIQ_INVALID_POINTER;
+    *result_output = NULL;
 
-    histogram *hist = get_histogram(img, attr);
-    if (!hist) {
-        return NULL;
+    const double deadline = attr->time_limit_ms ? liq_time_ms() + attr->time_limit_ms : 0;
+    mempool *arena = liq_arena_enter(attr->arena);
+    liq_thread_pool *pool = liq_attr_get_thread_pool(attr);
+    const unsigned int threads = liq_thread_count(pool, MIN(attr->max_threads, img->max_threads));
+
+    histogram *hist;
+    liq_error err = get_histogram(img, attr, &hist, arena, pool, threads);
+    if (err != LIQ_OK) {
+        liq_arena_leave(attr->arena);
+        return err;
     }
 
-    liq_result *result = pngquant_quantize(hist, attr, img->gamma);
+    set_gamma_luts(attr->gamma_lut, attr->rgb_lut, &attr->lut_gamma, img->gamma);
+
+    err = pngquant_quantize(hist, attr, img->gamma, deadline, arena, pool, threads, result_output);
 
     pam_freeacolorhist(hist);
-    return result;
+    liq_arena_leave(attr->arena);
+    return err;
 }
 
 LIQ_EXPORT liq_error liq_set_dithering_level(liq_result *res, float dither_level)
@@ -809,6 +1047,8 @@ LIQ_EXPORT void liq_result_destroy(liq_result *res)
     }
 
     pam_freecolormap(res->palette);
+    liq_arena_release(res->arena);
+    liq_thread_pool_release(res->thread_pool);
 
     res->magic_header = liq_freed_magic;
     res->free(res);
@@ -914,21 +1154,21 @@ inline static unsigned int posterize_channel(unsigned int color, unsigned int bi
     return (color & ~((1<<bits)-1)) | (color >> (8-bits));
 }
 
-static void set_rounded_palette(liq_palette *const dest, colormap *const map, const double gamma, unsigned int posterize)
+static void set_rounded_palette(liq_palette *const dest, colormap *const map, liq_result *const quant, unsigned int posterize)
 {
-    float gamma_lut[256];
-    to_f_set_gamma(gamma_lut, gamma);
+    // tables are made before gamma is known, or liq_set_output_gamma() changed it since
+    set_gamma_luts(quant->gamma_lut, quant->rgb_lut, &quant->lut_gamma, quant->gamma);
 
     dest->count = map->colors;
     for(unsigned int x = 0; x < map->colors; ++x) {
-        rgba_pixel px = to_rgb(gamma, map->palette[x].acolor);
+        rgba_pixel px = to_rgb_lut(quant->rgb_lut, map->palette[x].acolor);
 
         px.r = posterize_channel(px.r, posterize);
         px.g = posterize_channel(px.g, posterize);
         px.b = posterize_channel(px.b, posterize);
         px.a = posterize_channel(px.a, posterize);
 
-        map->palette[x].acolor = to_f(gamma_lut, px); /* saves rounding error introduced by to_rgb, which makes remapping & dithering more accurate */
+        map->palette[x].acolor = to_f(quant->gamma_lut, px); /* saves rounding error introduced by to_rgb, which makes remapping & dithering more accurate */
 
         if (!px.a) {
             px.r = 'L'; px.g = 'i'; px.b = 'q';
@@ -947,43 +1187,71 @@ LIQ_EXPORT const liq_palette *liq_get_palette(liq_result *result)
     }
 
     if (!result->int_palette.count) {
-        set_rounded_palette(&result->int_palette, result->palette, result->gamma, result->min_posterization_output);
+        set_rounded_palette(&result->int_palette, result->palette, result, result->min_posterization_output);
     }
     return &result->int_palette;
 }
 
-static float remap_to_palette(liq_image *const input_image, unsigned char *const *const output_pixels, colormap *const map, const bool fast)
+struct remap_to_palette_job {
+    liq_image *input_image;
+    unsigned char *const *output_pixels;
+    const colormap *map;
+    const struct nearest_map *n;
+    viter_state *average_color;
+    double thread_error[LIQ_MAX_THREADS];
+};
+
+static void remap_to_palette_rows(void *context, unsigned int start_row, unsigned int end_row, unsigned int thread)
 {
-    const int rows = input_image->height;
+    struct remap_to_palette_job *job = context;
+    liq_image *input_image = job->input_image;
     const unsigned int cols = input_image->width;
     const float min_opaque_val = input_image->min_opaque_val;
     double remapping_error=0;
 
-    if (!liq_image_get_row_f(input_image, 0)) { // trigger lazy conversion
-        return -1;
-    }
-
-    struct nearest_map *const n = nearest_init(map, fast);
-
-    const unsigned int max_threads = omp_get_max_threads();
-    viter_state average_color[(VITER_CACHE_LINE_GAP+map->colors) * max_threads];
-    viter_init(map, max_threads, average_color);
-
-    #pragma omp parallel for if (rows*cols > 3000) \
-        schedule(static) default(none) shared(average_color) reduction(+:remapping_error)
-    for(int row = 0; row < rows; ++row) {
-        const f_pixel *const row_pixels = liq_image_get_row_f(input_image, row);
+    for(unsigned int row = start_row; row < end_row; ++row) {
+        const f_pixel *const row_pixels = liq_image_get_row_f(input_image, row, thread);
         unsigned int last_match=0;
         for(unsigned int col = 0; col < cols; ++col) {
             f_pixel px = row_pixels[col];
             float diff;
 
-            output_pixels[row][col] = last_match = nearest_search(n, px, last_match, min_opaque_val, &diff);
+            job->output_pixels[row][col] = last_match = nearest_search(job->n, px, last_match, min_opaque_val, &diff);
 
             remapping_error += diff;
-            viter_update_color(px, 1.0, map, last_match, omp_get_thread_num(), average_color);
+            viter_update_color(px, 1.0, job->map, last_match, thread, job->average_color);
         }
     }
+    job->thread_error[thread] = remapping_error;
+}
+
+static float remap_to_palette(liq_image *const input_image, unsigned char *const *const output_pixels, colormap *const map, mempool *arena, liq_thread_pool *pool, unsigned int threads)
+{
+    const unsigned int rows = input_image->height, cols = input_image->width;
+
+    if (!liq_image_get_row_f(input_image, 0, 0)) { // trigger lazy conversion
+        return -1;
+    }
+
+    struct nearest_map *const n = nearest_init(map, arena);
+
+    const unsigned int max_threads = rows*cols > 3000 ? threads : 1;
+    viter_state average_color[(VITER_CACHE_LINE_GAP+map->colors) * max_threads];
+    viter_init(map, max_threads, average_color);
+
+    struct remap_to_palette_job job = {
+        .input_image = input_image,
+        .output_pixels = output_pixels,
+        .map = map,
+        .n = n,
+        .average_color = average_color,
+    };
+    liq_parallel_for(pool, max_threads, rows, remap_to_palette_rows, &job);
+
+    double remapping_error=0;
+    for(unsigned int t=0; t < max_threads; t++) {
+        remapping_error += job.thread_error[t];
+    }
 
     viter_finalize(map, max_threads, average_color);
 
@@ -1037,7 +1305,7 @@ inline static f_pixel get_dithered_pixel(const float dither_level, const float m
 
   If output_image_is_remapped is true, only pixels noticeably changed by error diffusion will be written to output image.
  */
-static void remap_to_palette_floyd(liq_image *input_image, unsigned char *const output_pixels[], const colormap *map, const float max_dither_error, const bool use_dither_map, const bool output_image_is_remapped, float base_dithering_level)
+static liq_error remap_to_palette_floyd(const liq_result *quant, liq_image *input_image, unsigned char *const output_pixels[], const colormap *map, const float max_dither_error, const bool use_dither_map, const bool output_image_is_remapped, float base_dithering_level, mempool *arena)
 {
     const unsigned int rows = input_image->height, cols = input_image->width;
     const unsigned char *dither_map = use_dither_map ? (input_image->dither_map ? input_image->dither_map : input_image->edges) : NULL;
@@ -1045,14 +1313,18 @@ static void remap_to_palette_floyd(liq_image *input_image, unsigned char *const
 
     const colormap_item *acolormap = map->palette;
 
-    struct nearest_map *const n = nearest_init(map, false);
+    struct nearest_map *const n = nearest_init(map, arena);
 
     /* Initialize Floyd-Steinberg error vectors. */
     f_pixel *restrict thiserr, *restrict nexterr;
-    thiserr = input_image->malloc((cols + 2) * sizeof(*thiserr) * 2); // +2 saves from checking out of bounds access
+    const unsigned int err_size = (cols + 2) * sizeof(*thiserr) * 2; // +2 saves from checking out of bounds access
+    thiserr = arena ? mempool_alloc(arena, err_size, err_size) : input_image->malloc(err_size);
     nexterr = thiserr + (cols + 2);
     srand(12345); /* deterministic dithering is better for comparing results */
-    if (!thiserr) return;
+    if (!thiserr) {
+        nearest_free(n);
+        return LIQ_OUT_OF_MEMORY;
+    }
 
     for (unsigned int col = 0; col < cols + 2; ++col) {
         const double rand_max = RAND_MAX;
@@ -1070,13 +1342,19 @@ static void remap_to_palette_floyd(liq_image *input_image, unsigned char *const
     }
     base_dithering_level *= 15.0/16.0; // prevent small errors from accumulating
 
+    liq_error err = LIQ_OK;
     bool fs_direction = true;
     unsigned int last_match=0;
     for (unsigned int row = 0; row < rows; ++row) {
+        if ((row & 15) == 15 && !liq_progress(quant->progress_callback, quant->progress_callback_user_info, LIQ_PROGRESS_REMAPPING, row * 100.f / rows)) {
+            err = LIQ_ABORTED;
+            break;
+        }
+
         memset(nexterr, 0, (cols + 2) * sizeof(*nexterr));
 
         unsigned int col = (fs_direction) ? 0 : (cols - 1);
-        const f_pixel *const row_pixels = liq_image_get_row_f(input_image, row);
+        const f_pixel *const row_pixels = liq_image_get_row_f(input_image, row, 0);
 
         do {
             float dither_level = base_dithering_level;
@@ -1169,19 +1447,24 @@ static void remap_to_palette_floyd(liq_image *input_image, unsigned char *const
         fs_direction = !fs_direction;
     }
 
-    input_image->free(MIN(thiserr, nexterr)); // MIN because pointers were swapped
-    nearest_free(n);
+    if (!arena) input_image->free(MIN(thiserr, nexterr)); // MIN because pointers were swapped
+    nearest_free(n); // also releases error vectors allocated from the arena
+    return err;
 }
 
 
 /* histogram contains information how many times each color is present in the image, weighted by importance_map */
-static histogram *get_histogram(liq_image *input_image, const liq_attr *options)
+static liq_error get_histogram(liq_image *input_image, const liq_attr *options, histogram **hist_output, mempool *arena, liq_thread_pool *pool, unsigned int threads)
 {
     unsigned int ignorebits=MAX(options->min_posterization_output, options->min_posterization_input);
     const unsigned int cols = input_image->width, rows = input_image->height;
 
-    if (!input_image->noise && options->use_contrast_maps) {
-        contrast_maps(input_image);
+    if (!liq_progress(options->progress_callback, options->progress_callback_user_info, LIQ_PROGRESS_HISTOGRAM, 0)) {
+        return LIQ_ABORTED;
+    }
+
+    if (!input_image->noise && options->use_contrast_maps && !options->low_memory) {
+        contrast_maps(input_image, arena, pool, threads);
     }
 
    /*
@@ -1194,25 +1477,34 @@ static histogram *get_histogram(liq_image *input_image, const liq_attr *options)
 
     struct acolorhash_table *acht;
     const bool all_rows_at_once = liq_image_can_use_rows(input_image);
+    const mempool_mark arena_mark = mempool_get_mark(arena ? *arena : NULL);
     do {
-        acht = pam_allocacolorhash(maxcolors, rows*cols, ignorebits, options->malloc, options->free);
-        if (!acht) return NULL;
+        acht = pam_allocacolorhash(maxcolors, rows*cols, ignorebits, arena, options->malloc, options->free);
+        if (!acht) return LIQ_OUT_OF_MEMORY;
 
         // histogram uses noise contrast map for importance. Color accuracy in noisy areas is not very important.
         // noise map does not include edges to avoid ruining anti-aliasing
         for(unsigned int row=0; row < rows; row++) {
+            if (!all_rows_at_once && (row & 63) == 63 &&
+                !liq_progress(options->progress_callback, options->progress_callback_user_info, LIQ_PROGRESS_HISTOGRAM, row * 100.f / rows)) {
+                pam_freeacolorhash(acht);
+                if (arena) mempool_rewind(arena, arena_mark);
+                return LIQ_ABORTED;
+            }
+
             bool added_ok;
             if (all_rows_at_once) {
                 added_ok = pam_computeacolorhash(acht, (const rgba_pixel *const *)input_image->rows, cols, rows, input_image->noise);
                 if (added_ok) break;
             } else {
-                const rgba_pixel* rows_p[1] = { liq_image_get_row_rgba(input_image, row) };
+                const rgba_pixel* rows_p[1] = { liq_image_get_row_rgba(input_image, row, 0) };
                 added_ok = pam_computeacolorhash(acht, rows_p, cols, 1, input_image->noise ? &input_image->noise[row * cols] : NULL);
             }
             if (!added_ok) {
                 ignorebits++;
                 liq_verbose_printf(options, "  too many colors! Scaling colors to improve clustering... %d", ignorebits);
                 pam_freeacolorhash(acht);
+                if (arena) mempool_rewind(arena, arena_mark);
                 acht = NULL;
                 break;
             }
@@ -1228,13 +1520,15 @@ static histogram *get_histogram(liq_image *input_image, const liq_attr *options)
         liq_image_free_rgba_source(input_image); // bow can free the RGBA source if copy has been made in f_pixels
     }
 
-    histogram *hist = pam_acolorhashtoacolorhist(acht, input_image->gamma, options->malloc, options->free);
+    histogram *hist = pam_acolorhashtoacolorhist(acht, input_image->gamma, arena, options->malloc, options->free);
     pam_freeacolorhash(acht);
-
-    if (hist) {
-        liq_verbose_printf(options, "  made histogram...%d colors found", hist->size);
+    if (!hist) {
+        return LIQ_OUT_OF_MEMORY;
     }
-    return hist;
+
+    liq_verbose_printf(options, "  made histogram...%d colors found", hist->size);
+    *hist_output = hist;
+    return LIQ_OK;
 }
 
 static void modify_alpha(liq_image *input_image, rgba_pixel *const row_pixels)
@@ -1261,32 +1555,62 @@ static void modify_alpha(liq_image *input_image, rgba_pixel *const row_pixels)
 }
 
 /**
- Builds two maps:
-    noise - approximation of areas with high-frequency noise, except straight edges. 1=flat, 0=noisy.
-    edges - noise map including all edges
+ Horizontal and vertical contrast of a pixel, as max of channels. Sets horiz and vert.
  */
-static void contrast_maps(liq_image *image)
+ALWAYS_INLINE static void pixel_contrast(const f_pixel prev, const f_pixel curr, const f_pixel next, const f_pixel prevl, const f_pixel nextl, float *horiz, float *vert);
+inline static void pixel_contrast(const f_pixel prev, const f_pixel curr, const f_pixel next, const f_pixel prevl, const f_pixel nextl, float *horiz, float *vert)
 {
-    const int cols = image->width, rows = image->height;
-    if (cols < 4 || rows < 4 || (3*cols*rows) > LIQ_HIGH_MEMORY_LIMIT) {
-        return;
-    }
+#if USE_SSE
+    const __m128 sign_mask = _mm_set1_ps(-0.f);
+    const __m128 vcurr2 = _mm_mul_ps(_mm_load_ps((const float*)&curr), _mm_set1_ps(2.f));
+    const __m128 h = _mm_andnot_ps(sign_mask, _mm_sub_ps(_mm_add_ps(_mm_load_ps((const float*)&prev), _mm_load_ps((const float*)&next)), vcurr2));
+    const __m128 v = _mm_andnot_ps(sign_mask, _mm_sub_ps(_mm_add_ps(_mm_load_ps((const float*)&prevl), _mm_load_ps((const float*)&nextl)), vcurr2));
+
+    // max of a,g and r,b of both, then max of those pairs gives horiz in lane 0, vert in lane 1
+    const __m128 pairs = _mm_max_ps(_mm_unpacklo_ps(h, v), _mm_unpackhi_ps(h, v));
+    const __m128 res = _mm_max_ps(pairs, _mm_movehl_ps(pairs, pairs));
+    *horiz = _mm_cvtss_f32(res);
+    *vert = _mm_cvtss_f32(_mm_shuffle_ps(res, res, 1));
+#else
+    // contrast is difference between pixels neighbouring horizontally and vertically
+    const float a = fabsf(prev.a+next.a - curr.a*2.f),
+                r = fabsf(prev.r+next.r - curr.r*2.f),
+                g = fabsf(prev.g+next.g - curr.g*2.f),
+                b = fabsf(prev.b+next.b - curr.b*2.f);
+
+    const float a1 = fabsf(prevl.a+nextl.a - curr.a*2.f),
+                r1 = fabsf(prevl.r+nextl.r - curr.r*2.f),
+                g1 = fabsf(prevl.g+nextl.g - curr.g*2.f),
+                b1 = fabsf(prevl.b+nextl.b - curr.b*2.f);
+
+    *horiz = MAX(MAX(a,r),MAX(g,b));
+    *vert = MAX(MAX(a1,r1),MAX(g1,b1));
+#endif
+}
 
-    unsigned char *restrict noise = image->malloc(cols*rows);
-    unsigned char *restrict edges = image->malloc(cols*rows);
-    unsigned char *restrict tmp = image->malloc(cols*rows);
+struct contrast_maps_job {
+    liq_image *image;
+    unsigned char *noise, *edges;
+};
 
-    if (!noise || !edges || !tmp) {
-        return;
-    }
+/**
+ Computes noise and edges maps for rows from start_row to end_row (exclusive)
+ */
+static void contrast_maps_rows(void *context, unsigned int start_row, unsigned int end_row, unsigned int thread)
+{
+    const struct contrast_maps_job *job = context;
+    liq_image *image = job->image;
+    unsigned char *restrict noise = job->noise, *restrict edges = job->edges;
+    const int cols = image->width, rows = image->height;
 
     const f_pixel *curr_row, *prev_row, *next_row;
-    curr_row = prev_row = next_row = liq_image_get_row_f(image, 0);
+    curr_row = liq_image_get_row_f(image, MAX(0, (int)start_row-1), thread);
+    next_row = liq_image_get_row_f(image, start_row, thread);
 
-    for (int j=0; j < rows; j++) {
+    for (int j=start_row; j < (int)end_row; j++) {
         prev_row = curr_row;
         curr_row = next_row;
-        next_row = liq_image_get_row_f(image, MIN(rows-1,j+1));
+        next_row = liq_image_get_row_f(image, MIN(rows-1,j+1), thread);
 
         f_pixel prev, curr = curr_row[0], next=curr;
         for (int i=0; i < cols; i++) {
@@ -1294,22 +1618,9 @@ static void contrast_maps(liq_image *image)
             curr=next;
             next = curr_row[MIN(cols-1,i+1)];
 
-            // contrast is difference between pixels neighbouring horizontally and vertically
-            const float a = fabsf(prev.a+next.a - curr.a*2.f),
-                        r = fabsf(prev.r+next.r - curr.r*2.f),
-                        g = fabsf(prev.g+next.g - curr.g*2.f),
-                        b = fabsf(prev.b+next.b - curr.b*2.f);
-
-            const f_pixel prevl = prev_row[i];
-            const f_pixel nextl = next_row[i];
-
-            const float a1 = fabsf(prevl.a+nextl.a - curr.a*2.f),
-                        r1 = fabsf(prevl.r+nextl.r - curr.r*2.f),
-                        g1 = fabsf(prevl.g+nextl.g - curr.g*2.f),
-                        b1 = fabsf(prevl.b+nextl.b - curr.b*2.f);
+            float horiz, vert;
+            pixel_contrast(prev, curr, next, prev_row[i], next_row[i], &horiz, &vert);
 
-            const float horiz = MAX(MAX(a,r),MAX(g,b));
-            const float vert = MAX(MAX(a1,r1),MAX(g1,b1));
             const float edge = MAX(horiz,vert);
             float z = edge - fabsf(horiz-vert)*.5f;
             z = 1.f - MAX(z,MIN(horiz,vert));
@@ -1322,24 +1633,52 @@ static void contrast_maps(liq_image *image)
             edges[j*cols+i] = z < 256 ? z : 255;
         }
     }
+}
+
+/**
+ Builds two maps:
+    noise - approximation of areas with high-frequency noise, except straight edges. 1=flat, 0=noisy.
+    edges - noise map including all edges
+ */
+static void contrast_maps(liq_image *image, mempool *arena, liq_thread_pool *pool, unsigned int threads)
+{
+    const int cols = image->width, rows = image->height;
+    if (cols < 4 || rows < 4 || (3*cols*rows) > LIQ_HIGH_MEMORY_LIMIT) {
+        return;
+    }
+
+    unsigned char *restrict noise = image->malloc(cols*rows);
+    unsigned char *restrict edges = image->malloc(cols*rows);
+    unsigned char *restrict tmp = arena ? mempool_alloc(arena, cols*rows, cols*rows) : image->malloc(cols*rows);
+
+    if (!noise || !edges || !tmp || !liq_image_get_row_f(image, 0, 0)) { // trigger lazy conversion before threads are started
+        if (noise) image->free(noise);
+        if (edges) image->free(edges);
+        if (tmp && !arena) image->free(tmp);
+        return;
+    }
+
+    // each band of rows is processed like the whole image, rows at band edges are simply read twice
+    struct contrast_maps_job job = {image, noise, edges};
+    liq_parallel_for(pool, rows*cols > 16384 ? threads : 1, rows, contrast_maps_rows, &job);
 
     // noise areas are shrunk and then expanded to remove thin edges from the map
-    liq_max3(noise, tmp, cols, rows);
-    liq_max3(tmp, noise, cols, rows);
+    liq_max3(noise, tmp, cols, rows, pool, threads);
+    liq_max3(tmp, noise, cols, rows, pool, threads);
 
-    liq_blur(noise, tmp, noise, cols, rows, 3);
+    liq_blur(noise, tmp, noise, cols, rows, 3, pool, threads);
 
-    liq_max3(noise, tmp, cols, rows);
+    liq_max3(noise, tmp, cols, rows, pool, threads);
 
-    liq_min3(tmp, noise, cols, rows);
-    liq_min3(noise, tmp, cols, rows);
-    liq_min3(tmp, noise, cols, rows);
+    liq_min3(tmp, noise, cols, rows, pool, threads);
+    liq_min3(noise, tmp, cols, rows, pool, threads);
+    liq_min3(tmp, noise, cols, rows, pool, threads);
 
-    liq_min3(edges, tmp, cols, rows);
-    liq_max3(tmp, edges, cols, rows);
+    liq_min3(edges, tmp, cols, rows, pool, threads);
+    liq_max3(tmp, edges, cols, rows, pool, threads);
     for(int i=0; i < cols*rows; i++) edges[i] = MIN(noise[i], edges[i]);
 
-    image->free(tmp);
+    if (!arena) image->free(tmp);
 
     image->noise = noise;
     image->edges = edges;
@@ -1404,7 +1743,7 @@ static void adjust_histogram_callback(hist_item *item, float diff)
 
  feedback_loop_trials controls how long the search will take. < 0 skips the iteration.
  */
-static colormap *find_best_palette(histogram *hist, const liq_attr *options, double *palette_error_p)
+static liq_error find_best_palette(histogram *hist, viter_histogram *vh, const liq_attr *options, colormap **palette_output, double *palette_error_p, const double deadline, mempool *arena, liq_thread_pool *pool, unsigned int threads)
 {
     unsigned int max_colors = options->max_colors;
     // if output is posterized it doesn't make sense to aim for perfrect colors, so increase target_mse
@@ -1417,15 +1756,27 @@ static colormap *find_best_palette(histogram *hist, const liq_attr *options, dou
     const double percent = (double)(feedback_loop_trials>0?feedback_loop_trials:1)/100.0;
 
     do {
+        const int progress = 100-MAX(0,(int)(feedback_loop_trials/percent));
+        if (!liq_progress(options->progress_callback, options->progress_callback_user_info, LIQ_PROGRESS_PALETTE, progress)) {
+            if (acolormap) pam_freecolormap(acolormap);
+            return LIQ_ABORTED;
+        }
+
+        const double trial_start = liq_time_ms();
         colormap *newmap = mediancut(hist, options->min_opaque_val, max_colors,
             target_mse * target_mse_overshoot, MAX(MAX(90.0/65536.0, target_mse), least_error)*1.2,
-            options->malloc, options->free);
+            options->malloc, options->free, pool, threads);
         if (!newmap) {
-            return NULL;
+            if (acolormap) pam_freecolormap(acolormap);
+            return LIQ_OUT_OF_MEMORY;
         }
 
+        // mediancut has reordered the histogram
+        viter_histogram_update(vh, hist);
+
         if (feedback_loop_trials <= 0) {
-            return newmap;
+            *palette_output = newmap;
+            return LIQ_OK;
         }
 
         // after palette has been created, total error (MSE) is calculated to keep the best palette
@@ -1433,7 +1784,8 @@ static colormap *find_best_palette(histogram *hist, const liq_attr *options, dou
         // and histogram weights are adjusted based on remapping error to give more weight to poorly matched colors
 
         const bool first_run_of_target_mse = !acolormap && target_mse > 0;
-        double total_error = viter_do_iteration(hist, newmap, options->min_opaque_val, first_run_of_target_mse ? NULL : adjust_histogram_callback, !acolormap || options->fast_palette);
+        double total_error = viter_do_iteration(hist, vh, newmap, options->min_opaque_val, first_run_of_target_mse ? NULL : adjust_histogram_callback, arena, pool, threads);
+        const unsigned int trial_colors = newmap->colors;
 
         // goal is to increase quality or to reduce number of colors used if quality is good enough
         if (!acolormap || total_error < least_error || (total_error <= target_mse && newmap->colors < max_colors)) {
@@ -1465,44 +1817,58 @@ static colormap *find_best_palette(histogram *hist, const liq_attr *options, dou
             pam_freecolormap(newmap);
         }
 
-        liq_verbose_printf(options, "  selecting colors...%d%%",100-MAX(0,(int)(feedback_loop_trials/percent)));
+        liq_verbose_printf(options, "  selecting colors...%d%% (MSE=%.3f with %d colors, %.1fms)", 100-MAX(0,(int)(feedback_loop_trials/percent)),
+                           total_error*65536.0/6.0, trial_colors, liq_time_ms() - trial_start);
+
+        if (feedback_loop_trials > 0 && past_deadline(deadline)) {
+            verbose_print(options, "  time limit reached, keeping the best palette so far");
+            break;
+        }
     }
     while(feedback_loop_trials > 0);
 
     // likely_colormap_index (used and set in viter_do_iteration) can't point to index outside colormap
     if (acolormap->colors < 256) {
-	for(unsigned int j=0; j < hist->size; j++) {
-	    if (hist->achv[j].tmp.likely_colormap_index >= acolormap->colors) {
-		hist->achv[j].tmp.likely_colormap_index = 0; // actual value doesn't matter, as the guess is out of date anyway
+	for(unsigned int j=0; j < vh->size; j++) {
+	    if (vh->likely_colormap_index[j] >= acolormap->colors) {
+		vh->likely_colormap_index[j] = 0; // actual value doesn't matter, as the guess is out of date anyway
 	    }
 	}
     }
     *palette_error_p = least_error;
-    return acolormap;
+    *palette_output = acolormap;
+    return LIQ_OK;
 }
 
-static liq_result *pngquant_quantize(histogram *hist, const liq_attr *options, const double gamma)
+static liq_error pngquant_quantize(histogram *hist, const liq_attr *options, const double gamma, const double deadline, mempool *arena, liq_thread_pool *pool, unsigned int threads, liq_result **result_output)
 {
     colormap *acolormap;
     double palette_error = -1;
 
-    // no point having perfect match with imperfect colors (ignorebits > 0)
-    const bool fast_palette = options->fast_palette || hist->ignorebits > 0;
     const bool few_input_colors = hist->size <= options->max_colors;
 
     // If image has few colors to begin with (and no quality degradation is required)
     // then it's possible to skip quantization entirely
     if (few_input_colors && options->target_mse == 0) {
         acolormap = pam_colormap(hist->size, options->malloc, options->free);
+        if (!acolormap) {
+            return LIQ_OUT_OF_MEMORY;
+        }
         for(unsigned int i=0; i < hist->size; i++) {
             acolormap->palette[i].acolor = hist->achv[i].acolor;
             acolormap->palette[i].popularity = hist->achv[i].perceptual_weight;
         }
         palette_error = 0;
     } else {
-        acolormap = find_best_palette(hist, options, &palette_error);
-        if (!acolormap) {
-            return NULL;
+        viter_histogram *vh = viter_histogram_create(hist, arena, options->malloc, options->free);
+        if (!vh) {
+            return LIQ_OUT_OF_MEMORY;
+        }
+
+        liq_error err = find_best_palette(hist, vh, options, &acolormap, &palette_error, deadline, arena, pool, threads);
+        if (err != LIQ_OK) {
+            viter_histogram_free(vh);
+            return err;
         }
 
         // Voronoi iteration approaches local minimum for the palette
@@ -1516,9 +1882,35 @@ static liq_result *pngquant_quantize(histogram *hist, const liq_attr *options, c
             verbose_print(options, "  moving colormap towards local minimum");
 
             double previous_palette_error = MAX_DIFF;
+            vh->use_bounds = iterations > 1; // palette moves less with each iteration, so searches can be skipped
+            f_pixel previous_palette[acolormap->colors];
 
             for(unsigned int i=0; i < iterations; i++) {
-                palette_error = viter_do_iteration(hist, acolormap, options->min_opaque_val, NULL, i==0 || options->fast_palette);
+                if (!liq_progress(options->progress_callback, options->progress_callback_user_info, LIQ_PROGRESS_REFINEMENT, i * 100.f / iterations)) {
+                    viter_histogram_free(vh);
+                    pam_freecolormap(acolormap);
+                    return LIQ_ABORTED;
+                }
+
+                // the first iteration is required if error hasn't been calculated yet
+                if (palette_error >= 0 && past_deadline(deadline)) {
+                    verbose_print(options, "  time limit reached, stopping early");
+                    break;
+                }
+
+                const double iteration_start = liq_time_ms();
+                for(unsigned int j=0; j < acolormap->colors; j++) {
+                    previous_palette[j] = acolormap->palette[j].acolor;
+                }
+
+                palette_error = viter_do_iteration(hist, vh, acolormap, options->min_opaque_val, NULL, arena, pool, threads);
+
+                float palette_drift = 0; // the largest move of a palette color
+                for(unsigned int j=0; j < acolormap->colors; j++) {
+                    palette_drift = MAX(palette_drift, colordifference(previous_palette[j], acolormap->palette[j].acolor));
+                }
+                liq_verbose_printf(options, "  iteration %u: MSE=%.3f, palette moved by up to %.3f, %.1fms", i+1,
+                                   palette_error*65536.0/6.0, palette_drift*65536.0/6.0, liq_time_ms() - iteration_start);
 
                 if (fabs(previous_palette_error-palette_error) < iteration_limit) {
                     break;
@@ -1532,32 +1924,46 @@ static liq_result *pngquant_quantize(histogram *hist, const liq_attr *options, c
                 previous_palette_error = palette_error;
             }
         }
+        viter_histogram_free(vh);
 
         if (palette_error > max_mse) {
             liq_verbose_printf(options, "  image degradation MSE=%.3f (Q=%d) exceeded limit of %.3f (%d)",
                                palette_error*65536.0/6.0, mse_to_quality(palette_error),
                                max_mse*65536.0/6.0, mse_to_quality(max_mse));
             pam_freecolormap(acolormap);
-            return NULL;
+            return LIQ_QUALITY_TOO_LOW;
         }
     }
 
     sort_palette(acolormap, options);
 
     liq_result *result = options->malloc(sizeof(liq_result));
-    if (!result) return NULL;
+    if (!result) {
+        pam_freecolormap(acolormap);
+        return LIQ_OUT_OF_MEMORY;
+    }
     *result = (liq_result){
         .magic_header = liq_result_magic,
         .malloc = options->malloc,
         .free = options->free,
         .palette = acolormap,
         .palette_error = palette_error,
-        .fast_palette = fast_palette,
-        .use_dither_map = options->use_dither_map,
+        .use_dither_map = options->use_dither_map && !options->low_memory,
         .gamma = gamma,
         .min_posterization_output = options->min_posterization_output,
+        .arena = liq_arena_retain(options->arena),
+        .thread_pool = liq_thread_pool_retain(pool),
+        .max_threads = options->max_threads,
+        .progress_callback = options->progress_callback,
+        .progress_callback_user_info = options->progress_callback_user_info,
     };
-    return result;
+    if (options->lut_gamma == gamma) {
+        result->lut_gamma = gamma;
+        memcpy(result->gamma_lut, options->gamma_lut, sizeof(result->gamma_lut));
+        memcpy(result->rgb_lut, options->rgb_lut, sizeof(result->rgb_lut));
+    }
+    *result_output = result;
+    return LIQ_OK;
 }
 
 LIQ_EXPORT liq_error liq_write_remapped_image(liq_result *result, liq_image *input_image, void *buffer, size_t buffer_size)
@@ -1593,14 +1999,22 @@ LIQ_EXPORT liq_error liq_write_remapped_image_rows(liq_result *quant, liq_image
         if (!CHECK_USER_POINTER(row_pointers+i) || !CHECK_USER_POINTER(row_pointers[i])) return LIQ_INVALID_POINTER;
     }
 
+    if (!liq_progress(quant->progress_callback, quant->progress_callback_user_info, LIQ_PROGRESS_REMAPPING, 0)) {
+        return LIQ_ABORTED;
+    }
+
     if (quant->remapping) {
         liq_remapping_result_destroy(quant->remapping);
     }
     liq_remapping_result *const result = quant->remapping = liq_remapping_result_create(quant);
     if (!result) return LIQ_OUT_OF_MEMORY;
 
+    mempool *arena = liq_arena_enter(quant->arena);
+    liq_thread_pool *pool = quant->thread_pool;
+    const unsigned int threads = liq_thread_count(pool, MIN(quant->max_threads, input_image->max_threads));
+
     if (!input_image->edges && !input_image->dither_map && quant->use_dither_map) {
-        contrast_maps(input_image);
+        contrast_maps(input_image, arena, pool, threads);
     }
 
     /*
@@ -1610,23 +2024,31 @@ LIQ_EXPORT liq_error liq_write_remapped_image_rows(liq_result *quant, liq_image
 
     float remapping_error = result->palette_error;
     if (result->dither_level == 0) {
-        set_rounded_palette(&result->int_palette, result->palette, result->gamma, quant->min_posterization_output);
-        remapping_error = remap_to_palette(input_image, row_pointers, result->palette, quant->fast_palette);
+        set_rounded_palette(&result->int_palette, result->palette, quant, quant->min_posterization_output);
+        remapping_error = remap_to_palette(input_image, row_pointers, result->palette, arena, pool, threads);
     } else {
         const bool generate_dither_map = result->use_dither_map && (input_image->edges && !input_image->dither_map);
         if (generate_dither_map) {
             // If dithering (with dither map) is required, this image is used to find areas that require dithering
-            remapping_error = remap_to_palette(input_image, row_pointers, result->palette, quant->fast_palette);
+            remapping_error = remap_to_palette(input_image, row_pointers, result->palette, arena, pool, threads);
             update_dither_map(row_pointers, input_image);
         }
 
         // remapping above was the last chance to do voronoi iteration, hence the final palette is set after remapping
-        set_rounded_palette(&result->int_palette, result->palette, result->gamma, quant->min_posterization_output);
-
-        remap_to_palette_floyd(input_image, row_pointers, result->palette,
-            MAX(remapping_error*2.4, 16.f/256.f), result->use_dither_map, generate_dither_map, result->dither_level);
+        set_rounded_palette(&result->int_palette, result->palette, quant, quant->min_posterization_output);
+
+        liq_error err = remap_to_palette_floyd(quant, input_image, row_pointers, result->palette,
+            MAX(remapping_error*2.4, 16.f/256.f), result->use_dither_map, generate_dither_map, result->dither_level, arena);
+        if (err != LIQ_OK) {
+            liq_arena_leave(quant->arena);
+            liq_remapping_result_destroy(result);
+            quant->remapping = NULL;
+            return err;
+        }
     }
 
+    liq_arena_leave(quant->arena);
+
     // remapping error from dithered image is absurd, so always non-dithered value is used
     // palette_error includes some perceptual weighting from histogram which is closer correlated with dssim
     // so that should be used when possible.
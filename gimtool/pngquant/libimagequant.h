@@ -29,6 +29,7 @@ extern "C" {
 typedef struct liq_attr liq_attr;
 typedef struct liq_image liq_image;
 typedef struct liq_result liq_result;
+typedef struct liq_thread_pool liq_thread_pool;
 
 typedef struct liq_color {
     unsigned char r, g, b, a;
@@ -48,6 +49,7 @@ typedef enum liq_error {
     LIQ_BITMAP_NOT_AVAILABLE,
     LIQ_BUFFER_TOO_SMALL,
     LIQ_INVALID_POINTER,
+    LIQ_ABORTED,
 } liq_error;
 
 enum liq_ownership {LIQ_OWN_ROWS=4, LIQ_OWN_PIXELS=8};
@@ -69,12 +71,32 @@ LIQ_EXPORT liq_error liq_set_quality(liq_attr* attr, int minimum, int maximum);
 LIQ_EXPORT int liq_get_min_quality(const liq_attr* attr);
 LIQ_EXPORT int liq_get_max_quality(const liq_attr* attr);
 LIQ_EXPORT void liq_set_last_index_transparent(liq_attr* attr, int is_last);
+LIQ_EXPORT void liq_set_low_memory(liq_attr* attr, int enabled);
+LIQ_EXPORT liq_error liq_set_arena(liq_attr* attr, int enabled);
+LIQ_EXPORT liq_error liq_set_time_limit_ms(liq_attr* attr, int milliseconds);
+LIQ_EXPORT int liq_get_time_limit_ms(const liq_attr* attr);
+LIQ_EXPORT liq_error liq_set_max_threads(liq_attr* attr, int threads);
+LIQ_EXPORT int liq_get_max_threads(const liq_attr* attr);
+LIQ_EXPORT liq_error liq_set_thread_pool(liq_attr* attr, liq_thread_pool* pool);
+
+LIQ_EXPORT liq_thread_pool* liq_thread_pool_create(int threads);
+LIQ_EXPORT void liq_thread_pool_destroy(liq_thread_pool* pool);
 
 typedef void liq_log_callback_function(const liq_attr*, const char* message, void* user_info);
 typedef void liq_log_flush_callback_function(const liq_attr*, void* user_info);
 LIQ_EXPORT void liq_set_log_callback(liq_attr*, liq_log_callback_function*, void* user_info);
 LIQ_EXPORT void liq_set_log_flush_callback(liq_attr*, liq_log_flush_callback_function*, void* user_info);
 
+typedef enum liq_progress_stage {
+    LIQ_PROGRESS_HISTOGRAM,
+    LIQ_PROGRESS_PALETTE,
+    LIQ_PROGRESS_REFINEMENT,
+    LIQ_PROGRESS_REMAPPING,
+} liq_progress_stage;
+
+typedef int liq_progress_callback_function(liq_progress_stage stage, float progress_percent, void* user_info);
+LIQ_EXPORT void liq_set_progress_callback(liq_attr*, liq_progress_callback_function*, void* user_info);
+
 LIQ_EXPORT liq_image* liq_image_create_rgba_rows(liq_attr* attr, void* rows[], int width, int height, double gamma);
 LIQ_EXPORT liq_image* liq_image_create_rgba(liq_attr* attr, void* bitmap, int width, int height, double gamma);
 
@@ -87,6 +109,7 @@ LIQ_EXPORT int liq_image_get_height(const liq_image* img);
 LIQ_EXPORT void liq_image_destroy(liq_image* img);
 
 LIQ_EXPORT liq_result* liq_quantize_image(liq_attr* options, liq_image* input_image);
+LIQ_EXPORT liq_error liq_image_quantize(liq_image* input_image, liq_attr* options, liq_result** result_output);
 
 LIQ_EXPORT liq_error liq_set_dithering_level(liq_result* res, float dither_level);
 LIQ_EXPORT liq_error liq_set_output_gamma(liq_result* res, double gamma);
@@ -18,6 +18,7 @@
 #include "libimagequant.h"
 #include "pam.h"
 #include "mediancut.h"
+#include "threadpool.h"
 
 #define index_of_channel(ch) (offsetof(f_pixel,ch)/sizeof(float))
 
@@ -31,49 +32,129 @@ struct box {
     unsigned int colors;
 };
 
-ALWAYS_INLINE static double variance_diff(double val, const double good_enough);
-inline static double variance_diff(double val, const double good_enough)
+ALWAYS_INLINE static precise_float variance_diff(precise_float val, const precise_float good_enough);
+inline static precise_float variance_diff(precise_float val, const precise_float good_enough)
 {
     val *= val;
     if (val < good_enough*good_enough) return val*0.25;
     return val;
 }
 
-/** Weighted per-channel variance of the box. It's used to decide which channel to split by */
-static f_pixel box_variance(const hist_item achv[], const struct box *box)
+// boxes larger than this are processed in chunks, which can be handled by different threads
+#define BOX_CHUNK_SIZE 8192
+// number of chunks depends only on size of the box, so results don't depend on number of threads
+#define BOX_MAX_CHUNKS 64
+
+/** Partial sums over a contiguous range of box's colors */
+typedef struct {
+    precise_float new_a, weight_sum;
+    float maxa;
+    precise_float r, g, b, a, color_sum;
+    precise_float variancea, variancer, varianceg, varianceb;
+    precise_float total_error, max_error;
+    precise_float totalvar;
+} box_sums;
+
+/** first pass of averagepixels: final opacity is needed in order to blend colors at that opacity */
+static void opacity_sums(const hist_item achv[], const unsigned int start, const unsigned int end, box_sums *const s)
 {
-    f_pixel mean = box->color;
-    double variancea=0, variancer=0, varianceg=0, varianceb=0;
-
-    for(unsigned int i = 0; i < box->colors; ++i) {
-        f_pixel px = achv[box->ind + i].acolor;
-        double weight = achv[box->ind + i].adjusted_weight;
-        variancea += variance_diff(mean.a - px.a, 2.0/256.0)*weight;
-        variancer += variance_diff(mean.r - px.r, 1.0/256.0)*weight;
-        varianceg += variance_diff(mean.g - px.g, 1.0/256.0)*weight;
-        varianceb += variance_diff(mean.b - px.b, 1.0/256.0)*weight;
+    for(unsigned int i = start; i < end; ++i) {
+        const f_pixel px = achv[i].acolor;
+        s->new_a += px.a * achv[i].adjusted_weight;
+        s->weight_sum += achv[i].adjusted_weight;
+
+        /* find if there are opaque colors, in case we're supposed to preserve opacity exactly (ie_bug) */
+        if (px.a > s->maxa) s->maxa = px.a;
     }
+}
 
-    return (f_pixel){
-        .a = variancea*(4.0/16.0),
-        .r = variancer*(7.0/16.0),
-        .g = varianceg*(9.0/16.0),
-        .b = varianceb*(5.0/16.0),
-    };
+static double final_opacity(const box_sums *const s, const float min_opaque_val)
+{
+    double new_a = s->new_a;
+    if (s->weight_sum) new_a /= s->weight_sum;
+
+    /** if there was at least one completely opaque color, "round" final color to opaque */
+    if (new_a >= min_opaque_val && s->maxa >= (255.0/256.0)) new_a = 1;
+    return new_a;
 }
 
-static double box_max_error(const hist_item achv[], const struct box *box)
+/** second pass of averagepixels */
+static void color_sums(const hist_item achv[], const unsigned int start, const unsigned int end, const double new_a, const f_pixel center, box_sums *const s)
 {
-    f_pixel mean = box->color;
-    double max_error = 0;
+    // reverse iteration for cache locality with previous loop
+    for(unsigned int i = end; i-- > start;) {
+        precise_float tmp, weight = 1.0f;
+        f_pixel px = achv[i].acolor;
+
+        /* give more weight to colors that are further away from average
+         this is intended to prevent desaturation of images and fading of whites
+         */
+        tmp = (center.r - px.r);
+        weight += tmp*tmp;
+        tmp = (center.g - px.g);
+        weight += tmp*tmp;
+        tmp = (center.b - px.b);
+        weight += tmp*tmp;
+
+        weight *= achv[i].adjusted_weight;
+        s->color_sum += weight;
 
-    for(unsigned int i = 0; i < box->colors; ++i) {
-        const double diff = colordifference(mean, achv[box->ind + i].acolor);
-        if (diff > max_error) {
-            max_error = diff;
+        if (px.a) {
+            px.r /= px.a;
+            px.g /= px.a;
+            px.b /= px.a;
         }
+
+        s->r += px.r * new_a * weight;
+        s->g += px.g * new_a * weight;
+        s->b += px.b * new_a * weight;
+        s->a += new_a * weight;
     }
-    return max_error;
+}
+
+static f_pixel color_from_sums(const box_sums *const s)
+{
+    double r = s->r, g = s->g, b = s->b, a = s->a;
+
+    if (s->color_sum) {
+    a /= s->color_sum;
+    r /= s->color_sum;
+    g /= s->color_sum;
+    b /= s->color_sum;
+    }
+
+    assert(!isnan(r) && !isnan(g) && !isnan(b) && !isnan(a));
+
+    return (f_pixel){.r=r, .g=g, .b=b, .a=a};
+}
+
+/** Weighted per-channel variance of the box (used to decide which channel to split by), and its max and total error */
+static void variance_sums(const hist_item achv[], const unsigned int start, const unsigned int end, const f_pixel mean, box_sums *const s)
+{
+    for(unsigned int i = start; i < end; ++i) {
+        const f_pixel px = achv[i].acolor;
+        const precise_float weight = achv[i].adjusted_weight;
+        s->variancea += variance_diff(mean.a - px.a, 2.0/256.0)*weight;
+        s->variancer += variance_diff(mean.r - px.r, 1.0/256.0)*weight;
+        s->varianceg += variance_diff(mean.g - px.g, 1.0/256.0)*weight;
+        s->varianceb += variance_diff(mean.b - px.b, 1.0/256.0)*weight;
+
+        const float diff = colordifference(mean, px);
+        if (diff > s->max_error) {
+            s->max_error = diff;
+        }
+        s->total_error += diff * achv[i].perceptual_weight;
+    }
+}
+
+static f_pixel variance_from_sums(const box_sums *const s)
+{
+    return (f_pixel){
+        .a = s->variancea*(4.0/16.0),
+        .r = s->variancer*(7.0/16.0),
+        .g = s->varianceg*(9.0/16.0),
+        .b = s->varianceb*(5.0/16.0),
+    };
 }
 
 ALWAYS_INLINE static double color_weight(f_pixel median, hist_item h);
@@ -184,8 +265,145 @@ static int comparevariance(const void *ch1, const void *ch2)
           (((const channelvariance*)ch1)->variance < ((const channelvariance*)ch2)->variance ? 1 : 0);
 }
 
+enum box_pass {
+    BOX_PASS_SORT_VALUE, BOX_PASS_COLOR_WEIGHT, BOX_PASS_OPACITY, BOX_PASS_COLOR, BOX_PASS_VARIANCE,
+};
+
+/** A pass over colors of one box, or both halves of a box that has just been split */
+struct box_pass_job {
+    hist_item *achv;
+    struct box *boxes[2];
+    unsigned int box_count;
+    unsigned int first_chunk[3]; // chunks of boxes[i] are first_chunk[i] to first_chunk[i+1]
+    enum box_pass pass;
+    unsigned int channels[4];
+    f_pixel median, center;
+    double new_a[2];
+    box_sums sums[2*BOX_MAX_CHUNKS];
+};
+
+static unsigned int box_chunk_count(const struct box *box)
+{
+    const unsigned int chunks = (box->colors + BOX_CHUNK_SIZE-1) / BOX_CHUNK_SIZE;
+    return MAX(1, MIN(BOX_MAX_CHUNKS, chunks));
+}
+
+static void box_pass_init(struct box_pass_job *job, hist_item achv[], struct box *box1, struct box *box2)
+{
+    *job = (struct box_pass_job){
+        .achv = achv,
+        .boxes = {box1, box2},
+        .box_count = box2 ? 2 : 1,
+    };
+    job->first_chunk[1] = box_chunk_count(box1);
+    job->first_chunk[2] = job->first_chunk[1] + (box2 ? box_chunk_count(box2) : 0);
+}
+
+static void box_pass_chunks(void *context, unsigned int start, unsigned int end, unsigned int thread)
+{
+    struct box_pass_job *job = context;
+    hist_item *achv = job->achv;
+
+    for(unsigned int chunk = start; chunk < end; chunk++) {
+        const unsigned int bi = chunk >= job->first_chunk[1];
+        const struct box *box = job->boxes[bi];
+        const unsigned int n = chunk - job->first_chunk[bi], chunks = job->first_chunk[bi+1] - job->first_chunk[bi];
+        const unsigned int from = box->ind + (unsigned long long)box->colors * n / chunks;
+        const unsigned int to = box->ind + (unsigned long long)box->colors * (n+1) / chunks;
+        box_sums *s = &job->sums[chunk];
+
+        switch(job->pass) {
+            case BOX_PASS_SORT_VALUE:
+                for(unsigned int i=from; i < to; i++) {
+                    const float *chans = (const float *)&achv[i].acolor;
+                    // Only the first channel really matters. When trying median cut many times
+                    // with different histogram weights, I don't want sort randomness to influence outcome.
+                    achv[i].tmp.sort_value = ((unsigned int)(chans[job->channels[0]]*65535.0)<<16) |
+                                           (unsigned int)((chans[job->channels[2]] + chans[job->channels[1]]/2.0 + chans[job->channels[3]]/4.0)*65535.0);
+                }
+                break;
+            case BOX_PASS_COLOR_WEIGHT:
+                for(unsigned int i=from; i < to; i++) s->totalvar += (achv[i].color_weight = color_weight(job->median, achv[i]));
+                break;
+            case BOX_PASS_OPACITY:
+                opacity_sums(achv, from, to, s);
+                break;
+            case BOX_PASS_COLOR:
+                color_sums(achv, from, to, job->new_a[bi], job->center, s);
+                break;
+            case BOX_PASS_VARIANCE:
+                variance_sums(achv, from, to, box->color, s);
+                break;
+        }
+    }
+}
+
+static void box_pass_run(struct box_pass_job *job, const enum box_pass pass, liq_thread_pool *pool, const unsigned int threads)
+{
+    job->pass = pass;
+    const unsigned int chunks = job->first_chunk[job->box_count];
+    liq_parallel_for(pool, MIN(threads, chunks), chunks, box_pass_chunks, job);
+}
+
+/** Adds up partial sums of the box always in the same order */
+static box_sums box_pass_total(const struct box_pass_job *job, const unsigned int bi)
+{
+    box_sums total = job->sums[job->first_chunk[bi]];
+    for(unsigned int i = job->first_chunk[bi]+1; i < job->first_chunk[bi+1]; i++) {
+        const box_sums *s = &job->sums[i];
+        total.new_a += s->new_a;
+        total.weight_sum += s->weight_sum;
+        total.maxa = MAX(total.maxa, s->maxa);
+        total.r += s->r;
+        total.g += s->g;
+        total.b += s->b;
+        total.a += s->a;
+        total.color_sum += s->color_sum;
+        total.variancea += s->variancea;
+        total.variancer += s->variancer;
+        total.varianceg += s->varianceg;
+        total.varianceb += s->varianceb;
+        total.total_error += s->total_error;
+        total.max_error = MAX(total.max_error, s->max_error);
+        total.totalvar += s->totalvar;
+    }
+    return total;
+}
+
+/**
+ Sets color, sum of weights, variance and errors of a box, or both halves of a split box.
+ Halves are independent, so their chunks are processed together.
+ */
+static void set_box_stats(struct box *box1, struct box *box2, hist_item achv[], const float min_opaque_val, const f_pixel center, liq_thread_pool *pool, const unsigned int threads)
+{
+    struct box_pass_job job;
+    box_pass_init(&job, achv, box1, box2);
+    job.center = center;
+
+    box_pass_run(&job, BOX_PASS_OPACITY, pool, threads);
+    for(unsigned int bi=0; bi < job.box_count; bi++) {
+        const box_sums s = box_pass_total(&job, bi);
+        job.new_a[bi] = final_opacity(&s, min_opaque_val);
+        job.boxes[bi]->sum = s.weight_sum;
+    }
+
+    box_pass_run(&job, BOX_PASS_COLOR, pool, threads);
+    for(unsigned int bi=0; bi < job.box_count; bi++) {
+        const box_sums s = box_pass_total(&job, bi);
+        job.boxes[bi]->color = color_from_sums(&s);
+    }
+
+    box_pass_run(&job, BOX_PASS_VARIANCE, pool, threads);
+    for(unsigned int bi=0; bi < job.box_count; bi++) {
+        const box_sums s = box_pass_total(&job, bi);
+        job.boxes[bi]->variance = variance_from_sums(&s);
+        job.boxes[bi]->max_error = s.max_error;
+        job.boxes[bi]->total_error = s.total_error;
+    }
+}
+
 /** Finds which channels need to be sorted first and preproceses achv for fast sort */
-static double prepare_sort(struct box *b, hist_item achv[])
+static double prepare_sort(struct box *b, hist_item achv[], liq_thread_pool *pool, const unsigned int threads)
 {
     /*
      ** Sort dimensions by their variance, and then sort colors first by dimension with highest variance
@@ -199,21 +417,16 @@ static double prepare_sort(struct box *b, hist_item achv[])
 
     qsort(channels, 4, sizeof(channels[0]), comparevariance);
 
-    for(unsigned int i=0; i < b->colors; i++) {
-        const float *chans = (const float *)&achv[b->ind + i].acolor;
-        // Only the first channel really matters. When trying median cut many times
-        // with different histogram weights, I don't want sort randomness to influence outcome.
-        achv[b->ind + i].tmp.sort_value = ((unsigned int)(chans[channels[0].chan]*65535.0)<<16) |
-                                       (unsigned int)((chans[channels[2].chan] + chans[channels[1].chan]/2.0 + chans[channels[3].chan]/4.0)*65535.0);
-    }
+    struct box_pass_job job;
+    box_pass_init(&job, achv, b, NULL);
+    for(unsigned int i=0; i < 4; i++) job.channels[i] = channels[i].chan;
+    box_pass_run(&job, BOX_PASS_SORT_VALUE, pool, threads);
 
-    const f_pixel median = get_median(b, achv);
+    job.median = get_median(b, achv);
 
     // box will be split to make color_weight of each side even
-    const unsigned int ind = b->ind, end = ind+b->colors;
-    double totalvar = 0;
-    for(unsigned int j=ind; j < end; j++) totalvar += (achv[j].color_weight = color_weight(median, achv[j]));
-    return totalvar / 2.0;
+    box_pass_run(&job, BOX_PASS_COLOR_WEIGHT, pool, threads);
+    return box_pass_total(&job, 0).totalvar / 2.0;
 }
 
 /** finds median in unsorted set by sorting only minimum required */
@@ -267,39 +480,15 @@ inline static double color_weight(f_pixel median, hist_item h)
 }
 
 static void set_colormap_from_boxes(colormap *map, struct box* bv, unsigned int boxes, hist_item *achv);
-static void adjust_histogram(hist_item *achv, const colormap *map, const struct box* bv, unsigned int boxes);
+static void adjust_histogram(hist_item *achv, const colormap *map, const struct box* bv, unsigned int boxes, liq_thread_pool *pool, unsigned int threads);
 
-double box_error(const struct box *box, const hist_item achv[])
-{
-    f_pixel avg = box->color;
-
-    double total_error=0;
-    for (unsigned int i = 0; i < box->colors; ++i) {
-        total_error += colordifference(avg, achv[box->ind + i].acolor) * achv[box->ind + i].perceptual_weight;
-    }
-
-    return total_error;
-}
-
-
-static bool total_box_error_below_target(double target_mse, struct box bv[], unsigned int boxes, const histogram *hist)
+static bool total_box_error_below_target(double target_mse, const struct box bv[], unsigned int boxes, const histogram *hist)
 {
     target_mse *= hist->total_perceptual_weight;
     double total_error=0;
 
     for(unsigned int i=0; i < boxes; i++) {
-        // error is (re)calculated lazily
-        if (bv[i].total_error >= 0) {
-            total_error += bv[i].total_error;
-        }
-        if (total_error > target_mse) return false;
-    }
-
-    for(unsigned int i=0; i < boxes; i++) {
-        if (bv[i].total_error < 0) {
-            bv[i].total_error = box_error(&bv[i], hist->achv);
-            total_error += bv[i].total_error;
-        }
+        total_error += bv[i].total_error;
         if (total_error > target_mse) return false;
     }
 
@@ -311,7 +500,7 @@ static bool total_box_error_below_target(double target_mse, struct box bv[], uns
  ** on Paul Heckbert's paper, "Color Image Quantization for Frame Buffer
  ** Display," SIGGRAPH 1982 Proceedings, page 297.
  */
-LIQ_PRIVATE colormap *mediancut(histogram *hist, const float min_opaque_val, unsigned int newcolors, const double target_mse, const double max_mse, void* (*malloc)(size_t), void (*free)(void*))
+LIQ_PRIVATE colormap *mediancut(histogram *hist, const float min_opaque_val, unsigned int newcolors, const double target_mse, const double max_mse, void* (*malloc)(size_t), void (*free)(void*), liq_thread_pool *pool, unsigned int threads)
 {
     hist_item *achv = hist->achv;
     struct box bv[newcolors];
@@ -321,29 +510,15 @@ LIQ_PRIVATE colormap *mediancut(histogram *hist, const float min_opaque_val, uns
      */
     bv[0].ind = 0;
     bv[0].colors = hist->size;
-    bv[0].color = averagepixels(bv[0].colors, &achv[bv[0].ind], min_opaque_val, (f_pixel){0.5,0.5,0.5,0.5});
-    bv[0].variance = box_variance(achv, &bv[0]);
-    bv[0].max_error = box_max_error(achv, &bv[0]);
-    bv[0].sum = 0;
-    bv[0].total_error = -1;
-    for(unsigned int i=0; i < bv[0].colors; i++) bv[0].sum += achv[i].adjusted_weight;
+    set_box_stats(&bv[0], NULL, achv, min_opaque_val, (f_pixel){0.5,0.5,0.5,0.5}, pool, threads);
 
     unsigned int boxes = 1;
 
-    // remember smaller palette for fast searching
-    colormap *representative_subset = NULL;
-    unsigned int subset_size = ceilf(powf(newcolors,0.7f));
-
     /*
      ** Main loop: split boxes until we have enough.
      */
     while (boxes < newcolors) {
 
-        if (boxes == subset_size) {
-            representative_subset = pam_colormap(boxes, malloc, free);
-            set_colormap_from_boxes(representative_subset, bv, boxes, achv);
-        }
-
         // first splits boxes that exceed quality limit (to have colors for things like odd green pixel),
         // later raises the limit to allow large smooth areas/gradients get colors.
         const double current_max_mse = max_mse + (boxes/(double)newcolors)*16.0*max_mse;
@@ -365,7 +540,7 @@ LIQ_PRIVATE colormap *mediancut(histogram *hist, const float min_opaque_val, uns
          Median used as expected value gives much better results than mean.
          */
 
-        const double halfvar = prepare_sort(&bv[bi], achv);
+        const double halfvar = prepare_sort(&bv[bi], achv, pool, threads);
         double lowervar=0;
 
         // hist_item_sort_halfvar sorts and sums lowervar at the same time
@@ -376,24 +551,13 @@ LIQ_PRIVATE colormap *mediancut(histogram *hist, const float min_opaque_val, uns
         /*
          ** Split the box.
          */
-        double sm = bv[bi].sum;
-        double lowersum = 0;
-        for(unsigned int i=0; i < break_at; i++) lowersum += achv[indx + i].adjusted_weight;
-
+        const double sm = bv[bi].sum;
         const f_pixel previous_center = bv[bi].color;
         bv[bi].colors = break_at;
-        bv[bi].sum = lowersum;
-        bv[bi].color = averagepixels(bv[bi].colors, &achv[bv[bi].ind], min_opaque_val, previous_center);
-        bv[bi].total_error = -1;
-        bv[bi].variance = box_variance(achv, &bv[bi]);
-        bv[bi].max_error = box_max_error(achv, &bv[bi]);
         bv[boxes].ind = indx + break_at;
         bv[boxes].colors = clrs - break_at;
-        bv[boxes].sum = sm - lowersum;
-        bv[boxes].color = averagepixels(bv[boxes].colors, &achv[bv[boxes].ind], min_opaque_val, previous_center);
-        bv[boxes].total_error = -1;
-        bv[boxes].variance = box_variance(achv, &bv[boxes]);
-        bv[boxes].max_error = box_max_error(achv, &bv[boxes]);
+        set_box_stats(&bv[bi], &bv[boxes], achv, min_opaque_val, previous_center, pool, threads);
+        bv[boxes].sum = sm - bv[bi].sum;
 
         ++boxes;
 
@@ -405,8 +569,7 @@ LIQ_PRIVATE colormap *mediancut(histogram *hist, const float min_opaque_val, uns
     colormap *map = pam_colormap(boxes, malloc, free);
     set_colormap_from_boxes(map, bv, boxes, achv);
 
-    map->subset_palette = representative_subset;
-    adjust_histogram(achv, map, bv, boxes);
+    adjust_histogram(achv, map, bv, boxes, pool, hist->size > BOX_CHUNK_SIZE ? threads : 1);
 
     return map;
 }
@@ -432,76 +595,40 @@ static void set_colormap_from_boxes(colormap *map, struct box* bv, unsigned int
     }
 }
 
-/* increase histogram popularity by difference from the final color (this is used as part of feedback loop) */
-static void adjust_histogram(hist_item *achv, const colormap *map, const struct box* bv, unsigned int boxes)
+struct adjust_histogram_job {
+    hist_item *achv;
+    const colormap *map;
+    const struct box *bv;
+};
+
+static void adjust_histogram_boxes(void *context, unsigned int start, unsigned int end, unsigned int thread)
 {
-    for(unsigned int bi = 0; bi < boxes; ++bi) {
-        for(unsigned int i=bv[bi].ind; i < bv[bi].ind+bv[bi].colors; i++) {
-            achv[i].adjusted_weight *= sqrt(1.0 +colordifference(map->palette[bi].acolor, achv[i].acolor)/4.0);
+    const struct adjust_histogram_job *job = context;
+    hist_item *achv = job->achv;
+
+    for(unsigned int bi = start; bi < end; ++bi) {
+        for(unsigned int i=job->bv[bi].ind; i < job->bv[bi].ind+job->bv[bi].colors; i++) {
+            achv[i].adjusted_weight *= sqrt(1.0 +colordifference(job->map->palette[bi].acolor, achv[i].acolor)/4.0);
             achv[i].tmp.likely_colormap_index = bi;
         }
     }
 }
 
-static f_pixel averagepixels(unsigned int clrs, const hist_item achv[], const float min_opaque_val, const f_pixel center)
+/* increase histogram popularity by difference from the final color (this is used as part of feedback loop) */
+static void adjust_histogram(hist_item *achv, const colormap *map, const struct box* bv, unsigned int boxes, liq_thread_pool *pool, unsigned int threads)
 {
-    double r = 0, g = 0, b = 0, a = 0, new_a=0, sum = 0;
-    float maxa = 0;
-
-    // first find final opacity in order to blend colors at that opacity
-    for(unsigned int i = 0; i < clrs; ++i) {
-        const f_pixel px = achv[i].acolor;
-        new_a += px.a * achv[i].adjusted_weight;
-        sum += achv[i].adjusted_weight;
-
-        /* find if there are opaque colors, in case we're supposed to preserve opacity exactly (ie_bug) */
-        if (px.a > maxa) maxa = px.a;
-    }
-
-    if (sum) new_a /= sum;
-
-    /** if there was at least one completely opaque color, "round" final color to opaque */
-    if (new_a >= min_opaque_val && maxa >= (255.0/256.0)) new_a = 1;
-
-    sum=0;
-    // reverse iteration for cache locality with previous loop
-    for(int i = clrs-1; i >= 0; i--) {
-        double tmp, weight = 1.0f;
-        f_pixel px = achv[i].acolor;
-
-        /* give more weight to colors that are further away from average
-         this is intended to prevent desaturation of images and fading of whites
-         */
-        tmp = (center.r - px.r);
-        weight += tmp*tmp;
-        tmp = (center.g - px.g);
-        weight += tmp*tmp;
-        tmp = (center.b - px.b);
-        weight += tmp*tmp;
-
-        weight *= achv[i].adjusted_weight;
-        sum += weight;
-
-        if (px.a) {
-            px.r /= px.a;
-            px.g /= px.a;
-            px.b /= px.a;
-        }
-
-        r += px.r * new_a * weight;
-        g += px.g * new_a * weight;
-        b += px.b * new_a * weight;
-        a += new_a * weight;
-    }
-
-    if (sum) {
-    a /= sum;
-    r /= sum;
-    g /= sum;
-    b /= sum;
-    }
-
-    assert(!isnan(r) && !isnan(g) && !isnan(b) && !isnan(a));
+    struct adjust_histogram_job job = {
+        .achv = achv,
+        .map = map,
+        .bv = bv,
+    };
+    liq_parallel_for(pool, MIN(threads, boxes), boxes, adjust_histogram_boxes, &job);
+}
 
-    return (f_pixel){.r=r, .g=g, .b=b, .a=a};
+static f_pixel averagepixels(unsigned int clrs, const hist_item achv[], const float min_opaque_val, const f_pixel center)
+{
+    box_sums s = {0};
+    opacity_sums(achv, 0, clrs, &s);
+    color_sums(achv, 0, clrs, final_opacity(&s, min_opaque_val), center, &s);
+    return color_from_sums(&s);
 }
@@ -10,10 +10,20 @@
 
 struct mempool {
     unsigned int used, size;
+    unsigned int peak; // most bytes allocated from all blocks at once, as of the last rewind or reset
     void* (*malloc)(size_t);
     void (*free)(void*);
     struct mempool *next;
 };
+
+static unsigned int mempool_first_used(const mempool m)
+{
+    uintptr_t mptr_used_start = (uintptr_t)m + sizeof(struct mempool);
+    unsigned int used = sizeof(struct mempool) + ((ALIGN_MASK + 1 - (mptr_used_start & ALIGN_MASK)) & ALIGN_MASK); // reserve bytes required to make subsequent allocations aligned
+    assert(!(((uintptr_t)m + used) & ALIGN_MASK));
+    return used;
+}
+
 LIQ_PRIVATE void* mempool_create(mempool *mptr, const unsigned int size, unsigned int max_size, void* (*malloc)(size_t), void (*free)(void*))
 {
     if (*mptr && ((*mptr)->used+size) <= (*mptr)->size) {
@@ -32,12 +42,10 @@ LIQ_PRIVATE void* mempool_create(mempool *mptr, const unsigned int size, unsigne
         .malloc = malloc,
         .free = free,
         .size = MEMPOOL_RESERVED + max_size,
-        .used = sizeof(struct mempool),
+        .used = mempool_first_used(*mptr),
+        .peak = old ? old->peak : 0,
         .next = old,
     };
-    uintptr_t mptr_used_start = (uintptr_t)(*mptr) + (*mptr)->used;
-    (*mptr)->used += (ALIGN_MASK + 1 - (mptr_used_start & ALIGN_MASK)) & ALIGN_MASK; // reserve bytes required to make subsequent allocations aligned
-    assert(!(((uintptr_t)(*mptr) + (*mptr)->used) & ALIGN_MASK));
 
     return mempool_alloc(mptr, size, size);
 }
@@ -61,3 +69,69 @@ LIQ_PRIVATE void mempool_destroy(mempool m)
         m = next;
     }
 }
+
+/*
+ Remembers current end of the pool, so that everything allocated after it can be released with mempool_rewind()
+ */
+LIQ_PRIVATE mempool_mark mempool_get_mark(mempool m)
+{
+    return (mempool_mark){
+        .pool = m,
+        .used = m ? m->used : 0,
+    };
+}
+
+static void mempool_update_peak(mempool m)
+{
+    unsigned int total = 0;
+    for(mempool b = m; b; b = b->next) {
+        total += b->used - mempool_first_used(b);
+    }
+    if (total > m->peak) m->peak = total;
+}
+
+/*
+ Releases allocations made after the mark was taken. Blocks added to the pool since then are freed.
+ */
+LIQ_PRIVATE void mempool_rewind(mempool *mptr, mempool_mark mark)
+{
+    if (!*mptr || !mark.pool) return;
+
+    mempool_update_peak(*mptr);
+    const unsigned int peak = (*mptr)->peak;
+    while (*mptr != mark.pool) {
+        mempool next = (*mptr)->next;
+        assert(next); // the mark must be from this pool
+        (*mptr)->free(*mptr);
+        *mptr = next;
+    }
+    assert(mark.used <= (*mptr)->used);
+    (*mptr)->used = mark.used;
+    (*mptr)->peak = peak;
+}
+
+/*
+ Releases all allocations, but keeps memory for reuse. If the pool had to grow
+ since the last reset, its blocks are replaced with a single one as large as the most memory used at once.
+ *mptr is set to NULL if that allocation fails.
+ */
+LIQ_PRIVATE void mempool_reset(mempool *mptr)
+{
+    mempool m = *mptr;
+    if (!m) return;
+
+    mempool_update_peak(m);
+    if (!m->next) {
+        m->used = mempool_first_used(m);
+        return;
+    }
+
+    const unsigned int peak = m->peak;
+    void* (*malloc)(size_t) = m->malloc;
+    void (*free)(void*) = m->free;
+    mempool_destroy(m);
+    *mptr = NULL;
+    if (mempool_create(mptr, 0, peak, malloc, free)) {
+        (*mptr)->peak = peak;
+    }
+}
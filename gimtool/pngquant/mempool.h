@@ -10,4 +10,13 @@ LIQ_PRIVATE void* mempool_create(mempool *mptr, unsigned int size, unsigned int
 LIQ_PRIVATE void* mempool_alloc(mempool *mptr, unsigned int size, unsigned int capacity);
 LIQ_PRIVATE void mempool_destroy(mempool m);
 
+typedef struct {
+    mempool pool;
+    unsigned int used;
+} mempool_mark;
+
+LIQ_PRIVATE mempool_mark mempool_get_mark(mempool m);
+LIQ_PRIVATE void mempool_rewind(mempool *mptr, mempool_mark mark);
+LIQ_PRIVATE void mempool_reset(mempool *mptr);
+
 #endif
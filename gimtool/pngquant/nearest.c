@@ -1,190 +1,250 @@
-
 #include "libimagequant.h"
 #include "pam.h"
 #include "nearest.h"
 #include "mempool.h"
 #include <stdlib.h>
 
-struct sorttmp {
-    float radius;
+// nodes with this many colors or less are not split further, and their colors are checked one by one
+#define VP_LEAF_SIZE 6
+
+/*
+ Vantage-point tree. sqrtf(colordifference()) is a metric, so colors in the near subtree
+ (not farther from the vantage point than near_radius) and in the far subtree (not closer than far_radius)
+ can be skipped when the needle is too far from them to find anything better than the current best match.
+ */
+struct vp_node {
+    struct vp_node *near, *far;
+    f_pixel vantage_point;
+    float near_radius, far_radius; // as sqrtf(colordifference())
+    unsigned int index;        // palette index of the vantage point
+    unsigned int num_leaves;   // if non-zero, this is a leaf node without vantage point
+    f_pixel *leaf_colors;
+    unsigned char *leaf_index;
+};
+
+struct vp_sort_tmp {
+    float distance_squared;
     unsigned int index;
 };
 
-struct head {
-    // colors less than radius away from vantage_point color will have best match in candidates
-    f_pixel vantage_point;
-    float radius;
-    unsigned int num_candidates;
-    f_pixel *candidates_color;
-    unsigned short *candidates_index;
+struct vp_search_tmp {
+    float distance, distance_squared;   // the best match so far
+    float second_distance, second_distance_squared; // the second best match, if searched for
+    unsigned int index, skip_index;
+    bool iebug, find_second;
 };
 
 struct nearest_map {
     const colormap *map;
+    struct vp_node *root;
     float nearest_other_color_dist[256];
-    mempool mempool;
-    struct head heads[];
+    mempool mempool, *arena;
+    mempool_mark arena_mark; // nearest_free() releases everything allocated from the arena after it
 };
 
-static unsigned int find_slow(const f_pixel px, const colormap *map)
+static inline void vp_sort_tmp_swap(struct vp_sort_tmp *l, struct vp_sort_tmp *r)
 {
-    unsigned int best=0;
-    float bestdiff = colordifference(px, map->palette[0].acolor);
-
-    for(unsigned int i=1; i < map->colors; i++) {
-        float diff = colordifference(px, map->palette[i].acolor);
-        if (diff < bestdiff) {
-            best = i;
-            bestdiff = diff;
-        }
-    }
-    return best;
+    const struct vp_sort_tmp t = *l;
+    *l = *r;
+    *r = t;
 }
 
-static float distance_from_nearest_other_color(const colormap *map, const unsigned int i)
+static unsigned int vp_partition(struct vp_sort_tmp *const base, const unsigned int len)
 {
-    float second_best=MAX_DIFF;
-    for(unsigned int j=0; j < map->colors; j++) {
-        if (i == j) continue;
-        float diff = colordifference(map->palette[i].acolor, map->palette[j].acolor);
-        if (diff <= second_best) {
-            second_best = diff;
+    vp_sort_tmp_swap(&base[0], &base[len/2]);
+
+    const float pivot_value = base[0].distance_squared;
+    unsigned int l = 1, r = len;
+    while (l < r) {
+        if (base[l].distance_squared <= pivot_value) {
+            l++;
+        } else {
+            while(l < --r && base[r].distance_squared > pivot_value) {}
+            vp_sort_tmp_swap(&base[l], &base[r]);
         }
     }
-    return second_best;
+    l--;
+    vp_sort_tmp_swap(&base[0], &base[l]);
+
+    return l;
 }
 
-static int compareradius(const void *ap, const void *bp)
+/** quick select algorithm, colors before nth are not farther than it and colors after it are not closer */
+static void vp_select(struct vp_sort_tmp *base, unsigned int len, unsigned int nth)
 {
-    float a = ((const struct sorttmp*)ap)->radius;
-    float b = ((const struct sorttmp*)bp)->radius;
-    return a > b ? 1 : (a < b ? -1 : 0);
+    for(;;) {
+        const unsigned int l = vp_partition(base, len), r = l+1;
+
+        if (nth < l) {
+            len = l;
+        }
+        else if (nth > l) {
+            base += r; len -= r; nth -= r;
+        }
+        else break;
+    }
 }
 
-static struct head build_head(f_pixel px, const colormap *map, unsigned int num_candidates, mempool *m, float error_margin, bool skip_index[], unsigned int *skipped)
+static struct vp_node *vp_create_node(mempool *m, struct vp_sort_tmp colors[], const unsigned int num_colors, const colormap *map)
 {
-    struct sorttmp colors[map->colors];
-    unsigned int colorsused=0;
+    if (!num_colors) {
+        return NULL;
+    }
 
-    for(unsigned int i=0; i < map->colors; i++) {
-        if (skip_index[i]) continue; // colors in skip_index have been eliminated already in previous heads
-        colors[colorsused].index = i;
-        colors[colorsused].radius = colordifference(px, map->palette[i].acolor);
-        colorsused++;
+    struct vp_node *node = mempool_alloc(m, sizeof(*node), 0);
+    if (num_colors <= VP_LEAF_SIZE) {
+        *node = (struct vp_node){
+            .num_leaves = num_colors,
+            .leaf_colors = mempool_alloc(m, num_colors * sizeof(node->leaf_colors[0]), 0),
+            .leaf_index = mempool_alloc(m, num_colors * sizeof(node->leaf_index[0]), 0),
+        };
+        for(unsigned int i=0; i < num_colors; i++) {
+            node->leaf_colors[i] = map->palette[colors[i].index].acolor;
+            node->leaf_index[i] = colors[i].index;
+        }
+        return node;
     }
 
-    qsort(&colors, colorsused, sizeof(colors[0]), compareradius);
-    assert(colorsused < 2 || colors[0].radius <= colors[1].radius); // closest first
+    // the most popular color is the most likely match, so it's checked first
+    unsigned int best = 0;
+    for(unsigned int i=1; i < num_colors; i++) {
+        if (map->palette[colors[i].index].popularity > map->palette[colors[best].index].popularity) {
+            best = i;
+        }
+    }
+    const unsigned int vantage_index = colors[best].index;
+    colors[best] = colors[0];
+
+    const f_pixel vantage_point = map->palette[vantage_index].acolor;
+    struct vp_sort_tmp *const rest = &colors[1];
+    const unsigned int num_rest = num_colors-1;
+    for(unsigned int i=0; i < num_rest; i++) {
+        rest[i].distance_squared = colordifference(vantage_point, map->palette[rest[i].index].acolor);
+    }
+    // subtrees only need to be split at the median, not sorted
+    const unsigned int half = num_rest/2;
+    vp_select(rest, num_rest, half);
 
-    num_candidates = MIN(colorsused, num_candidates);
+    float near_radius_squared = 0;
+    for(unsigned int i=0; i < half; i++) {
+        near_radius_squared = MAX(near_radius_squared, rest[i].distance_squared);
+    }
 
-    struct head h = {
-        .candidates_color = mempool_alloc(m, num_candidates * sizeof(h.candidates_color[0]), 0),
-        .candidates_index = mempool_alloc(m, num_candidates * sizeof(h.candidates_index[0]), 0),
-        .vantage_point = px,
-        .num_candidates = num_candidates,
+    *node = (struct vp_node){
+        .vantage_point = vantage_point,
+        .index = vantage_index,
+        .near_radius = sqrtf(near_radius_squared),
+        .far_radius = sqrtf(rest[half].distance_squared),
     };
-    for(unsigned int i=0; i < num_candidates; i++) {
-        h.candidates_color[i] = map->palette[colors[i].index].acolor;
-        h.candidates_index[i] = colors[i].index;
+    node->near = vp_create_node(m, rest, half, map);
+    node->far = vp_create_node(m, &rest[half], num_rest - half, map);
+    return node;
+}
+
+ALWAYS_INLINE static void vp_search_check(float distance_squared, const f_pixel color, const unsigned int index, struct vp_search_tmp *best);
+inline static void vp_search_check(float distance_squared, const f_pixel color, const unsigned int index, struct vp_search_tmp *best)
+{
+    if (index == best->skip_index) return;
+
+    /* penalty for making holes in IE */
+    if (best->iebug && color.a < 1) {
+        distance_squared += 1.f/1024.f;
     }
-    // if all colors within this radius are included in candidates, then there cannot be any other better match
-    // farther away from the vantage point than half of the radius. Due to alpha channel must assume pessimistic radius.
-    h.radius = min_colordifference(px, h.candidates_color[num_candidates-1])/4.0f; // /4 = half of radius, but radius is squared
-
-    for(unsigned int i=0; i < num_candidates; i++) {
-        // divide again as that's matching certain subset within radius-limited subset
-        // - 1/256 is a tolerance for miscalculation (seems like colordifference isn't exact)
-        if (colors[i].radius < h.radius/4.f - error_margin) {
-            skip_index[colors[i].index]=true;
-            (*skipped)++;
+
+    if (distance_squared < best->distance_squared) {
+        if (best->find_second) {
+            best->second_distance_squared = best->distance_squared;
+            best->second_distance = best->distance;
         }
+        best->distance_squared = distance_squared;
+        best->distance = sqrtf(distance_squared);
+        best->index = index;
+    } else if (best->find_second && distance_squared < best->second_distance_squared) {
+        best->second_distance_squared = distance_squared;
+        best->second_distance = sqrtf(distance_squared);
     }
-    return h;
 }
 
-static colormap *get_subset_palette(const colormap *map)
+static void vp_search_node(const struct vp_node *node, const f_pixel px, struct vp_search_tmp *best)
 {
-    if (map->subset_palette) {
-        return map->subset_palette;
-    }
+    do {
+        if (node->num_leaves) {
+            for(unsigned int i=0; i < node->num_leaves; i++) {
+                vp_search_check(colordifference(node->leaf_colors[i], px), node->leaf_colors[i], node->leaf_index[i], best);
+            }
+            return;
+        }
 
-    unsigned int subset_size = (map->colors+3)/4;
-    colormap *subset_palette = pam_colormap(subset_size, map->malloc, map->free);
+        const float distance_squared = colordifference(node->vantage_point, px);
+        vp_search_check(distance_squared, node->vantage_point, node->index, best);
 
-    for(unsigned int i=0; i < subset_size; i++) {
-        subset_palette->palette[i] = map->palette[i];
-    }
+        // IE penalty only makes distances larger, so it doesn't invalidate the bounds
+        const float distance = sqrtf(distance_squared);
 
-    return subset_palette;
+        if (distance - node->near_radius < node->far_radius - distance) {
+            if (node->near) {
+                vp_search_node(node->near, px, best);
+            }
+            // colors in the far subtree are at least (far_radius - distance) away
+            const float limit = best->find_second ? best->second_distance : best->distance;
+            if (node->far && node->far_radius - distance <= limit) {
+                node = node->far;
+            } else {
+                return;
+            }
+        } else {
+            if (node->far) {
+                vp_search_node(node->far, px, best);
+            }
+            // colors in the near subtree are at least (distance - near_radius) away
+            const float limit = best->find_second ? best->second_distance : best->distance;
+            if (node->near && distance - node->near_radius <= limit) {
+                node = node->near;
+            } else {
+                return;
+            }
+        }
+    } while(1);
 }
 
-LIQ_PRIVATE struct nearest_map *nearest_init(const colormap *map, bool fast)
+static float distance_from_nearest_other_color(const struct nearest_map *centroids, const unsigned int i)
 {
-    colormap *subset_palette = get_subset_palette(map);
-    const unsigned int num_vantage_points = map->colors > 16 ? MIN(map->colors/4, subset_palette->colors) : 0;
-    const unsigned long heads_size = sizeof(struct head) * (num_vantage_points+1); // +1 is fallback head
+    struct vp_search_tmp best = {
+        .distance_squared = MAX_DIFF,
+        .distance = MAX_DIFF,
+        .index = i,
+        .skip_index = i,
+    };
+    vp_search_node(centroids->root, centroids->map->palette[i].acolor, &best);
+    return best.distance_squared;
+}
 
-    const unsigned long mempool_size = (sizeof(f_pixel) + sizeof(unsigned int)) * subset_palette->colors * map->colors/5 + (1<<14);
+/*
+ If arena is given, the map is allocated from it. Other allocations from the arena
+ must not outlive the map, as nearest_free() rewinds it.
+ */
+LIQ_PRIVATE struct nearest_map *nearest_init(const colormap *map, mempool *arena)
+{
+    const unsigned long mempool_size = (sizeof(struct vp_node) + sizeof(f_pixel) + 1) * map->colors + (1<<10);
     mempool m = NULL;
-    struct nearest_map *centroids = mempool_create(&m, sizeof(*centroids) + heads_size /* heads array is appended to it */, mempool_size, map->malloc, map->free);
-    centroids->mempool = m;
-
-    for(unsigned int i=0; i < map->colors; i++) {
-        const float dist = distance_from_nearest_other_color(map,i);
-        centroids->nearest_other_color_dist[i] = dist / 4.f; // half of squared distance
-    }
-
+    const mempool_mark arena_mark = mempool_get_mark(arena ? *arena : NULL);
+    struct nearest_map *centroids = arena ? mempool_alloc(arena, sizeof(*centroids), mempool_size)
+                                          : mempool_create(&m, sizeof(*centroids), mempool_size, map->malloc, map->free);
+    centroids->arena = arena;
+    centroids->arena_mark = arena_mark;
     centroids->map = map;
 
-    unsigned int skipped=0;
     assert(map->colors > 0);
-    bool skip_index[map->colors]; for(unsigned int j=0; j < map->colors; j++) skip_index[j]=false;
-
-    // floats and colordifference calculations are not perfect
-    const float error_margin = fast ? 0 : 8.f/256.f/256.f;
-    unsigned int h=0;
-    for(; h < num_vantage_points; h++) {
-        unsigned int num_candiadtes = 1+(map->colors - skipped)/((1+num_vantage_points-h)/2);
-
-        centroids->heads[h] = build_head(subset_palette->palette[h].acolor, map, num_candiadtes, &centroids->mempool, error_margin, skip_index, &skipped);
-        if (centroids->heads[h].num_candidates == 0) {
-            break;
-        }
-    }
-
-    // assumption that there is no better color within radius of vantage point color
-    // holds true only for colors within convex hull formed by palette colors.
-    // since finding proper convex hull is more than a few lines, this
-    // is a cheap shot at finding just few key points.
-    const f_pixel extrema[] = {
-        {.a=0,0,0,0},
-
-        {.a=.5,0,0,0}, {.a=.5,1,0,0},
-        {.a=.5,0,0,1}, {.a=.5,1,0,1},
-        {.a=.5,0,1,0}, {.a=.5,1,1,0},
-        {.a=.5,0,1,1}, {.a=.5,1,1,1},
-
-        {.a=1,0,0,0}, {.a=1,1,0,0},
-        {.a=1,0,0,1}, {.a=1,1,0,1},
-        {.a=1,0,1,0}, {.a=1,1,1,0},
-        {.a=1,0,1,1}, {.a=1,1,1,1},
-
-        {.a=1,.5, 0, 0}, {.a=1, 0,.5, 0}, {.a=1, 0, 0, .5},
-        {.a=1,.5, 0, 1}, {.a=1, 0,.5, 1}, {.a=1, 0, 1, .5},
-        {.a=1,.5, 1, 0}, {.a=1, 1,.5, 0}, {.a=1, 1, 0, .5},
-        {.a=1,.5, 1, 1}, {.a=1, 1,.5, 1}, {.a=1, 1, 1, .5},
-    };
-    for(unsigned int i=0; i < sizeof(extrema)/sizeof(extrema[0]); i++) {
-        skip_index[find_slow(extrema[i], map)]=0;
+    struct vp_sort_tmp colors[map->colors];
+    for(unsigned int i=0; i < map->colors; i++) {
+        colors[i].index = i;
     }
+    centroids->root = vp_create_node(arena ? arena : &m, colors, map->colors, map);
+    centroids->mempool = m;
 
-    centroids->heads[h] = build_head((f_pixel){0,0,0,0}, map, map->colors, &centroids->mempool, error_margin, skip_index, &skipped);
-    centroids->heads[h].radius = MAX_DIFF;
-
-    // get_subset_palette could have created a copy
-    if (subset_palette != map->subset_palette) {
-        pam_freecolormap(subset_palette);
+    for(unsigned int i=0; i < map->colors; i++) {
+        const float dist = distance_from_nearest_other_color(centroids, i);
+        centroids->nearest_other_color_dist[i] = dist / 4.f; // half of squared distance
     }
 
     return centroids;
@@ -194,8 +254,6 @@ LIQ_PRIVATE unsigned int nearest_search(const struct nearest_map *centroids, con
 {
     const bool iebug = px.a > min_opaque_val;
 
-    const struct head *const heads = centroids->heads;
-
     assert(likely_colormap_index < centroids->map->colors);
     const float guess_diff = colordifference(centroids->map->palette[likely_colormap_index].acolor, px);
     if (guess_diff < centroids->nearest_other_color_dist[likely_colormap_index]) {
@@ -203,39 +261,73 @@ LIQ_PRIVATE unsigned int nearest_search(const struct nearest_map *centroids, con
         return likely_colormap_index;
     }
 
-    for(unsigned int i=0; /* last head will always be selected */ ; i++) {
-        float vantage_point_dist = colordifference(px, heads[i].vantage_point);
+    // the guess is the best match until the tree finds a better one
+    const float guess_distance_squared = guess_diff + (iebug && centroids->map->palette[likely_colormap_index].acolor.a < 1 ? 1.f/1024.f : 0);
+    struct vp_search_tmp best = {
+        .distance_squared = guess_distance_squared,
+        .distance = sqrtf(guess_distance_squared),
+        .index = likely_colormap_index,
+        .skip_index = likely_colormap_index,
+        .iebug = iebug,
+    };
+    vp_search_node(centroids->root, px, &best);
 
-        if (vantage_point_dist <= heads[i].radius) {
-            assert(heads[i].num_candidates);
-            unsigned int ind=0;
-            float dist = colordifference(px, heads[i].candidates_color[0]);
+    if (diff) *diff = best.distance_squared;
+    return best.index;
+}
 
-            /* penalty for making holes in IE */
-            if (iebug && heads[i].candidates_color[0].a < 1) {
-                dist += 1.f/1024.f;
-            }
+/*
+ Exact search for colors that don't get the IE penalty. sqrtf(colordifference()) is a metric, so bounds of distances
+ can be loosened by how much palette colors have moved since they were computed (as in Hamerly's k-means).
 
-            for(unsigned int j=1; j < heads[i].num_candidates; j++) {
-                float newdist = colordifference(px, heads[i].candidates_color[j]);
+ lower_bound is at most the distance from px to any palette color other than likely_colormap_index.
+ On input it's the bound from the previous search (negative if unknown), which is then reduced by other_colors_moved.
+ On output it's the bound for the returned color.
+ */
+LIQ_PRIVATE unsigned int nearest_search_bounded(const struct nearest_map *centroids, const f_pixel px, const unsigned int likely_colormap_index, const float other_colors_moved, float *lower_bound, float *diff)
+{
+    const colormap *const map = centroids->map;
 
-                /* penalty for making holes in IE */
-                if (iebug && heads[i].candidates_color[j].a < 1) {
-                    newdist += 1.f/1024.f;
-                }
+    assert(likely_colormap_index < map->colors);
+    const float guess_diff = colordifference(map->palette[likely_colormap_index].acolor, px);
+    const float guess_dist = sqrtf(guess_diff);
 
-                if (newdist < dist) {
-                    dist = newdist;
-                    ind = j;
-                }
-            }
-            if (diff) *diff = dist;
-            return heads[i].candidates_index[ind];
-        }
+    // palette hasn't moved enough to make any other color closer
+    const float lower = *lower_bound - other_colors_moved;
+    if (guess_dist < lower) {
+        *lower_bound = lower;
+        *diff = guess_diff;
+        return likely_colormap_index;
+    }
+
+    // px is closer to the color than half of distance to any other color
+    if (guess_diff < centroids->nearest_other_color_dist[likely_colormap_index]) {
+        *lower_bound = MAX(lower, 2.f*sqrtf(centroids->nearest_other_color_dist[likely_colormap_index]) - guess_dist);
+        *diff = guess_diff;
+        return likely_colormap_index;
     }
+
+    struct vp_search_tmp best = {
+        .distance_squared = guess_diff,
+        .distance = guess_dist,
+        .second_distance_squared = MAX_DIFF,
+        .second_distance = MAX_DIFF,
+        .index = likely_colormap_index,
+        .skip_index = likely_colormap_index,
+        .find_second = true,
+    };
+    vp_search_node(centroids->root, px, &best);
+
+    *lower_bound = best.second_distance;
+    *diff = best.distance_squared;
+    return best.index;
 }
 
 LIQ_PRIVATE void nearest_free(struct nearest_map *centroids)
 {
+    if (centroids->arena) {
+        mempool_rewind(centroids->arena, centroids->arena_mark);
+        return;
+    }
     mempool_destroy(centroids->mempool);
 }
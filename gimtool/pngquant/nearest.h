@@ -3,6 +3,7 @@
 //  pngquant
 //
 struct nearest_map;
-LIQ_PRIVATE struct nearest_map *nearest_init(const colormap *palette, const bool fast);
+LIQ_PRIVATE struct nearest_map *nearest_init(const colormap *palette, struct mempool **arena);
 LIQ_PRIVATE unsigned int nearest_search(const struct nearest_map *map, const f_pixel px, const int palette_index_guess, const float min_opaque, float *diff);
+LIQ_PRIVATE unsigned int nearest_search_bounded(const struct nearest_map *map, const f_pixel px, const unsigned int likely_colormap_index, const float other_colors_moved, float *lower_bound, float *diff);
 LIQ_PRIVATE void nearest_free(struct nearest_map *map);
@@ -106,7 +106,7 @@ LIQ_PRIVATE bool pam_computeacolorhash(struct acolorhash_table *acht, const rgba
                         if (freestackp <= 0) {
                             // estimate how many colors are going to be + headroom
                             const int mempool_size = ((acht->rows + rows-row) * 2 * colors / (acht->rows + row + 1) + 1024) * sizeof(struct acolorhist_arr_item);
-                            new_items = mempool_alloc(&acht->mempool, sizeof(struct acolorhist_arr_item)*capacity, mempool_size);
+                            new_items = mempool_alloc(acht->pool, sizeof(struct acolorhist_arr_item)*capacity, mempool_size);
                         } else {
                             // freestack stores previously freed (reallocated) arrays that can be reused
                             // (all pesimistically assumed to be capacity = 8)
@@ -119,7 +119,7 @@ LIQ_PRIVATE bool pam_computeacolorhash(struct acolorhash_table *acht, const rgba
                             freestack[freestackp++] = other_items;
                         }
                         const int mempool_size = ((acht->rows + rows-row) * 2 * colors / (acht->rows + row + 1) + 32*capacity) * sizeof(struct acolorhist_arr_item);
-                        new_items = mempool_alloc(&acht->mempool, sizeof(struct acolorhist_arr_item)*capacity, mempool_size);
+                        new_items = mempool_alloc(acht->pool, sizeof(struct acolorhist_arr_item)*capacity, mempool_size);
                         if (!new_items) return false;
                         memcpy(new_items, other_items, sizeof(other_items[0])*achl->capacity);
                     }
@@ -156,7 +156,10 @@ LIQ_PRIVATE bool pam_computeacolorhash(struct acolorhash_table *acht, const rgba
     return true;
 }
 
-LIQ_PRIVATE struct acolorhash_table *pam_allocacolorhash(unsigned int maxcolors, unsigned int surface, unsigned int ignorebits, void* (*malloc)(size_t), void (*free)(void*))
+/*
+ If arena is given, the table is allocated from it and pam_freeacolorhash() doesn't release any memory
+ */
+LIQ_PRIVATE struct acolorhash_table *pam_allocacolorhash(unsigned int maxcolors, unsigned int surface, unsigned int ignorebits, mempool *arena, void* (*malloc)(size_t), void (*free)(void*))
 {
     const unsigned int estimated_colors = MIN(maxcolors, surface/(ignorebits + (surface > 512*512 ? 5 : 4)));
     const unsigned int hash_size = estimated_colors < 66000 ? 6673 : (estimated_colors < 200000 ? 12011 : 24019);
@@ -164,14 +167,17 @@ LIQ_PRIVATE struct acolorhash_table *pam_allocacolorhash(unsigned int maxcolors,
     mempool m = NULL;
     const unsigned int buckets_size = hash_size * sizeof(struct acolorhist_arr_head);
     const unsigned int mempool_size = sizeof(struct acolorhash_table) + buckets_size + estimated_colors * sizeof(struct acolorhist_arr_item);
-    struct acolorhash_table *t = mempool_create(&m, sizeof(*t) + buckets_size, mempool_size, malloc, free);
+    struct acolorhash_table *t = arena ? mempool_alloc(arena, sizeof(*t) + buckets_size, mempool_size)
+                                       : mempool_create(&m, sizeof(*t) + buckets_size, mempool_size, malloc, free);
     if (!t) return NULL;
     *t = (struct acolorhash_table){
         .mempool = m,
+        .pool = arena,
         .hash_size = hash_size,
         .maxcolors = maxcolors,
         .ignorebits = ignorebits,
     };
+    if (!arena) t->pool = &t->mempool;
     memset(t->buckets, 0, hash_size * sizeof(struct acolorhist_arr_head));
     return t;
 }
@@ -182,14 +188,19 @@ LIQ_PRIVATE struct acolorhash_table *pam_allocacolorhash(unsigned int maxcolors,
     ++j; \
 }
 
-LIQ_PRIVATE histogram *pam_acolorhashtoacolorhist(const struct acolorhash_table *acht, const double gamma, void* (*malloc)(size_t), void (*free)(void*))
+/*
+ If arena is given, the histogram is allocated from it and pam_freeacolorhist() doesn't release any memory
+ */
+LIQ_PRIVATE histogram *pam_acolorhashtoacolorhist(const struct acolorhash_table *acht, const double gamma, mempool *arena, void* (*malloc)(size_t), void (*free)(void*))
 {
-    histogram *hist = malloc(sizeof(hist[0]));
-    if (!hist || !acht) return NULL;
+    if (!acht) return NULL;
+    histogram *hist = arena ? mempool_alloc(arena, sizeof(hist[0]), 0) : malloc(sizeof(hist[0]));
+    if (!hist) return NULL;
+    const unsigned int achv_size = acht->colors * sizeof(hist->achv[0]);
     *hist = (histogram){
-        .achv = malloc(acht->colors * sizeof(hist->achv[0])),
+        .achv = arena ? mempool_alloc(arena, achv_size, achv_size) : malloc(achv_size),
         .size = acht->colors,
-        .free = free,
+        .free = arena ? NULL : free,
         .ignorebits = acht->ignorebits,
     };
     if (!hist->achv) return NULL;
@@ -229,6 +240,8 @@ LIQ_PRIVATE void pam_freeacolorhash(struct acolorhash_table *acht)
 
 LIQ_PRIVATE void pam_freeacolorhist(histogram *hist)
 {
+    if (!hist->free) return; // memory belongs to the arena
+
     hist->free(hist->achv);
     hist->free(hist);
 }
@@ -244,7 +257,6 @@ LIQ_PRIVATE colormap *pam_colormap(unsigned int colors, void* (*malloc)(size_t),
     *map = (colormap){
         .malloc = malloc,
         .free = free,
-        .subset_palette = NULL,
         .colors = colors,
     };
     memset(map->palette, 0, colors_size);
@@ -257,15 +269,11 @@ LIQ_PRIVATE colormap *pam_duplicate_colormap(colormap *map)
     for(unsigned int i=0; i < map->colors; i++) {
         dupe->palette[i] = map->palette[i];
     }
-    if (map->subset_palette) {
-        dupe->subset_palette = pam_duplicate_colormap(map->subset_palette);
-    }
     return dupe;
 }
 
 LIQ_PRIVATE void pam_freecolormap(colormap *c)
 {
-    if (c->subset_palette) pam_freecolormap(c->subset_palette);
     c->free(c);
 }
 
@@ -276,3 +284,20 @@ LIQ_PRIVATE void to_f_set_gamma(float gamma_lut[], const double gamma)
     }
 }
 
+/**
+ rgb_lut[i] is the lowest (unpremultiplied) channel value that to_rgb() converts to i or more.
+ It's found by stepping over neighboring floats from an estimate, so it matches powf() exactly.
+ */
+LIQ_PRIVATE void to_rgb_set_gamma(float rgb_lut[], const double gamma)
+{
+    const float gamma_f = gamma; // to_rgb() takes gamma as float
+    const float power = gamma_f/internal_gamma;
+
+    rgb_lut[0] = 0;
+    for(int i=1; i < 256; i++) {
+        float x = powf(i/256.f, 1.f/power);
+        while (x > 0 && powf(x, power)*256.f >= i) x = nextafterf(x, 0);
+        while (powf(x, power)*256.f < i) x = nextafterf(x, 2.f);
+        rgb_lut[i] = x;
+    }
+}
@@ -28,6 +28,20 @@
 
 #define MAX_DIFF 1e20
 
+/*
+ USE_FLOAT_MATH=1 computes color differences and sums of histogram colors in single precision
+ (SSE version of colordifference() is always single precision). See "Compiling and Linking" in MANUAL.md.
+ */
+#ifndef USE_FLOAT_MATH
+#  define USE_FLOAT_MATH 0
+#endif
+
+#if USE_FLOAT_MATH
+typedef float precise_float;
+#else
+typedef double precise_float;
+#endif
+
 #ifndef USE_SSE
 #  if defined(__SSE__) && (defined(WIN32) || defined(__WIN32__))
 #    define USE_SSE 1
@@ -135,12 +149,45 @@ inline static rgba_pixel to_rgb(const float gamma, const f_pixel px)
     };
 }
 
-ALWAYS_INLINE static double colordifference_ch(const double x, const double y, const double alphas);
-inline static double colordifference_ch(const double x, const double y, const double alphas)
+LIQ_PRIVATE void to_rgb_set_gamma(float rgb_lut[], const double gamma);
+
+/**
+ Finds channel value in table of thresholds made by to_rgb_set_gamma() (binary search)
+ */
+inline static unsigned char to_rgb_channel(const float rgb_lut[], const float value)
+{
+    unsigned int i = 0;
+    for(unsigned int step = 128; step; step >>= 1) {
+        if (value >= rgb_lut[i + step]) i += step;
+    }
+    return i;
+}
+
+/**
+ Same as to_rgb(), but without powf(). Table gives the same rounding as to_rgb().
+ */
+inline static rgba_pixel to_rgb_lut(const float rgb_lut[], const f_pixel px)
+{
+    if (px.a < 1.f/256.f) {
+        return (rgba_pixel){0,0,0,0};
+    }
+
+    const float a = px.a * 256.f;
+
+    return (rgba_pixel){
+        .r = to_rgb_channel(rgb_lut, px.r / px.a),
+        .g = to_rgb_channel(rgb_lut, px.g / px.a),
+        .b = to_rgb_channel(rgb_lut, px.b / px.a),
+        .a = a>=255.f ? 255 : a,
+    };
+}
+
+ALWAYS_INLINE static precise_float colordifference_ch(const precise_float x, const precise_float y, const precise_float alphas);
+inline static precise_float colordifference_ch(const precise_float x, const precise_float y, const precise_float alphas)
 {
     // maximum of channel blended on white, and blended on black
     // premultiplied alpha and backgrounds 0/1 shorten the formula
-    const double black = x-y, white = black+alphas;
+    const precise_float black = x-y, white = black+alphas;
     return black*black + white*white;
 }
 
@@ -160,16 +207,16 @@ inline static float colordifference_stdc(const f_pixel px, const f_pixel py)
     // (px.rgb - px.a) - (py.rgb - py.a)
     // (px.rgb - py.rgb) + (py.a - px.a)
 
-    const double alphas = py.a-px.a;
+    const precise_float alphas = py.a-px.a;
     return colordifference_ch(px.r, py.r, alphas) +
            colordifference_ch(px.g, py.g, alphas) +
            colordifference_ch(px.b, py.b, alphas);
 }
 
-ALWAYS_INLINE static double min_colordifference_ch(const double x, const double y, const double alphas);
-inline static double min_colordifference_ch(const double x, const double y, const double alphas)
+ALWAYS_INLINE static precise_float min_colordifference_ch(const precise_float x, const precise_float y, const precise_float alphas);
+inline static precise_float min_colordifference_ch(const precise_float x, const precise_float y, const precise_float alphas)
 {
-    const double black = x-y, white = black+alphas;
+    const precise_float black = x-y, white = black+alphas;
     return MIN(black*black , white*white) * 2.f;
 }
 
@@ -177,7 +224,7 @@ inline static double min_colordifference_ch(const double x, const double y, cons
 ALWAYS_INLINE static float min_colordifference(const f_pixel px, const f_pixel py);
 inline static float min_colordifference(const f_pixel px, const f_pixel py)
 {
-    const double alphas = py.a-px.a;
+    const precise_float alphas = py.a-px.a;
     return min_colordifference_ch(px.r, py.r, alphas) +
            min_colordifference_ch(px.g, py.g, alphas) +
            min_colordifference_ch(px.b, py.b, alphas);
@@ -249,7 +296,6 @@ typedef struct colormap {
     unsigned int colors;
     void* (*malloc)(size_t);
     void (*free)(void*);
-    struct colormap *subset_palette;
     colormap_item palette[];
 } colormap;
 
@@ -268,7 +314,7 @@ struct acolorhist_arr_head {
 };
 
 struct acolorhash_table {
-    struct mempool *mempool;
+    struct mempool *mempool, **pool; // pool is either &mempool or the arena the table was allocated from
     unsigned int ignorebits, maxcolors, colors, cols, rows;
     unsigned int hash_size;
     unsigned int freestackp;
@@ -277,8 +323,8 @@ struct acolorhash_table {
 };
 
 LIQ_PRIVATE void pam_freeacolorhash(struct acolorhash_table *acht);
-LIQ_PRIVATE struct acolorhash_table *pam_allocacolorhash(unsigned int maxcolors, unsigned int surface, unsigned int ignorebits, void* (*malloc)(size_t), void (*free)(void*));
-LIQ_PRIVATE histogram *pam_acolorhashtoacolorhist(const struct acolorhash_table *acht, const double gamma, void* (*malloc)(size_t), void (*free)(void*));
+LIQ_PRIVATE struct acolorhash_table *pam_allocacolorhash(unsigned int maxcolors, unsigned int surface, unsigned int ignorebits, struct mempool **arena, void* (*malloc)(size_t), void (*free)(void*));
+LIQ_PRIVATE histogram *pam_acolorhashtoacolorhist(const struct acolorhash_table *acht, const double gamma, struct mempool **arena, void* (*malloc)(size_t), void (*free)(void*));
 LIQ_PRIVATE bool pam_computeacolorhash(struct acolorhash_table *acht, const rgba_pixel *const pixels[], unsigned int cols, unsigned int rows, const unsigned char *importance_map);
 
 LIQ_PRIVATE void pam_freeacolorhist(histogram *h);
@@ -0,0 +1,102 @@
+/*
+ Compares liq_blur() with the row at a time version it replaced, which is copied below,
+ for square images up to 4096x4096 with the radius used by contrast_maps().
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../libimagequant.h"
+#include "../pam.h"
+#include "../blur.h"
+#include "../threadpool.h"
+
+static void old_transposing_1d_blur(unsigned char *restrict src, unsigned char *restrict dst, unsigned int width, unsigned int height, const unsigned int size)
+{
+    for(unsigned int j=0; j < height; j++) {
+        unsigned char *restrict row = src + j*width;
+
+        // accumulate sum for pixels outside line
+        unsigned int sum;
+        sum = row[0]*size;
+        for(unsigned int i=0; i < size; i++) {
+            sum += row[i];
+        }
+
+        // blur with left side outside line
+        for(unsigned int i=0; i < size; i++) {
+            sum -= row[0];
+            sum += row[i+size];
+
+            dst[i*height + j] = sum / (size*2);
+        }
+
+        for(unsigned int i=size; i < width-size; i++) {
+            sum -= row[i-size];
+            sum += row[i+size];
+
+            dst[i*height + j] = sum / (size*2);
+        }
+
+        // blur with right side outside line
+        for(unsigned int i=width-size; i < width; i++) {
+            sum -= row[i-size];
+            sum += row[width-1];
+
+            dst[i*height + j] = sum / (size*2);
+        }
+    }
+}
+
+static void old_liq_blur(unsigned char *src, unsigned char *tmp, unsigned char *dst, unsigned int width, unsigned int height, unsigned int size)
+{
+    if (width < 2*size+1 || height < 2*size+1) {
+        return;
+    }
+    old_transposing_1d_blur(src, tmp, width, height, size);
+    old_transposing_1d_blur(tmp, dst, height, width, size);
+}
+
+int main(void)
+{
+    static const unsigned int sizes[] = {64, 256, 1024, 4096};
+    const unsigned int radius = 3;
+    liq_thread_pool *pool = liq_thread_pool_create(0);
+    const unsigned int threads = liq_thread_count(pool, ~0u);
+    bool differs = false;
+
+    printf("blur: %u threads\n", threads);
+    for(unsigned int s=0; s < sizeof(sizes)/sizeof(sizes[0]); s++) {
+        const unsigned int width = sizes[s], height = sizes[s], pixels = width*height;
+        unsigned char *src = malloc(pixels), *tmp = malloc(pixels), *old_dst = malloc(pixels), *dst = malloc(pixels);
+        unsigned int seed = s + 1;
+        for(unsigned int i=0; i < pixels; i++) {
+            seed = seed * 1103515245u + 12345u;
+            src[i] = seed >> 24;
+        }
+
+        // about 256M pixels blurred for each size
+        const unsigned int rounds = MAX(1, (1u << 28) / pixels);
+        double start = liq_time_ms();
+        for(unsigned int r=0; r < rounds; r++) old_liq_blur(src, tmp, old_dst, width, height, radius);
+        const double old_ms = (liq_time_ms() - start) / rounds;
+
+        start = liq_time_ms();
+        for(unsigned int r=0; r < rounds; r++) liq_blur(src, tmp, dst, width, height, radius, NULL, 1);
+        const double new_ms = (liq_time_ms() - start) / rounds;
+        const bool same = !memcmp(old_dst, dst, pixels);
+
+        start = liq_time_ms();
+        for(unsigned int r=0; r < rounds; r++) liq_blur(src, tmp, dst, width, height, radius, pool, threads);
+        const double threaded_ms = (liq_time_ms() - start) / rounds;
+
+        printf("blur: %4ux%-4u old %8.3fms, new %8.3fms (%.1fx), on the thread pool %8.3fms (%.1fx)%s\n",
+               width, height, old_ms, new_ms, old_ms / new_ms, threaded_ms, old_ms / threaded_ms,
+               same && !memcmp(old_dst, dst, pixels) ? "" : ", OUTPUT DIFFERS");
+        differs |= !same || memcmp(old_dst, dst, pixels);
+
+        free(src); free(tmp); free(old_dst); free(dst);
+    }
+
+    liq_thread_pool_destroy(pool);
+    return differs ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,162 @@
+/*
+ Built twice, with USE_FLOAT_MATH=0 and 1. Checks the relative error of single precision color differences,
+ and prints quantization errors of a set of generated images. With --compare it reads the errors printed
+ by the other build from stdin and checks that they differ by less than the bounds stated in MANUAL.md.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "../libimagequant.h"
+#include "../pam.h"
+
+#define IMAGES 8
+#define MAX_IMAGE_CHANGE 0.03 // relative change of quantization error of any image
+#define MAX_MEAN_CHANGE 0.01 // average of the relative changes
+#define MAX_DIFFERENCE_ERROR 4e-7 // relative error of colordifference_stdc()
+
+static unsigned int seed = 1;
+
+static unsigned int next_random(void)
+{
+    seed = seed * 1103515245u + 12345u;
+    return seed >> 16;
+}
+
+static float random_unit(void)
+{
+    return (next_random() & 0xFFFF) / 65535.f;
+}
+
+static double colordifference_double(const f_pixel px, const f_pixel py)
+{
+    const double alphas = (double)py.a - px.a;
+    double sum = 0;
+    const float x[3] = {px.r, px.g, px.b}, y[3] = {py.r, py.g, py.b};
+    for(unsigned int i=0; i < 3; i++) {
+        const double black = (double)x[i] - y[i], white = black + alphas;
+        sum += black*black + white*white;
+    }
+    return sum;
+}
+
+static f_pixel random_f_pixel(void)
+{
+    const float a = random_unit();
+    return (f_pixel){.a = a, .r = a * random_unit(), .g = a * random_unit(), .b = a * random_unit()};
+}
+
+static unsigned int check_colordifference(FILE *log)
+{
+    double max_error = 0;
+    for(unsigned int i=0; i < 1000000; i++) {
+        const f_pixel px = random_f_pixel();
+        // close colors too, as compared by the palette search
+        f_pixel py = random_f_pixel();
+        if (i & 1) {
+            py = (f_pixel){.a = px.a + py.a/256.f, .r = px.r + py.r/256.f, .g = px.g, .b = px.b - py.b/256.f};
+        }
+        const double exact = colordifference_double(px, py);
+        if (exact > 0) {
+            max_error = MAX(max_error, fabs(colordifference_stdc(px, py) - exact) / exact);
+        }
+    }
+    fprintf(log, "float_math: colordifference relative error %.2g\n", max_error);
+    if (max_error >= MAX_DIFFERENCE_ERROR) {
+        fprintf(stderr, "float_math: colordifference relative error %.2g exceeds %.2g\n", max_error, MAX_DIFFERENCE_ERROR);
+        return 1;
+    }
+    return 0;
+}
+
+// Gradients, noise, flat areas with antialiased edges, and translucency, in different mixes
+static void generate_image(unsigned int n, rgba_pixel *pixels, unsigned int width, unsigned int height)
+{
+    seed = n + 1;
+    const unsigned int noise = (n & 3) * 24, shapes = 1 + n*3;
+    for(unsigned int y=0; y < height; y++) {
+        for(unsigned int x=0; x < width; x++) {
+            const unsigned int r = x*255/width, g = y*255/height, b = (x+y)*255/(width+height);
+            pixels[y*width + x] = (rgba_pixel){
+                .r = MIN(255, r + next_random() % (noise+1)),
+                .g = MIN(255, g + next_random() % (noise+1)),
+                .b = MIN(255, b + next_random() % (noise+1)),
+                .a = n & 4 ? 255 - (x+y)*200/(width+height) : 255,
+            };
+        }
+    }
+    for(unsigned int s=0; s < shapes; s++) {
+        const float cx = random_unit() * width, cy = random_unit() * height, radius = 4 + random_unit() * width/4;
+        const rgba_pixel color = {next_random(), next_random(), next_random(), 128 + next_random() % 128};
+        for(unsigned int y=0; y < height; y++) {
+            for(unsigned int x=0; x < width; x++) {
+                const float coverage = radius - hypotf(x - cx, y - cy);
+                if (coverage > 0) {
+                    const float c = MIN(1.f, coverage);
+                    rgba_pixel *px = &pixels[y*width + x];
+                    px->r = px->r + (color.r - px->r) * c;
+                    px->g = px->g + (color.g - px->g) * c;
+                    px->b = px->b + (color.b - px->b) * c;
+                    px->a = px->a + (color.a - px->a) * c;
+                }
+            }
+        }
+    }
+}
+
+static double quantization_error(unsigned int n)
+{
+    const unsigned int width = 256, height = 256;
+    rgba_pixel *pixels = malloc(width * height * sizeof(pixels[0]));
+    generate_image(n, pixels, width, height);
+
+    liq_attr *attr = liq_attr_create();
+    liq_set_max_colors(attr, n & 1 ? 256 : 32);
+    liq_image *image = liq_image_create_rgba(attr, pixels, width, height, 0);
+    liq_result *result = liq_quantize_image(attr, image);
+    const double error = result ? liq_get_quantization_error(result) : -1;
+
+    liq_result_destroy(result);
+    liq_image_destroy(image);
+    liq_attr_destroy(attr);
+    free(pixels);
+    return error;
+}
+
+int main(int argc, char *argv[])
+{
+    const bool compare = argc > 1 && !strcmp(argv[1], "--compare");
+    // the errors printed without --compare are piped to the other build
+    unsigned int errors = check_colordifference(compare ? stdout : stderr);
+    double sum_change = 0, max_change = 0;
+
+    for(unsigned int n=0; n < IMAGES; n++) {
+        const double error = quantization_error(n);
+        if (!compare) {
+            printf("%u %.6f\n", n, error);
+            continue;
+        }
+
+        unsigned int other_n;
+        double other_error;
+        if (scanf("%u %lf", &other_n, &other_error) != 2 || other_n != n || other_error <= 0 || error <= 0) {
+            fprintf(stderr, "float_math: no quantization error of image %u to compare with\n", n);
+            return EXIT_FAILURE;
+        }
+        const double change = (error - other_error) / other_error;
+        printf("float_math: image %u quantization error %.3f, %+.2f%%\n", n, error, change * 100.0);
+        sum_change += change;
+        max_change = MAX(max_change, fabs(change));
+    }
+
+    if (compare) {
+        const double mean_change = sum_change / IMAGES;
+        printf("float_math: mean change %+.2f%%\n", mean_change * 100.0);
+        if (max_change >= MAX_IMAGE_CHANGE || fabs(mean_change) >= MAX_MEAN_CHANGE) {
+            fprintf(stderr, "float_math: quantization error changed by more than %.0f%% per image or %.0f%% on average\n",
+                    MAX_IMAGE_CHANGE * 100.0, MAX_MEAN_CHANGE * 100.0);
+            errors++;
+        }
+    }
+    return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
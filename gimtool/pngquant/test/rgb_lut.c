@@ -0,0 +1,67 @@
+/*
+ Checks that to_rgb_lut() rounds palette colors exactly like to_rgb() does with powf()
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "../libimagequant.h"
+#include "../pam.h"
+
+static int check_pixel(const float gamma, const float rgb_lut[], const f_pixel px)
+{
+    const rgba_pixel lut = to_rgb_lut(rgb_lut, px);
+    const rgba_pixel exact = to_rgb(gamma, px);
+    if (lut.r != exact.r || lut.g != exact.g || lut.b != exact.b || lut.a != exact.a) {
+        fprintf(stderr, "gamma %f, pixel %.9g %.9g %.9g %.9g: table gives %u %u %u %u, powf gives %u %u %u %u\n",
+                gamma, px.a, px.r, px.g, px.b, lut.r, lut.g, lut.b, lut.a, exact.r, exact.g, exact.b, exact.a);
+        return 1;
+    }
+    return 0;
+}
+
+int main(void)
+{
+    static const double gammas[] = {0.45455, 1/2.2, 0.5, 0.5499, 0.4, 0.3, 0.7, 1.0};
+    float gamma_lut[256], rgb_lut[256];
+    unsigned int errors = 0;
+
+    for(unsigned int g=0; g < sizeof(gammas)/sizeof(gammas[0]); g++) {
+        to_f_set_gamma(gamma_lut, gammas[g]);
+        to_rgb_set_gamma(rgb_lut, gammas[g]);
+
+        // every 8-bit color converted back
+        for(unsigned int a=0; a < 256; a++) {
+            for(unsigned int v=0; v < 256; v++) {
+                errors += check_pixel(gammas[g], rgb_lut, to_f(gamma_lut, (rgba_pixel){v, 255-v, v^0x55, a}));
+            }
+        }
+
+        // values next to the thresholds of the table
+        for(unsigned int i=1; i < 256; i++) {
+            const float t = rgb_lut[i];
+            const float below = nextafterf(t, 0), above = nextafterf(t, 2.f);
+            errors += check_pixel(gammas[g], rgb_lut, (f_pixel){.a = 1.f, .r = below, .g = t, .b = above});
+        }
+
+        // averages of colors, as made by palette search
+        srand(g);
+        for(unsigned int i=0; i < 1000000; i++) {
+            const float a = (rand() % 65536 + 256) / 65792.f;
+            errors += check_pixel(gammas[g], rgb_lut, (f_pixel){
+                .a = a,
+                .r = a * rand() / RAND_MAX,
+                .g = a * rand() / RAND_MAX,
+                .b = a * rand() / RAND_MAX,
+            });
+        }
+
+        if (errors) break;
+    }
+
+    if (errors) {
+        fprintf(stderr, "rgb_lut: %u colors rounded differently\n", errors);
+        return EXIT_FAILURE;
+    }
+    printf("rgb_lut: ok\n");
+    return EXIT_SUCCESS;
+}
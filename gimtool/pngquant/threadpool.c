@@ -0,0 +1,320 @@
+/*
+ Minimal pool of worker threads. Work is split into as many contiguous chunks as threads,
+ and the calling thread processes the first chunk itself, so results depend only on number of threads.
+ */
+
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "libimagequant.h"
+#include "threadpool.h"
+
+#ifdef _WIN32
+/* condition variables are declared only for Windows Vista and later */
+#if !defined(_WIN32_WINNT) || _WIN32_WINNT < 0x0600
+#undef _WIN32_WINNT
+#define _WIN32_WINNT 0x0600
+#endif
+#include <windows.h>
+
+typedef HANDLE liq_thread;
+typedef CRITICAL_SECTION liq_mutex;
+typedef CONDITION_VARIABLE liq_cond;
+#define liq_mutex_init(m) InitializeCriticalSection(m)
+#define liq_mutex_destroy(m) DeleteCriticalSection(m)
+#define liq_mutex_lock(m) EnterCriticalSection(m)
+#define liq_mutex_unlock(m) LeaveCriticalSection(m)
+#define liq_cond_init(c) InitializeConditionVariable(c)
+#define liq_cond_destroy(c)
+#define liq_cond_wait(c, m) SleepConditionVariableCS(c, m, INFINITE)
+#define liq_cond_broadcast(c) WakeAllConditionVariable(c)
+#define liq_cond_signal(c) WakeConditionVariable(c)
+#else
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+
+typedef pthread_t liq_thread;
+typedef pthread_mutex_t liq_mutex;
+typedef pthread_cond_t liq_cond;
+#define liq_mutex_init(m) pthread_mutex_init(m, NULL)
+#define liq_mutex_destroy(m) pthread_mutex_destroy(m)
+#define liq_mutex_lock(m) pthread_mutex_lock(m)
+#define liq_mutex_unlock(m) pthread_mutex_unlock(m)
+#define liq_cond_init(c) pthread_cond_init(c, NULL)
+#define liq_cond_destroy(c) pthread_cond_destroy(c)
+#define liq_cond_wait(c, m) pthread_cond_wait(c, m)
+#define liq_cond_broadcast(c) pthread_cond_broadcast(c)
+#define liq_cond_signal(c) pthread_cond_signal(c)
+#endif
+
+struct liq_job {
+    liq_parallel_function *function;
+    void *context;
+    unsigned int tasks, threads;
+};
+
+struct liq_worker {
+    liq_thread_pool *pool;
+    unsigned int index;
+    liq_thread thread;
+};
+
+struct liq_thread_pool {
+    void (*free)(void*);
+    liq_mutex lock;
+    liq_cond wake, done;
+    struct liq_job job;
+    unsigned int generation; // incremented for each job, so workers know there is a new one
+    unsigned int pending;    // workers that haven't finished current job
+    unsigned int refcount;
+    bool busy, stop;
+    unsigned int threads;    // including the thread calling liq_parallel_for()
+    struct liq_worker workers[];
+};
+
+static void liq_job_run_chunk(const struct liq_job *job, const unsigned int thread)
+{
+    const unsigned int start = (unsigned long long)job->tasks * thread / job->threads;
+    const unsigned int end = (unsigned long long)job->tasks * (thread+1) / job->threads;
+    if (start < end) {
+        job->function(job->context, start, end, thread);
+    }
+}
+
+static void liq_worker_main(struct liq_worker *worker)
+{
+    liq_thread_pool *pool = worker->pool;
+    unsigned int seen_generation = 0;
+
+    liq_mutex_lock(&pool->lock);
+    for(;;) {
+        while (!pool->stop && pool->generation == seen_generation) {
+            liq_cond_wait(&pool->wake, &pool->lock);
+        }
+        if (pool->stop) break;
+
+        seen_generation = pool->generation;
+        if (worker->index < pool->job.threads) {
+            const struct liq_job job = pool->job;
+            liq_mutex_unlock(&pool->lock);
+
+            liq_job_run_chunk(&job, worker->index);
+
+            liq_mutex_lock(&pool->lock);
+            if (!--pool->pending) {
+                liq_cond_signal(&pool->done);
+            }
+        }
+    }
+    liq_mutex_unlock(&pool->lock);
+}
+
+#ifdef _WIN32
+static DWORD WINAPI liq_worker_thread(LPVOID worker)
+{
+    liq_worker_main(worker);
+    return 0;
+}
+
+static bool liq_thread_start(struct liq_worker *worker)
+{
+    worker->thread = CreateThread(NULL, 0, liq_worker_thread, worker, 0, NULL);
+    return worker->thread != NULL;
+}
+
+static void liq_thread_join(struct liq_worker *worker)
+{
+    WaitForSingleObject(worker->thread, INFINITE);
+    CloseHandle(worker->thread);
+}
+#else
+static void *liq_worker_thread(void *worker)
+{
+    liq_worker_main(worker);
+    return NULL;
+}
+
+static bool liq_thread_start(struct liq_worker *worker)
+{
+    return 0 == pthread_create(&worker->thread, NULL, liq_worker_thread, worker);
+}
+
+static void liq_thread_join(struct liq_worker *worker)
+{
+    pthread_join(worker->thread, NULL);
+}
+#endif
+
+static void liq_thread_pool_stop(liq_thread_pool *pool, unsigned int started)
+{
+    liq_mutex_lock(&pool->lock);
+    pool->stop = true;
+    liq_cond_broadcast(&pool->wake);
+    liq_mutex_unlock(&pool->lock);
+
+    for(unsigned int i=1; i < started; i++) {
+        liq_thread_join(&pool->workers[i]);
+    }
+
+    liq_cond_destroy(&pool->done);
+    liq_cond_destroy(&pool->wake);
+    liq_mutex_destroy(&pool->lock);
+    pool->free(pool);
+}
+
+LIQ_PRIVATE liq_thread_pool *liq_thread_pool_create_internal(unsigned int threads, void* (*malloc)(size_t), void (*free)(void*))
+{
+    if (threads < 1 || threads > LIQ_MAX_THREADS) {
+        return NULL;
+    }
+
+    liq_thread_pool *pool = malloc(sizeof(liq_thread_pool) + threads * sizeof(pool->workers[0]));
+    if (!pool) return NULL;
+    *pool = (liq_thread_pool){
+        .free = free,
+        .refcount = 1,
+        .threads = threads,
+    };
+
+    liq_mutex_init(&pool->lock);
+    liq_cond_init(&pool->wake);
+    liq_cond_init(&pool->done);
+
+    // workers[0] is unused, as it's the thread calling liq_parallel_for()
+    for(unsigned int i=1; i < threads; i++) {
+        pool->workers[i] = (struct liq_worker){
+            .pool = pool,
+            .index = i,
+        };
+        if (!liq_thread_start(&pool->workers[i])) {
+            liq_thread_pool_stop(pool, i);
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+LIQ_EXPORT liq_thread_pool *liq_thread_pool_create(int threads)
+{
+    return liq_thread_pool_create_internal(threads > 0 ? threads : liq_cpu_count(), malloc, free);
+}
+
+LIQ_PRIVATE liq_thread_pool *liq_thread_pool_retain(liq_thread_pool *pool)
+{
+    if (pool) {
+        liq_mutex_lock(&pool->lock);
+        pool->refcount++;
+        liq_mutex_unlock(&pool->lock);
+    }
+    return pool;
+}
+
+LIQ_PRIVATE void liq_thread_pool_release(liq_thread_pool *pool)
+{
+    if (!pool) return;
+
+    liq_mutex_lock(&pool->lock);
+    const bool last = !--pool->refcount;
+    liq_mutex_unlock(&pool->lock);
+
+    if (last) {
+        liq_thread_pool_stop(pool, pool->threads);
+    }
+}
+
+/*
+ Pool is destroyed when all liq_attr and liq_result objects using it are destroyed too
+ */
+LIQ_EXPORT void liq_thread_pool_destroy(liq_thread_pool *pool)
+{
+    liq_thread_pool_release(pool);
+}
+
+/*
+ Number of threads liq_parallel_for() can use, so that per-thread buffers can be allocated for them
+ */
+LIQ_PRIVATE unsigned int liq_thread_count(const liq_thread_pool *pool, unsigned int max_threads)
+{
+    if (!pool || max_threads < 1) return 1;
+    return max_threads < pool->threads ? max_threads : pool->threads;
+}
+
+/*
+ Splits tasks into given number of chunks and calls the function for each chunk from a different thread.
+ If the pool is busy with work for another caller, all chunks are processed by the calling thread instead.
+ Results are the same either way.
+ */
+LIQ_PRIVATE void liq_parallel_for(liq_thread_pool *pool, unsigned int threads, unsigned int tasks, liq_parallel_function *function, void *context)
+{
+    const struct liq_job job = {
+        .function = function,
+        .context = context,
+        .tasks = tasks,
+        .threads = threads > 0 ? threads : 1,
+    };
+
+    bool use_pool = false;
+    if (pool && job.threads > 1 && job.threads <= pool->threads) {
+        liq_mutex_lock(&pool->lock);
+        if (!pool->busy) {
+            use_pool = pool->busy = true;
+            pool->job = job;
+            pool->pending = job.threads-1;
+            pool->generation++;
+            liq_cond_broadcast(&pool->wake);
+        }
+        liq_mutex_unlock(&pool->lock);
+    }
+
+    if (!use_pool) {
+        for(unsigned int i=0; i < job.threads; i++) {
+            liq_job_run_chunk(&job, i);
+        }
+        return;
+    }
+
+    liq_job_run_chunk(&job, 0);
+
+    liq_mutex_lock(&pool->lock);
+    while (pool->pending) {
+        liq_cond_wait(&pool->done, &pool->lock);
+    }
+    pool->busy = false;
+    liq_mutex_unlock(&pool->lock);
+}
+
+LIQ_PRIVATE unsigned int liq_cpu_count(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    const long count = info.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+    const long count = sysconf(_SC_NPROCESSORS_ONLN);
+#else
+    const long count = 1;
+#endif
+    return count < 1 ? 1 : (count > LIQ_MAX_THREADS ? LIQ_MAX_THREADS : count);
+}
+
+/*
+ Monotonic clock for time limits, in milliseconds from an arbitrary point
+ */
+LIQ_PRIVATE double liq_time_ms(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER counter, frequency;
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    return counter.QuadPart * 1000.0 / frequency.QuadPart;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+#endif
+}
@@ -0,0 +1,21 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+// library never uses more threads than that, as some buffers are allocated per thread
+#define LIQ_MAX_THREADS 64
+
+/*
+ Processes tasks from start to end (exclusive). Thread is index of the calling thread,
+ always less than number of threads given to liq_parallel_for(), so it can be used to pick per-thread buffers.
+ */
+typedef void liq_parallel_function(void *context, unsigned int start, unsigned int end, unsigned int thread);
+
+LIQ_PRIVATE liq_thread_pool *liq_thread_pool_create_internal(unsigned int threads, void* (*malloc)(size_t), void (*free)(void*));
+LIQ_PRIVATE liq_thread_pool *liq_thread_pool_retain(liq_thread_pool *pool);
+LIQ_PRIVATE void liq_thread_pool_release(liq_thread_pool *pool);
+LIQ_PRIVATE unsigned int liq_thread_count(const liq_thread_pool *pool, unsigned int max_threads);
+LIQ_PRIVATE void liq_parallel_for(liq_thread_pool *pool, unsigned int threads, unsigned int tasks, liq_parallel_function *function, void *context);
+LIQ_PRIVATE unsigned int liq_cpu_count(void);
+LIQ_PRIVATE double liq_time_ms(void);
+
+#endif
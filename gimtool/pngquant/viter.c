@@ -3,16 +3,11 @@
 #include "pam.h"
 #include "viter.h"
 #include "nearest.h"
+#include "threadpool.h"
+#include "mempool.h"
 #include <stdlib.h>
 #include <string.h>
 
-#ifdef _OPENMP
-#include <omp.h>
-#else
-#define omp_get_max_threads() 1
-#define omp_get_thread_num() 0
-#endif
-
 /*
  * Voronoi iteration: new palette color is computed from weighted average of colors that map to that palette entry.
  */
@@ -59,27 +54,146 @@ LIQ_PRIVATE void viter_finalize(colormap *map, const unsigned int max_threads, c
     }
 }
 
-LIQ_PRIVATE double viter_do_iteration(histogram *hist, colormap *const map, const float min_opaque_val, viter_callback callback, const bool fast_palette)
+/*
+ Arrays have to be filled with viter_histogram_update() before use.
+ If arena is given, they are allocated from it and viter_histogram_free() doesn't release any memory.
+ */
+LIQ_PRIVATE viter_histogram *viter_histogram_create(const histogram *hist, mempool *arena, void* (*malloc)(size_t), void (*free)(void*))
 {
-    const unsigned int max_threads = omp_get_max_threads();
-    viter_state average_color[(VITER_CACHE_LINE_GAP+map->colors) * max_threads];
-    viter_init(map, max_threads, average_color);
-    struct nearest_map *const n = nearest_init(map, fast_palette);
-    hist_item *const achv = hist->achv;
-    const int hist_size = hist->size;
+    const unsigned int colors_size = sizeof(f_pixel) * hist->size, floats_size = sizeof(float) * hist->size;
+    const unsigned int size = sizeof(viter_histogram) + 16 + colors_size + 2*floats_size + hist->size;
+    viter_histogram *vh = arena ? mempool_alloc(arena, size, size) : malloc(size);
+    if (!vh) return NULL;
+
+    // colors are aligned for SSE loads
+    char *const arrays = (char*)(((size_t)(vh + 1) + 15) & ~(size_t)15);
+    *vh = (viter_histogram){
+        .acolor = (f_pixel*)arrays,
+        .perceptual_weight = (float*)(arrays + colors_size),
+        .lower_bound = (float*)(arrays + colors_size + floats_size),
+        .likely_colormap_index = (unsigned char*)(arrays + colors_size + 2*floats_size),
+        .free = arena ? NULL : free,
+        .size = hist->size,
+    };
+    return vh;
+}
+
+/*
+ Copies histogram again after mediancut has reordered it
+ */
+LIQ_PRIVATE void viter_histogram_update(viter_histogram *vh, const histogram *hist)
+{
+    const hist_item *const achv = hist->achv;
+    vh->bounds_colors = 0; // bounds are in the old order
+    for(unsigned int j=0; j < vh->size; j++) {
+        vh->acolor[j] = achv[j].acolor;
+        vh->perceptual_weight[j] = achv[j].perceptual_weight;
+        vh->likely_colormap_index[j] = achv[j].tmp.likely_colormap_index;
+    }
+}
+
+LIQ_PRIVATE void viter_histogram_free(viter_histogram *vh)
+{
+    if (vh && vh->free) vh->free(vh);
+}
+
+struct viter_job {
+    hist_item *achv;
+    const f_pixel *acolor;
+    const float *perceptual_weight;
+    unsigned char *likely_colormap_index;
+    float *lower_bound; // NULL if bounds aren't used
+    float moved_max, moved_second; // the largest and second largest move of palette colors
+    unsigned int moved_max_index;
+    colormap *map;
+    const struct nearest_map *n;
+    float min_opaque_val;
+    viter_callback callback;
+    viter_state *average_color;
+    double thread_diff[LIQ_MAX_THREADS];
+};
+
+static void viter_do_iteration_items(void *context, unsigned int start, unsigned int end, unsigned int thread)
+{
+    struct viter_job *job = context;
+    const f_pixel *const acolor = job->acolor;
+    const float *const perceptual_weight = job->perceptual_weight;
+    unsigned char *const likely_colormap_index = job->likely_colormap_index;
 
     double total_diff=0;
-    #pragma omp parallel for if (hist_size > 3000) \
-        schedule(static) default(none) shared(average_color,callback) reduction(+:total_diff)
-    for(int j=0; j < hist_size; j++) {
+    for(unsigned int j=start; j < end; j++) {
         float diff;
-        unsigned int match = nearest_search(n, achv[j].acolor, achv[j].tmp.likely_colormap_index, min_opaque_val, &diff);
-        achv[j].tmp.likely_colormap_index = match;
-        total_diff += diff * achv[j].perceptual_weight;
+        unsigned int match;
+        if (job->lower_bound && !(acolor[j].a > job->min_opaque_val)) { // colors with the IE penalty don't fit bounds
+            const unsigned int guess = likely_colormap_index[j];
+            const float other_colors_moved = guess == job->moved_max_index ? job->moved_second : job->moved_max;
+            match = nearest_search_bounded(job->n, acolor[j], guess, other_colors_moved, &job->lower_bound[j], &diff);
+        } else {
+            match = nearest_search(job->n, acolor[j], likely_colormap_index[j], job->min_opaque_val, &diff);
+            if (job->lower_bound) job->lower_bound[j] = -1;
+        }
+        likely_colormap_index[j] = match;
+        total_diff += diff * perceptual_weight[j];
+
+        viter_update_color(acolor[j], perceptual_weight[j], job->map, match, thread, job->average_color);
+
+        if (job->callback) job->callback(&job->achv[j], diff);
+    }
+    job->thread_diff[thread] = total_diff;
+}
+
+LIQ_PRIVATE double viter_do_iteration(histogram *hist, viter_histogram *vh, colormap *const map, const float min_opaque_val, viter_callback callback, struct mempool **arena, liq_thread_pool *pool, unsigned int threads)
+{
+    const unsigned int max_threads = hist->size > 3000 ? threads : 1;
+    viter_state average_color[(VITER_CACHE_LINE_GAP+map->colors) * max_threads];
+    viter_init(map, max_threads, average_color);
+    struct nearest_map *const n = nearest_init(map, arena);
 
-        viter_update_color(achv[j].acolor, achv[j].perceptual_weight, map, match, omp_get_thread_num(), average_color);
+    struct viter_job job = {
+        .achv = hist->achv,
+        .acolor = vh->acolor,
+        .perceptual_weight = vh->perceptual_weight,
+        .likely_colormap_index = vh->likely_colormap_index,
+        .lower_bound = vh->use_bounds ? vh->lower_bound : NULL,
+        .moved_max = MAX_DIFF,
+        .moved_second = MAX_DIFF,
+        .map = map,
+        .n = n,
+        .min_opaque_val = min_opaque_val,
+        .callback = callback,
+        .average_color = average_color,
+    };
 
-        if (callback) callback(&achv[j], diff);
+    if (vh->use_bounds && vh->bounds_colors == map->colors) {
+        job.moved_max = job.moved_second = 0;
+        for(unsigned int i=0; i < map->colors; i++) {
+            const float moved = sqrtf(colordifference(vh->bounds_palette[i], map->palette[i].acolor));
+            if (moved > job.moved_max) {
+                job.moved_second = job.moved_max;
+                job.moved_max = moved;
+                job.moved_max_index = i;
+            } else if (moved > job.moved_second) {
+                job.moved_second = moved;
+            }
+        }
+    } else if (vh->use_bounds) {
+        for(unsigned int j=0; j < vh->size; j++) {
+            vh->lower_bound[j] = -1; // unknown
+        }
+    }
+
+    liq_parallel_for(pool, max_threads, hist->size, viter_do_iteration_items, &job);
+
+    if (vh->use_bounds) {
+        for(unsigned int i=0; i < map->colors; i++) {
+            vh->bounds_palette[i] = map->palette[i].acolor;
+        }
+        vh->bounds_colors = map->colors;
+    }
+
+    double total_diff=0;
+    for(unsigned int t=0; t < max_threads; t++) {
+        total_diff += job.thread_diff[t];
     }
 
     nearest_free(n);
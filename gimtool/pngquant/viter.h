@@ -6,14 +6,34 @@
 #define VITER_CACHE_LINE_GAP ((64+sizeof(viter_state)-1)/sizeof(viter_state))
 
 typedef struct {
-    double a, r, g, b, total;
+    precise_float a, r, g, b, total;
 } viter_state;
 
 typedef void (*viter_callback)(hist_item *item, float diff);
 
+/*
+ Histogram fields used by Voronoi iteration, kept in separate arrays
+ so that iterations read only colors, weights and palette index guesses instead of whole hist_items.
+ */
+typedef struct {
+    f_pixel *acolor;
+    float *perceptual_weight;
+    unsigned char *likely_colormap_index;
+    float *lower_bound;           // see nearest_search_bounded()
+    void (*free)(void*);
+    unsigned int size;
+    bool use_bounds;              // skip searches for colors that couldn't have changed their match
+    unsigned int bounds_colors;   // number of colors in bounds_palette, 0 if lower_bound isn't valid
+    f_pixel bounds_palette[256];  // palette that lower_bound has been computed for
+} viter_histogram;
+
+LIQ_PRIVATE viter_histogram *viter_histogram_create(const histogram *hist, struct mempool **arena, void* (*malloc)(size_t), void (*free)(void*));
+LIQ_PRIVATE void viter_histogram_update(viter_histogram *vh, const histogram *hist);
+LIQ_PRIVATE void viter_histogram_free(viter_histogram *vh);
+
 LIQ_PRIVATE void viter_init(const colormap *map, const unsigned int max_threads, viter_state state[]);
 LIQ_PRIVATE void viter_update_color(const f_pixel acolor, const float value, const colormap *map, unsigned int match, const unsigned int thread, viter_state average_color[]);
 LIQ_PRIVATE void viter_finalize(colormap *map, const unsigned int max_threads, const viter_state state[]);
-LIQ_PRIVATE double viter_do_iteration(histogram *hist, colormap *const map, const float min_opaque_val, viter_callback callback, const bool fast_palette);
+LIQ_PRIVATE double viter_do_iteration(histogram *hist, viter_histogram *vh, colormap *const map, const float min_opaque_val, viter_callback callback, struct mempool **arena, liq_thread_pool *pool, unsigned int threads);
 
 #endif
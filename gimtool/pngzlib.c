@@ -0,0 +1,168 @@
+#include <stdlib.h>
+#include "pngzlib.h"
+
+#if defined(USE_LIBDEFLATE)
+#include <libdeflate.h>
+#elif defined(USE_ZLIB)
+#include <zlib.h>
+#endif
+
+// lodepng error codes returned by the hooks
+#define PNGZLIB_ALLOC_FAIL 83
+#define PNGZLIB_BAD_DATA 52
+
+#if defined(USE_LIBDEFLATE) || defined(USE_ZLIB)
+// The level of zlib and libdeflate matching lodepng_compress_settings_set_level's presets, which
+// set maxchainlength to zlib's limits and leave out lazy matching below level 4. Others compress at 6.
+static int pngzlib_level(const LodePNGCompressSettings *settings)
+{
+	unsigned chain = settings->maxchainlength;
+	if(settings->btype == 0)
+		return 0;
+	if(settings->windowsize == 1)
+		return 1;
+	if(!settings->lazymatching)
+		return chain <= 4 ? 1 : chain <= 8 ? 2 : 3;
+	if(chain == 0)
+		return 6;
+	return chain <= 16 ? 4 : chain <= 32 ? 5 : chain <= 128 ? 6 : chain <= 256 ? 7 : chain <= 1024 ? 8 : 9;
+}
+#endif
+
+/*
+ Like lodepng's own zlib functions, the hooks append to *out, which holds *outsize bytes already
+ or is a buffer allocated ahead by the decoder. On errors *out stays valid for the caller to free.
+ */
+
+#if defined(USE_LIBDEFLATE)
+
+static unsigned pngzlib_compress(unsigned char **out, size_t *outsize, const unsigned char *in, size_t insize, const LodePNGCompressSettings *settings)
+{
+	// libdeflate has no run length only strategy, its level 1 is the fastest
+	struct libdeflate_compressor *compressor = libdeflate_alloc_compressor(pngzlib_level(settings));
+	if(!compressor)
+		return lodepng_zlib_compress(out, outsize, in, insize, settings);
+
+	size_t bound = libdeflate_zlib_compress_bound(compressor, insize);
+	unsigned char *buffer = realloc(*out, *outsize + bound);
+	size_t size = 0;
+	if(buffer)
+	{
+		*out = buffer;
+		size = libdeflate_zlib_compress(compressor, in, insize, buffer + *outsize, bound);
+	}
+	libdeflate_free_compressor(compressor);
+	if(!size)
+		return lodepng_zlib_compress(out, outsize, in, insize, settings);
+
+	*outsize += size;
+	return 0;
+}
+
+static unsigned pngzlib_decompress(unsigned char **out, size_t *outsize, const unsigned char *in, size_t insize, const LodePNGDecompressSettings *settings)
+{
+	struct libdeflate_decompressor *decompressor = libdeflate_alloc_decompressor();
+	if(!decompressor)
+		return lodepng_zlib_decompress(out, outsize, in, insize, settings);
+
+	// the decompressed size isn't known, retry with a twice as large buffer until it fits
+	size_t capacity = insize * 4 + 1024;
+	size_t size = 0;
+	enum libdeflate_result result = LIBDEFLATE_INSUFFICIENT_SPACE;
+	while(result == LIBDEFLATE_INSUFFICIENT_SPACE)
+	{
+		unsigned char *buffer = realloc(*out, *outsize + capacity);
+		if(!buffer)
+			break;
+		*out = buffer;
+		result = libdeflate_zlib_decompress(decompressor, in, insize, buffer + *outsize, capacity, &size);
+		capacity *= 2;
+	}
+	libdeflate_free_decompressor(decompressor);
+
+	if(result != LIBDEFLATE_SUCCESS)
+		return result == LIBDEFLATE_INSUFFICIENT_SPACE ? PNGZLIB_ALLOC_FAIL : PNGZLIB_BAD_DATA;
+
+	*outsize += size;
+	return 0;
+}
+
+#elif defined(USE_ZLIB)
+
+static unsigned pngzlib_compress(unsigned char **out, size_t *outsize, const unsigned char *in, size_t insize, const LodePNGCompressSettings *settings)
+{
+	// lodepng's speed first settings only encode runs, which is zlib's Z_RLE strategy
+	int strategy = settings->windowsize == 1 ? Z_RLE : Z_DEFAULT_STRATEGY;
+	z_stream stream = {0};
+	if(deflateInit2(&stream, pngzlib_level(settings), Z_DEFLATED, 15, 8, strategy) != Z_OK)
+		return lodepng_zlib_compress(out, outsize, in, insize, settings);
+
+	uLong bound = deflateBound(&stream, insize);
+	unsigned char *buffer = realloc(*out, *outsize + bound);
+	int result = Z_MEM_ERROR;
+	if(buffer)
+	{
+		*out = buffer;
+		stream.next_in = (Bytef *)in;
+		stream.avail_in = insize;
+		stream.next_out = buffer + *outsize;
+		stream.avail_out = bound;
+		result = deflate(&stream, Z_FINISH);
+	}
+	size_t size = stream.total_out;
+	deflateEnd(&stream);
+	if(result != Z_STREAM_END)
+		return lodepng_zlib_compress(out, outsize, in, insize, settings);
+
+	*outsize += size;
+	return 0;
+}
+
+static unsigned pngzlib_decompress(unsigned char **out, size_t *outsize, const unsigned char *in, size_t insize, const LodePNGDecompressSettings *settings)
+{
+	z_stream stream = {0};
+	if(inflateInit(&stream) != Z_OK)
+		return lodepng_zlib_decompress(out, outsize, in, insize, settings);
+
+	// the decompressed size isn't known, the buffer grows twice as large whenever it's full
+	size_t capacity = insize * 4 + 1024;
+	int result = Z_BUF_ERROR;
+	stream.next_in = (Bytef *)in;
+	stream.avail_in = insize;
+	while(result == Z_OK || result == Z_BUF_ERROR)
+	{
+		unsigned char *buffer = realloc(*out, *outsize + capacity);
+		if(!buffer)
+		{
+			result = Z_MEM_ERROR;
+			break;
+		}
+		*out = buffer;
+		stream.next_out = buffer + *outsize + stream.total_out;
+		stream.avail_out = capacity - stream.total_out;
+		result = inflate(&stream, Z_FINISH);
+		if(result == Z_BUF_ERROR && stream.avail_out != 0)
+			break; // input ended before the end of the stream
+		capacity *= 2;
+	}
+	size_t size = stream.total_out;
+	inflateEnd(&stream);
+
+	if(result != Z_STREAM_END)
+		return result == Z_MEM_ERROR ? PNGZLIB_ALLOC_FAIL : PNGZLIB_BAD_DATA;
+
+	*outsize += size;
+	return 0;
+}
+
+#endif
+
+void pngzlib_init(LodePNGState *state)
+{
+#if defined(USE_LIBDEFLATE) || defined(USE_ZLIB)
+	state->encoder.zlibsettings.custom_zlib = pngzlib_compress;
+	state->decoder.zlibsettings.custom_zlib = pngzlib_decompress;
+#else
+	(void)state;
+#endif
+}
@@ -0,0 +1,16 @@
+#ifndef PNGZLIB_H
+#define PNGZLIB_H
+
+#include "lodepng.h"
+
+/*
+ Build options selecting the zlib implementation lodepng uses for PNG files:
+ -DUSE_LIBDEFLATE links libdeflate (-ldeflate), -DUSE_ZLIB links zlib or zlib-ng
+ in zlib compatible mode (-lz). Without either, lodepng's own deflate is used.
+ The "Release libdeflate" and "Release zlib" targets of gim2png.cbp set them.
+ */
+
+// Sets the zlib hooks of the encoder and decoder settings of state to the selected library
+void pngzlib_init(LodePNGState *state);
+
+#endif
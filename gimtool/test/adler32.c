@@ -0,0 +1,74 @@
+/*
+Checks the SSSE3 and AVX2 Adler-32 of lodepng against the scalar loop, for every length up to a few blocks
+and for long inputs of 255 bytes, which come closest to overflowing the sums.
+*/
+
+#include "../lodepng.c"
+
+#include <string.h>
+
+#ifdef LODEPNG_X86_SIMD
+static unsigned check_adler32(const char* name, unsigned (*simd)(unsigned, const unsigned char*, unsigned),
+                              const unsigned char* data, unsigned size)
+{
+  unsigned errors = 0;
+  unsigned len, start;
+  for(len = 0; len <= 1000 && len <= size; len++)
+  {
+    for(start = 0; start < 2; start++)
+    {
+      unsigned adler = start ? 0xfff0fff0u : 1u;
+      if(simd(adler, data, len) != update_adler32_scalar(adler, data, len))
+      {
+        if(!errors) printf("adler32: %s differs for %u bytes\n", name, len);
+        errors++;
+      }
+    }
+  }
+  if(simd(1u, data, size) != update_adler32_scalar(1u, data, size))
+  {
+    printf("adler32: %s differs for %u bytes\n", name, size);
+    errors++;
+  }
+  return errors;
+}
+#endif /*LODEPNG_X86_SIMD*/
+
+int main(void)
+{
+  unsigned size = 1u << 20;
+  unsigned char* random = (unsigned char*)malloc(size);
+  unsigned char* ones = (unsigned char*)malloc(size);
+  unsigned errors = 0;
+  unsigned i, seed = 1;
+
+  for(i = 0; i < size; i++)
+  {
+    seed = seed * 1103515245u + 12345u;
+    random[i] = (unsigned char)(seed >> 24);
+  }
+  memset(ones, 255, size);
+
+#ifdef LODEPNG_X86_SIMD
+  if(__builtin_cpu_supports("ssse3"))
+  {
+    errors += check_adler32("SSSE3", update_adler32_ssse3, random, size);
+    errors += check_adler32("SSSE3", update_adler32_ssse3, ones, size);
+  }
+  else printf("adler32: SSSE3 not supported by the CPU, skipped\n");
+  if(__builtin_cpu_supports("avx2"))
+  {
+    errors += check_adler32("AVX2", update_adler32_avx2, random, size);
+    errors += check_adler32("AVX2", update_adler32_avx2, ones, size);
+  }
+  else printf("adler32: AVX2 not supported by the CPU, skipped\n");
+#else
+  printf("adler32: built without LODEPNG_X86_SIMD, nothing to check\n");
+#endif /*LODEPNG_X86_SIMD*/
+
+  free(random);
+  free(ones);
+  if(errors) return 1;
+  printf("adler32: ok\n");
+  return 0;
+}
@@ -0,0 +1,81 @@
+/*
+Checks lodepng_crc32 against the byte at a time loop and measures both, on inputs the size of PNG rows
+and IDAT chunks.
+*/
+
+#include "../lodepng.c"
+
+#include <string.h>
+#include <time.h>
+
+static unsigned crc32_bytewise(const unsigned char* buf, size_t len)
+{
+  unsigned c = 0xffffffffL;
+  while(len > 0)
+  {
+    c = lodepng_crc32_table[(c ^ *buf) & 0xff] ^ (c >> 8);
+    ++buf;
+    --len;
+  }
+  return c ^ 0xffffffffL;
+}
+
+/*megabytes per second of crc(buf, len) repeated for about 64 MB*/
+static double measure(unsigned (*crc)(const unsigned char*, size_t), const unsigned char* buf, size_t len)
+{
+  /*called through a volatile pointer, so repeated calls can't be merged*/
+  unsigned (*volatile call)(const unsigned char*, size_t) = crc;
+  size_t rounds = (64u << 20) / len, i;
+  unsigned sum = 0;
+  clock_t start = clock();
+  double seconds;
+  for(i = 0; i < rounds; i++) sum += call(buf, len);
+  seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+  if(sum == 1) printf(" ");
+  return seconds > 0 ? (double)rounds * len / seconds / (1 << 20) : 0;
+}
+
+int main(void)
+{
+  static const size_t sizes[] = {13, 64, 1000, 8192, 65536, 1u << 20};
+  size_t size = 1u << 20, len, i;
+  unsigned char* buf = (unsigned char*)malloc(size + 16);
+  unsigned errors = 0, seed = 1;
+
+  for(i = 0; i < size + 16; i++)
+  {
+    seed = seed * 1103515245u + 12345u;
+    buf[i] = (unsigned char)(seed >> 24);
+  }
+
+  /*every length up to a few blocks, at every alignment modulo 16*/
+  for(len = 0; len <= 300; len++)
+  {
+    for(i = 0; i < 16; i++)
+    {
+      if(lodepng_crc32(buf + i, len) != crc32_bytewise(buf + i, len))
+      {
+        if(!errors) printf("crc32: differs for %u bytes at offset %u\n", (unsigned)len, (unsigned)i);
+        errors++;
+      }
+    }
+  }
+  if(lodepng_crc32(buf, size) != crc32_bytewise(buf, size)) errors++;
+  if(lodepng_crc32((const unsigned char*)"IEND", 4) != 0xae426082u) errors++;
+  if(errors)
+  {
+    printf("crc32: %u lengths differ\n", errors);
+    free(buf);
+    return 1;
+  }
+  printf("crc32: ok\n");
+
+  for(i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+  {
+    printf("crc32: %7u bytes: %8.0f MB/s, byte at a time %6.0f MB/s\n", (unsigned)sizes[i],
+           measure(lodepng_crc32, buf, sizes[i]), measure(crc32_bytewise, buf, sizes[i]));
+  }
+
+  free(buf);
+  return 0;
+}